@@ -22,6 +22,10 @@ public:
   ArchiveDriver* getDriver(const char* path, bool create) {
     return new IsoDriver(path, create);
   }
+
+  ArchiveDriver* getDriver(const char* name, DataSource* source) {
+    return new IsoDriver(name, source);
+  }
 };
 
 extern "C" {
@@ -99,6 +103,71 @@ IsoDriver::IsoDriver(const char* _archive, bool create_archive)
   return;
 }
 
+/* Čtení obrazu ze zdroje dat
+ * - libisofs čte obraz po blocích (2048 B) funkcí read_block datového zdroje
+ * - zdroj dat vlastní FileSystem, IsoDataSource (alokovaný jako v libisofs
+ *   malloc, uvolní jej iso_data_source_unref) jej nemaže
+ */
+static int sourceOpen(IsoDataSource*) {
+  return 1;
+}
+
+static int sourceClose(IsoDataSource*) {
+  return 1;
+}
+
+static int sourceReadBlock(IsoDataSource* src, uint32_t lba, uint8_t* buffer) {
+  DataSource* source = reinterpret_cast<DataSource*>(src->data);
+  const size_t block = 2048;
+  if (source->read((char*)buffer, block, offset_t(lba) * block) != ssize_t(block))
+    return ISO_FILE_READ_ERROR;
+  return 1;
+}
+
+static void sourceFree(IsoDataSource*) {
+}
+
+IsoDriver::IsoDriver(const char* _name, DataSource* source)
+  : ArchiveDriver(_name),
+    iso_source(NULL),
+    iso_filesystem(NULL) {
+
+  pthread_mutex_init(&mutex, NULL);
+
+  IsoReadOpts* ropts;
+
+  iso_source = (IsoDataSource*)calloc(1, sizeof(IsoDataSource));
+  if (iso_source == NULL) {
+    pthread_mutex_destroy(&mutex);
+    throw ArchiveError();
+  }
+  iso_source->version = 0;
+  iso_source->refcount = 1;
+  iso_source->open = sourceOpen;
+  iso_source->close = sourceClose;
+  iso_source->read_block = sourceReadBlock;
+  iso_source->free_data = sourceFree;
+  iso_source->data = source;
+
+  if (iso_read_opts_new(&ropts, 0) < 0) {
+    iso_data_source_unref(iso_source);
+    pthread_mutex_destroy(&mutex);
+    throw ArchiveError();
+  }
+
+  if (iso_image_filesystem_new(iso_source, ropts, 1, &iso_filesystem) < 0) {
+    iso_data_source_unref(iso_source);
+    iso_read_opts_free(ropts);
+    pthread_mutex_destroy(&mutex);
+    throw ArchiveError();
+  }
+
+  iso_read_opts_free(ropts);
+
+  /* Zdroj dat drží iso_filesystem */
+  iso_data_source_unref(iso_source);
+}
+
 IsoDriver::~IsoDriver() {
   pthread_mutex_destroy(&mutex);
 
@@ -504,6 +573,7 @@ int IsoDriver::bufferStreamCloneStream(IsoStream *old_stream,
   BufferStream* old_s = reinterpret_cast<BufferStream*>(old_stream);
   BufferStream** new_s = reinterpret_cast<BufferStream**>(new_stream);
 
+  /* Kopie sdílí data bufferu (copy-on-write), nekopíruje je */
   Buffer* new_buf;
   try {
     new_buf = new Buffer(*(old_s->buffer));
@@ -38,11 +38,15 @@ public:
 class IsoDriver: public ArchiveDriver {
 public:
   IsoDriver(const char* _archive, bool create_archive);
+
+  /// Ovladač obrazu čteného ze zdroje dat (vnořený archiv), pouze pro čtení
+  IsoDriver(const char* _name, DataSource* source);
   ~IsoDriver();
 
   bool open(FileNode* node);
   int read(FileNode* node, char* buffer, size_t bytes, offset_t offset);
   void close(FileNode* node);
+  bool inflates(FileNode*) { return false; }
   bool saveArchive(FileMap* files, FileList* deleted);
 
   bool buildFileSystem(FileSystem* fs);
@@ -8,6 +8,7 @@
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
+#include <algorithm>
 #include <fcntl.h>
 #include <unistd.h>
 #include <zlib.h>
@@ -23,6 +24,10 @@ public:
   ArchiveDriver* getDriver(const char* path, bool create) {
     return new TarDriver(path, create);
   }
+
+  ArchiveDriver* getDriver(const char* name, DataSource* source) {
+    return new TarDriver(name, source);
+  }
 };
 
 class TarGzDriverFactory: public AbstractFactory {
@@ -30,6 +35,10 @@ public:
   ArchiveDriver* getDriver(const char* path, bool create) {
     return new TarDriver(path, create, TarDriver::GZIP);
   }
+
+  ArchiveDriver* getDriver(const char* name, DataSource* source) {
+    return new TarDriver(name, source, TarDriver::GZIP);
+  }
 };
 
 extern "C" {
@@ -46,9 +55,15 @@ extern "C" {
 }
 
 TarDriver::TarDriver(const char* _archive, bool create_archive, enum Compression _comp)
-  : ArchiveDriver(_archive) {
+  : ArchiveDriver(_archive),
+    data_source(NULL),
+    stream_pos(0),
+    tail(-1),
+    opens(0),
+    stash_bytes(0) {
 
   if (create_archive) throw ArchiveError();
+  pthread_mutex_init(&stream_mux, NULL);
 
   compression_used = _comp;
   switch (_comp) {
@@ -71,6 +86,7 @@ TarDriver::TarDriver(const char* _archive, bool create_archive, enum Compression
 
   if (tar_open(&tar_file, const_cast<char*>(_archive),
       (tartype_t*)&functions, O_RDONLY, 0644, TAR_VERBOSE) != 0) {
+    pthread_mutex_destroy(&stream_mux);
     throw ArchiveError();
   }
 
@@ -78,56 +94,398 @@ TarDriver::TarDriver(const char* _archive, bool create_archive, enum Compression
   return;
 }
 
+/* Čtení archivu ze zdroje dat
+ * - libtar čte funkcemi nad deskriptorem, zdroj dat je tedy zaregistrován
+ *   pod deskriptorem /dev/null (jedinečný, dokud není uzavřen) spolu
+ *   s pozicí čtení
+ * - zlib umí gzip číst jen z deskriptoru (gzdopen), komprimovaný zdroj je
+ *   proto dekomprimován vlastním proudem (SourceStream); pozice je jako
+ *   u gzseek v dekomprimovaných datech a posun vzad dekomprimuje proud
+ *   od začátku
+ */
+struct SourceStream {
+  z_stream strm;
+  offset_t in_pos;
+  /// Předchozí člen gzip skončil, chyba před prvními daty dalšího
+  /// člena znamená výplň za koncem proudu
+  bool member_end;
+  bool end;
+  unsigned char input[16384];
+};
+
+struct SourceCursor {
+  DataSource* source;
+  off_t pos;
+  /// Dekomprese zdroje gzip, jinak NULL
+  SourceStream* stream;
+};
+
+static map<int, SourceCursor> cursors;
+static pthread_mutex_t cursors_mux = PTHREAD_MUTEX_INITIALIZER;
+
+static bool streamReset(SourceStream* stream) {
+  stream->in_pos = 0;
+  stream->member_end = false;
+  stream->end = false;
+  stream->strm.next_in = stream->input;
+  stream->strm.avail_in = 0;
+  return inflateReset(&stream->strm) == Z_OK;
+}
+
+static ssize_t streamRead(DataSource* source, SourceStream* stream, char* buffer, size_t bytes) {
+  z_stream& strm = stream->strm;
+  strm.next_out = (Bytef*)buffer;
+  strm.avail_out = bytes;
+
+  while (strm.avail_out > 0 && !stream->end) {
+    if (strm.avail_in == 0) {
+      ssize_t got = source->read((char*)stream->input, sizeof(stream->input), stream->in_pos);
+      if (got < 0) return -1;
+      if (got == 0) break;
+      stream->in_pos += got;
+      strm.next_in = stream->input;
+      strm.avail_in = got;
+    }
+
+    int ret = ::inflate(&strm, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      /* Za členem může následovat další (zřetězený gzip) */
+      if (inflateReset(&strm) != Z_OK) return -1;
+      stream->member_end = true;
+    } else if (ret == Z_DATA_ERROR && stream->member_end && strm.total_out == 0) {
+      stream->end = true;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      return -1;
+    }
+  }
+  return bytes - strm.avail_out;
+}
+
+static int sourceOpen(DataSource* source, bool gzip) {
+  SourceStream* stream = NULL;
+  if (gzip) {
+    stream = new SourceStream;
+    memset(&stream->strm, 0, sizeof(z_stream));
+    /* 16 + MAX_WBITS - pouze formát gzip */
+    if (inflateInit2(&stream->strm, 16 + MAX_WBITS) != Z_OK) {
+      delete stream;
+      return -1;
+    }
+    streamReset(stream);
+  }
+
+  int fd = ::open("/dev/null", O_RDONLY);
+  if (fd == -1) {
+    if (stream) {
+      inflateEnd(&stream->strm);
+      delete stream;
+    }
+    return -1;
+  }
+
+  SourceCursor cursor = {source, 0, stream};
+  pthread_mutex_lock(&cursors_mux);
+  cursors[fd] = cursor;
+  pthread_mutex_unlock(&cursors_mux);
+  return fd;
+}
+
+static int sourceClose(int fd) {
+  pthread_mutex_lock(&cursors_mux);
+  SourceStream* stream = cursors[fd].stream;
+  cursors.erase(fd);
+  pthread_mutex_unlock(&cursors_mux);
+  if (stream) {
+    inflateEnd(&stream->strm);
+    delete stream;
+  }
+  return ::close(fd);
+}
+
+/* Proud je čten při budování (jedno vlákno) a poté pod stream_mux */
+static ssize_t sourceRead(int fd, void* buffer, size_t bytes) {
+  pthread_mutex_lock(&cursors_mux);
+  SourceCursor cursor = cursors[fd];
+  pthread_mutex_unlock(&cursors_mux);
+
+  ssize_t read_bytes;
+  if (cursor.stream)
+    read_bytes = streamRead(cursor.source, cursor.stream, (char*)buffer, bytes);
+  else
+    read_bytes = cursor.source->read((char*)buffer, bytes, cursor.pos);
+  if (read_bytes > 0) {
+    pthread_mutex_lock(&cursors_mux);
+    cursors[fd].pos += read_bytes;
+    pthread_mutex_unlock(&cursors_mux);
+  }
+  return read_bytes;
+}
+
+static off_t streamSeek(int fd, SourceCursor cursor, off_t offset) {
+  char skip_buf[16384];
+
+  if (offset < cursor.pos) {
+    if (!streamReset(cursor.stream)) return -1;
+    cursor.pos = 0;
+  }
+  while (cursor.pos < offset) {
+    size_t skip = (offset - cursor.pos < off_t(sizeof(skip_buf))) ?
+                  size_t(offset - cursor.pos) : sizeof(skip_buf);
+    ssize_t read_bytes = streamRead(cursor.source, cursor.stream, skip_buf, skip);
+    if (read_bytes <= 0) break;
+    cursor.pos += read_bytes;
+  }
+
+  pthread_mutex_lock(&cursors_mux);
+  cursors[fd].pos = cursor.pos;
+  pthread_mutex_unlock(&cursors_mux);
+  return (cursor.pos == offset) ? offset : -1;
+}
+
+static off_t sourceSeek(int fd, off_t offset, int whence) {
+  pthread_mutex_lock(&cursors_mux);
+  SourceCursor& cursor = cursors[fd];
+  if (cursor.stream) {
+    SourceCursor copy = cursor;
+    pthread_mutex_unlock(&cursors_mux);
+    /* Velikost dekomprimovaných dat není známa */
+    if (whence == SEEK_END) return -1;
+    if (whence == SEEK_CUR) offset += copy.pos;
+    if (offset < 0) return -1;
+    return streamSeek(fd, copy, offset);
+  }
+  if (whence == SEEK_CUR) offset += cursor.pos;
+  else if (whence == SEEK_END) offset += cursor.source->size();
+  if (offset >= 0) cursor.pos = offset;
+  pthread_mutex_unlock(&cursors_mux);
+  return offset >= 0 ? offset : -1;
+}
+
+TarDriver::TarDriver(const char* _name, DataSource* source, enum Compression _comp)
+  : ArchiveDriver(_name),
+    compression_used(_comp),
+    data_source(source),
+    stream_pos(0),
+    tail(-1),
+    opens(0),
+    stash_bytes(0) {
+
+  functions.openfunc = ::open;
+  functions.closefunc = sourceClose;
+  functions.readfunc = (readfunc_t)sourceRead;
+  functions.writefunc = ::write;
+  functions.seekfunc = sourceSeek;
+
+  /* bzip2 ze zdroje dat čten není */
+  if (_comp == BZIP) throw ArchiveError();
+  int fd = sourceOpen(source, _comp == GZIP);
+  if (fd == -1) throw ArchiveError();
+
+  if (tar_fdopen(&tar_file, fd, const_cast<char*>(_name),
+      (tartype_t*)&functions, O_RDONLY, 0644, TAR_VERBOSE) != 0) {
+    sourceClose(fd);
+    throw ArchiveError();
+  }
+  pthread_mutex_init(&stream_mux, NULL);
+}
+
 TarDriver::~TarDriver() {
+  for (map<FileNode*, Buffer*>::iterator it = stash.begin(); it != stash.end(); ++it)
+    delete it->second;
   tar_close(tar_file);
+  pthread_mutex_destroy(&stream_mux);
 }
 
+/* Otevření souboru komprimovaného archivu
+ * - gzseek vpřed dekomprimuje data až k cílové pozici, vzad dekomprimuje
+ *   proud od začátku; čtení souborů v pořadí archivu tak proud projde jen
+ *   jednou
+ * - je-li otevíráno více souborů (SCAN_OPENS), jsou data přeskakovaných
+ *   souborů uložena do bufferů (stash) a jejich pozdější otevření již
+ *   proud nevrací
+ */
 bool TarDriver::open(FileNode* node) {
   if (compression_used != NONE) {
     TarFileData* casted_data = static_cast<TarFileData*>(node->data);
 
+    /* Soubor byl dekomprimován při dřívějším průchodu */
+    map<FileNode*, Buffer*>::iterator stashed = stash.find(node);
+    if (stashed != stash.end()) {
+      pthread_rwlock_wrlock(&(node->lock));
+      node->buffer = stashed->second;
+      pthread_rwlock_unlock(&(node->lock));
+      stash_bytes -= node->getSize();
+      stash.erase(stashed);
+      return true;
+    }
+
     offset_t bytes_to_read = node->getSize();
+
+    /* Velký soubor je čten proudem až funkcí read() */
+    if (streamed(bytes_to_read)) {
+      casted_data->streamed = true;
+      return true;
+    }
+
+    pthread_mutex_lock(&stream_mux);
+    if (++opens >= SCAN_OPENS && casted_data->offset > stream_pos)
+      stashUntil(casted_data->offset);
+
     pthread_rwlock_wrlock(&(node->lock));
     try {
         node->buffer = new Buffer(bytes_to_read);
     }
     catch (...) {
       pthread_rwlock_unlock(&(node->lock));
+      pthread_mutex_unlock(&stream_mux);
       node->buffer = NULL;
       return false;
     }
 
-    int read_bytes = 0;
+    if (!inflate(casted_data->offset, bytes_to_read, node->buffer)) {
+      delete node->buffer;
+      node->buffer = NULL;
+      pthread_rwlock_unlock(&(node->lock));
+      pthread_mutex_unlock(&stream_mux);
+      return false;
+    }
+    pthread_rwlock_unlock(&(node->lock));
+    pthread_mutex_unlock(&stream_mux);
+  }
+  return true;
+}
+
+bool TarDriver::inflate(off_t offset, offset_t size, Buffer* target) {
+  char buf[Buffer::BLOCK_SIZE];
+  int read_bytes;
+  unsigned bytes;
+  offset_t read_offset = 0;
 
-    unsigned bytes;
-    unsigned read_offset = 0;
-    functions.seekfunc(tar_file->fd, casted_data->offset, SEEK_SET);
+  if (functions.seekfunc(tar_file->fd, offset, SEEK_SET) != offset) {
+    stream_pos = -1;
+    return false;
+  }
 
-    while (bytes_to_read > 0) {
-      if (Buffer::BLOCK_SIZE > bytes_to_read) bytes = bytes_to_read;
-      else bytes = Buffer::BLOCK_SIZE;
+  while (size > 0) {
+    if (Buffer::BLOCK_SIZE > size) bytes = size;
+    else bytes = Buffer::BLOCK_SIZE;
 
-      char buf[Buffer::BLOCK_SIZE];
-      read_bytes = functions.readfunc(tar_file->fd, buf, bytes);
-      node->buffer->write(buf, read_bytes, read_offset);
-      if (read_bytes < 0) return false;
-      bytes_to_read -= read_bytes;
-      read_offset += read_bytes;
+    read_bytes = functions.readfunc(tar_file->fd, buf, bytes);
+    if (read_bytes <= 0) {
+      stream_pos = -1;
+      return false;
     }
-    pthread_rwlock_unlock(&(node->lock));
+    target->write(buf, read_bytes, read_offset);
+    size -= read_bytes;
+    read_offset += read_bytes;
   }
+
+  stream_pos = offset + read_offset;
   return true;
 }
 
+void TarDriver::stashUntil(off_t target) {
+  vector<pair<off_t, FileNode*> >::iterator it;
+  FileNode* member;
+  Buffer* buffer;
+  offset_t size;
+
+  it = lower_bound(members.begin(), members.end(),
+                   pair<off_t, FileNode*>(stream_pos, (FileNode*)NULL));
+
+  for (; it != members.end() && it->first < target; ++it) {
+    member = it->second;
+    size = member->getSize();
+
+    /* Starší verze souboru, změněný, otevřený nebo již bufferovaný soubor */
+    if (static_cast<TarFileData*>(member->data)->offset != it->first) continue;
+    if (member->changed || member->buffer != NULL || member->cached_data != NULL) continue;
+    if (stash.find(member) != stash.end()) continue;
+
+    if (stash_bytes + size > scan_buffer_limit) break;
+
+    try {
+      buffer = new Buffer(size);
+    }
+    catch (...) {
+      break;
+    }
+
+    if (!inflate(it->first, size, buffer)) {
+      delete buffer;
+      break;
+    }
+    stash[member] = buffer;
+    stash_bytes += size;
+  }
+}
+
 int TarDriver::read(FileNode* node, char* buffer, size_t bytes, offset_t offset) {
   TarFileData* casted_data = static_cast<TarFileData*>(node->data);
+
+  /* Data komprimovaného archivu jsou po otevření v bufferu, velký soubor je
+   * čten přímo z proudu - gzseek vpřed jen dekomprimuje rozdíl, sekvenční
+   * čtení tak proud projde jednou */
+  if (compression_used != NONE) {
+    if (casted_data->streamed) {
+      offset_t size = node->getSize();
+      if (offset >= size) return 0;
+      if (offset_t(offset + bytes) > size) bytes = size - offset;
+
+      pthread_mutex_lock(&stream_mux);
+      off_t target = casted_data->offset + offset;
+      if (functions.seekfunc(tar_file->fd, target, SEEK_SET) != target) {
+        stream_pos = -1;
+        pthread_mutex_unlock(&stream_mux);
+        return -EIO;
+      }
+      size_t done = 0;
+      while (done < bytes) {
+        int read_bytes = functions.readfunc(tar_file->fd, buffer + done, bytes - done);
+        if (read_bytes <= 0) break;
+        done += read_bytes;
+      }
+      stream_pos = target + done;
+      pthread_mutex_unlock(&stream_mux);
+      return done;
+    }
+
+    if (node->buffer == NULL) return -EBADF;
+    return node->buffer->read(buffer, bytes, offset);
+  }
+
+  if (data_source)
+    return data_source->read(buffer, bytes, casted_data->offset + offset);
   return (pread(tar_fd(tar_file), buffer, bytes, casted_data->offset+offset));
 }
 
+/* Data souboru nekomprimovaného archivu na disku jsou v archivu souvislá,
+ * FUSE je tedy může předat z deskriptoru archivu (read_buf) */
+bool TarDriver::direct(FileNode* node, int& fd, off_t& pos, bool locate) {
+  (void)locate;
+  if (compression_used != NONE || data_source != NULL || node->data == NULL) return false;
+  fd = tar_fd(tar_file);
+  pos = static_cast<TarFileData*>(node->data)->offset;
+  return true;
+}
+
+/* Do bufferu je při otevření dekomprimován jen soubor komprimovaného
+ * archivu, který není čten proudem ani nebyl uložen při průchodu proudem */
+bool TarDriver::inflates(FileNode* node) {
+  if (compression_used == NONE) return false;
+  return !streamed(node->getSize()) && stash.find(node) == stash.end();
+}
+
 void TarDriver::close(FileNode* node) {
   if (compression_used != NONE) {
+    TarFileData* casted_data = static_cast<TarFileData*>(node->data);
+    if (casted_data->streamed) {
+      casted_data->streamed = false;
+      return;
+    }
+
     pthread_rwlock_wrlock(&(node->lock));
-    if (node->buffer->release())
+    if (node->buffer != NULL && node->buffer->release())
       node->buffer = NULL;
     pthread_rwlock_unlock(&(node->lock));
   }
@@ -135,19 +493,39 @@ void TarDriver::close(FileNode* node) {
 
 bool TarDriver::buildFileSystem(FileSystem* fs) {
   if (fs == NULL) return false;
+  return scan(fs, 0);
+}
 
+/* Soubory připojené na konec archivu (tar -r) začínají na místě koncových
+ * nulových bloků, stačí tedy projít archiv od tail. Komprimovaný proud
+ * takto doplnit nelze.
+ */
+bool TarDriver::updateFileSystem(FileSystem* fs) {
+  if (fs == NULL || compression_used != NONE || tail < 0) return false;
+  return scan(fs, tail);
+}
+
+bool TarDriver::scan(FileSystem* fs, off_t start) {
   FileNode *node = NULL;
   bool new_node;
   char *tar_pathname = NULL;
   char *pathname, *ptr;
   enum FileNode::NodeType node_type;
   off_t offset;
+  offset_t size;
+  bool cached;
+  vector<char> content;
 
   /* Pro jistotu nastavime ukazatel na data souboru na zacatek */
-  functions.seekfunc(tar_fd(tar_file), 0, SEEK_SET);
+  if (functions.seekfunc(tar_fd(tar_file), start, SEEK_SET) != start) return false;
 
+  tail = start;
   while(th_read(tar_file) == 0) {
     tar_pathname = th_get_pathname(tar_file);
+
+    /* Hlavičky (a dlouhá jména GNU tar) tvoří otisk archivu */
+    hashMetadata(&tar_file->th_buf, sizeof(tar_file->th_buf));
+    hashMetadata(tar_pathname, strlen(tar_pathname));
     pathname = strdup(tar_pathname);
     ptr = pathname;
 
@@ -161,7 +539,17 @@ bool TarDriver::buildFileSystem(FileSystem* fs) {
       node_type = FileNode::FILE_NODE;
 
     offset = functions.seekfunc(tar_fd(tar_file), 0, SEEK_CUR);
-    tar_skip_regfile(tar_file);
+    size = headerSize();
+
+    /* Malé soubory rovnou přečteme do cache, u komprimovaných archivů by se
+     * jinak musela data při otevření znovu dekomprimovat */
+    cached = false;
+    if (node_type == FileNode::FILE_NODE && TH_ISREG(tar_file) && fs->isCacheable(size))
+      cached = readContent(content, size);
+    else if (TH_ISREG(tar_file) && !skipContent(size)) {
+      free(pathname);
+      break;
+    }
 
     node = fs->find(pathname);
 
@@ -178,8 +566,13 @@ bool TarDriver::buildFileSystem(FileSystem* fs) {
 
     free(pathname);
 
+    /* Starší verze souboru v archivu mohla být uložena v cache */
+    node->cached_data = NULL;
+    if (cached)
+      fs->cacheContent(node, &content[0], size);
+
     /* nasleduje zjisteni a zpracovani informaci/atributu souboru */
-    node->setSize(th_get_size(tar_file));
+    node->setSize(size);
     node->file_info.st_atime =
       node->file_info.st_mtime =
       node->file_info.st_ctime = th_get_mtime(tar_file);
@@ -197,13 +590,79 @@ bool TarDriver::buildFileSystem(FileSystem* fs) {
       }
       catch (FileSystem::AlreadyExists& existing) {
         existing.node->file_info = node->file_info;
+        existing.node->cached_data = node->cached_data;
         if (existing.node->data == NULL) existing.node->data = new TarFileData;
-        memcpy(existing.node->data, node->data, sizeof(TarFileData));
+        static_cast<TarFileData*>(existing.node->data)->offset = offset;
         delete node;
+        node = existing.node;
       }
     }
+
+    if (node_type == FileNode::FILE_NODE && TH_ISREG(tar_file) && !cached)
+      members.push_back(pair<off_t, FileNode*>(offset, node));
+
+    /* Za daty souboru začíná další hlavička */
+    tail = functions.seekfunc(tar_fd(tar_file), 0, SEEK_CUR);
+  }
+
+  stream_pos = functions.seekfunc(tar_fd(tar_file), 0, SEEK_CUR);
+  return true;
+}
+
+/* TarDriver::headerSize
+ * - th_get_size vrací int, soubory nad 2 GB by byly zkráceny; oktalové
+ *   pole velikosti pojme nejvýše 8 GB, větší soubory (GNU tar, star) mají
+ *   velikost v binárním tvaru (base-256) označeném nejvyšším bitem
+ */
+offset_t TarDriver::headerSize() {
+  const unsigned char* field = (const unsigned char*)tar_file->th_buf.size;
+  const size_t len = sizeof(tar_file->th_buf.size);
+  offset_t size = 0;
+
+  if (field[0] & 0x80) {
+    size = field[0] & 0x7f;
+    for (size_t i = 1; i < len; ++i)
+      size = (size << 8) | field[i];
+    return size;
   }
 
+  for (size_t i = 0; i < len; ++i) {
+    if (field[i] == ' ' && size == 0) continue;
+    if (field[i] < '0' || field[i] > '7') break;
+    size = (size << 3) | (field[i] - '0');
+  }
+  return size;
+}
+
+/* Přeskočí data aktuálního souboru - stejně jako tar_skip_regfile, ale
+ * s 64bitovou velikostí */
+bool TarDriver::skipContent(offset_t size) {
+  if (size == 0) return true;
+
+  off_t blocks = (size + T_BLOCKSIZE - 1) / T_BLOCKSIZE;
+  off_t current = functions.seekfunc(tar_fd(tar_file), 0, SEEK_CUR);
+  if (current < 0) return false;
+
+  off_t target = current + blocks * T_BLOCKSIZE;
+  return functions.seekfunc(tar_fd(tar_file), target, SEEK_SET) == target;
+}
+
+/* Přečte obsah aktuálního souboru v archivu po blocích - stejně jako
+ * tar_skip_regfile, pouze data nezahazuje */
+bool TarDriver::readContent(vector<char>& content, offset_t size) {
+  char block[T_BLOCKSIZE];
+  offset_t remaining = size;
+  offset_t copied = 0;
+  size_t len;
+
+  content.resize(size);
+  while (remaining > 0) {
+    if (tar_block_read(tar_file, block) != T_BLOCKSIZE) return false;
+    len = (remaining < T_BLOCKSIZE) ? remaining : T_BLOCKSIZE;
+    memcpy(&content[copied], block, len);
+    copied += len;
+    remaining -= len;
+  }
   return true;
 }
 
@@ -9,7 +9,10 @@
 #define TAR_DRIVER_HPP
 
 #include <cstdio>
+#include <vector>
+#include <map>
 #include <sys/types.h>
+#include <pthread.h>
 #include <libtar.h>
 
 #include "archivedriver.hpp"
@@ -21,9 +24,15 @@ class TarFileData: public FileData {
 public:
   TarFileData(off_t _offset = -1) {
     offset = _offset;
+    streamed = false;
   }
   off_t offset;
+
+  /// Soubor komprimovaného archivu je čten proudem, nemá buffer
+  bool streamed;
   ~TarFileData() { }
+
+  offset_t order() const { return offset; }
 };
 
 class TarDriver: public ArchiveDriver {
@@ -31,19 +40,71 @@ public:
   enum Compression {NONE, GZIP, BZIP} compression_used;
 
   TarDriver(const char* _archive, bool create_archive, enum Compression _comp = NONE);
+
+  /// Ovladač archivu čteného ze zdroje dat (tar nebo tar.gz)
+  TarDriver(const char* _name, DataSource* source, enum Compression _comp = NONE);
   ~TarDriver();
 
   bool open(FileNode* node);
   int read(FileNode* node, char* buffer, size_t bytes, offset_t offset);
   void close(FileNode* node);
+  bool direct(FileNode* node, int& fd, off_t& pos, bool locate);
+  bool inflates(FileNode* node);
   bool saveArchive(FileMap* files, FileList* deleted);
 
   bool buildFileSystem(FileSystem* fs);
+  bool updateFileSystem(FileSystem* fs);
+
+  /// Počet otevřených souborů, po kterém jsou při průchodu proudem ukládány i přeskočené soubory
+  static const unsigned SCAN_OPENS = 3;
 
 private:
   TAR* tar_file;
   FILE* tar_file_itself;
 
+  /// Zdroj dat vnořeného archivu, jinak NULL
+  DataSource* data_source;
+
+  /** Soubory v pořadí, v jakém jsou uloženy v archivu (offset dat, uzel).
+   *  Pokud offset neodpovídá offsetu uzlu, jedná se o starší verzi souboru.
+   */
+  vector<pair<off_t, FileNode*> > members;
+
+  /// Pozice v dekomprimovaném proudu
+  off_t stream_pos;
+
+  /// Proud komprimovaného archivu čtou i soubory čtené proudem, mimo
+  /// zámek FileSystému
+  pthread_mutex_t stream_mux;
+
+  /// Velikost souboru z aktuální hlavičky (i > 8 GB - base-256)
+  offset_t headerSize();
+
+  /// Přeskočí data aktuálního souboru o velikosti size
+  bool skipContent(offset_t size);
+
+  /// Pozice za posledním souborem archivu (začátek koncových nulových bloků)
+  off_t tail;
+
+  /// Projde archiv od pozice start a připojí nalezené soubory do fs
+  bool scan(FileSystem* fs, off_t start);
+
+  /// Počet otevření komprimovaných souborů
+  unsigned opens;
+
+  /// Soubory dekomprimované při průchodu proudem, dosud neotevřené
+  map<FileNode*, Buffer*> stash;
+  offset_t stash_bytes;
+
+  /// Dekomprimuje size bytů dat od pozice offset do target
+  bool inflate(off_t offset, offset_t size, Buffer* target);
+
+  /// Uloží přeskočené soubory ležící v proudu před pozicí target
+  void stashUntil(off_t target);
+
+  /// Přečte obsah aktuálního souboru archivu o velikosti size do content
+  bool readContent(vector<char>& content, offset_t size);
+
   typedef off_t (*seekfunc_t)(int, off_t, int);
   struct {
     openfunc_t openfunc;
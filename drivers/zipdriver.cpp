@@ -9,7 +9,10 @@
 #include <cstring>
 #include <cstdlib>
 #include <climits>
+#include <new>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <pthread.h>
@@ -24,6 +27,12 @@ public:
   ArchiveDriver* getDriver(const char* path, bool create) {
     return new ZipDriver(path, create);
   }
+
+#ifdef ZIP_RDONLY
+  ArchiveDriver* getDriver(const char* name, DataSource* source) {
+    return new ZipDriver(name, source);
+  }
+#endif
 };
 
 extern "C" {
@@ -35,38 +44,378 @@ extern "C" {
   }
 }
 
+/* Čísla v zip jsou uložena little-endian */
+static inline unsigned le16(const unsigned char* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static inline unsigned long le32(const unsigned char* p) {
+  return le16(p) | ((unsigned long)le16(p + 2) << 16);
+}
+
+static inline unsigned long long le64(const unsigned char* p) {
+  return le32(p) | ((unsigned long long)le32(p + 4) << 32);
+}
+
+ZipInflater::ZipInflater(int _fd, off_t _start, offset_t _packed, offset_t _size, bool keep)
+  : opens(1),
+    fd(_fd),
+    start(_start),
+    packed(_packed),
+    size(_size),
+    out_pos(0),
+    in_pos(0),
+    finished(false),
+    cache(NULL) {
+  span = size / MAX_CHECKPOINTS;
+  if (span < offset_t(MIN_SPAN)) span = MIN_SPAN;
+
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) throw bad_alloc();
+  if (keep) {
+    try {
+      cache = new Buffer(size);
+    }
+    catch (...) {
+      inflateEnd(&strm);
+      throw;
+    }
+  }
+  pthread_mutex_init(&mux, NULL);
+}
+
+ZipInflater::~ZipInflater() {
+  for (vector<Checkpoint>::iterator it = checkpoints.begin(); it != checkpoints.end(); ++it)
+    delete[] it->window;
+  delete cache;
+  inflateEnd(&strm);
+  pthread_mutex_destroy(&mux);
+}
+
+/* ZipInflater::read
+ * - uchovávaná data jsou čtena z bufferu, dekomprimuje se jen zbytek
+ *   po konec čteného rozsahu
+ * - bez bufferu je čtení vzad (nebo skok vpřed přes kontrolní bod) zahájeno
+ *   od nejbližšího kontrolního bodu, sekvenční čtení dekomprimuje proud
+ *   jednou
+ */
+int ZipInflater::read(char* buffer, size_t bytes, offset_t offset) {
+  if (offset >= size) return 0;
+  if (offset_t(offset + bytes) > size) bytes = size - offset;
+  offset_t end = offset + bytes;
+  int ret;
+
+  pthread_mutex_lock(&mux);
+  try {
+    if (cache != NULL) {
+      if (end > out_pos && !advance(end, NULL, 0)) {
+        pthread_mutex_unlock(&mux);
+        return -EIO;
+      }
+      if (end > out_pos) end = out_pos;
+      ret = (end > offset) ? cache->read(buffer, end - offset, offset) : 0;
+    } else {
+      const Checkpoint* checkpoint = nearest(offset);
+      if (offset < out_pos || (checkpoint != NULL && checkpoint->out > out_pos)) {
+        if (!restart(checkpoint)) {
+          pthread_mutex_unlock(&mux);
+          return -EIO;
+        }
+      }
+      if (!advance(end, buffer, offset)) {
+        pthread_mutex_unlock(&mux);
+        return -EIO;
+      }
+      if (end > out_pos) end = out_pos;
+      ret = (end > offset) ? end - offset : 0;
+    }
+  }
+  catch (bad_alloc&) {
+    ret = -ENOMEM;
+  }
+  catch (int error) {
+    ret = -error;
+  }
+  pthread_mutex_unlock(&mux);
+  return ret;
+}
+
+bool ZipInflater::advance(offset_t end, char* dest, offset_t dest_start) {
+  while (out_pos < end && !finished) {
+    if (strm.avail_in == 0) {
+      offset_t left = packed - in_pos;
+      if (left <= 0) return false;
+      ssize_t got = pread(fd, input, (left > INPUT) ? INPUT : left, start + in_pos);
+      if (got <= 0) return false;
+      in_pos += got;
+      strm.next_in = input;
+      strm.avail_in = got;
+    }
+
+    unsigned at = out_pos % WINDOW;
+    offset_t room = WINDOW - at;
+    if (room > end - out_pos) room = end - out_pos;
+    strm.next_out = window + at;
+    strm.avail_out = room;
+
+    /* Z_BLOCK - dekomprese se zastaví na hranici bloku (kontrolní bod) */
+    int ret = ::inflate(&strm, Z_BLOCK);
+    if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) return false;
+
+    offset_t produced = room - strm.avail_out;
+    if (cache != NULL && produced > 0)
+      cache->write(reinterpret_cast<char*>(window + at), produced, out_pos);
+    if (dest != NULL) {
+      offset_t from = (out_pos > dest_start) ? out_pos : dest_start;
+      offset_t to = out_pos + produced;
+      if (from < to)
+        memcpy(dest + (from - dest_start), window + at + (from - out_pos), to - from);
+    }
+    out_pos += produced;
+
+    if (ret == Z_STREAM_END) finished = true;
+    else if (cache == NULL && (strm.data_type & 128) && !(strm.data_type & 64)
+             && out_pos - (checkpoints.empty() ? 0 : checkpoints.back().out) >= span
+             && checkpoints.size() < MAX_CHECKPOINTS)
+      addCheckpoint();
+  }
+  return true;
+}
+
+/* ZipInflater::addCheckpoint
+ * - volá se na hranici bloku deflate, span (>= 1 MB) zaručuje, že okno
+ *   obsahuje celých WINDOW bytů dat
+ */
+void ZipInflater::addCheckpoint() {
+  Checkpoint checkpoint;
+  checkpoint.out = out_pos;
+  checkpoint.in = in_pos - strm.avail_in;
+  checkpoint.bits = strm.data_type & 7;
+  checkpoint.window = new (nothrow) unsigned char[WINDOW];
+  if (checkpoint.window == NULL) return;
+
+  unsigned at = out_pos % WINDOW;
+  memcpy(checkpoint.window, window + at, WINDOW - at);
+  memcpy(checkpoint.window + WINDOW - at, window, at);
+  checkpoints.push_back(checkpoint);
+}
+
+const ZipInflater::Checkpoint* ZipInflater::nearest(offset_t offset) const {
+  vector<Checkpoint>::const_reverse_iterator it;
+  for (it = checkpoints.rbegin(); it != checkpoints.rend(); ++it)
+    if (it->out <= offset) return &*it;
+  return NULL;
+}
+
+bool ZipInflater::restart(const Checkpoint* checkpoint) {
+  inflateReset(&strm);
+  strm.avail_in = 0;
+  finished = false;
+
+  if (checkpoint == NULL) {
+    in_pos = out_pos = 0;
+    return true;
+  }
+
+  in_pos = checkpoint->in;
+  out_pos = checkpoint->out;
+  if (checkpoint->bits) {
+    /* Blok začíná uvnitř bytu - jeho zbývající bity jsou vloženy zpět */
+    unsigned char byte;
+    if (pread(fd, &byte, 1, start + checkpoint->in - 1) != 1) return false;
+    inflatePrime(&strm, checkpoint->bits, byte >> (8 - checkpoint->bits));
+  }
+  inflateSetDictionary(&strm, checkpoint->window, WINDOW);
+
+  unsigned at = out_pos % WINDOW;
+  memcpy(window + at, checkpoint->window, WINDOW - at);
+  memcpy(window, checkpoint->window + WINDOW - at, at);
+  return true;
+}
+
 ZipDriver::ZipDriver(const char* _archive, bool create_archive)
-  : ArchiveDriver(_archive) {
+  : ArchiveDriver(_archive),
+    archive_fd(-1) {
   int err;
+  pthread_mutex_init(&zip_mux, NULL);
+  pthread_mutex_init(&inflater_mux, NULL);
   if (create_archive) {
     zip_file = zip_open(_archive, ZIP_CREATE, &err);
     if (zip_file == NULL) {
       cerr << "ZipDriver: " << strerror(err) << endl;
+      pthread_mutex_destroy(&zip_mux);
+      pthread_mutex_destroy(&inflater_mux);
       throw ArchiveError();
     }
   } else {
-    zip_file = zip_open(_archive, 0, NULL);
+    zip_file = zip_open(_archive, 0, &err);
     if (zip_file == NULL) {
-      cerr << "ZipDriver: " << zip_strerror(zip_file) << endl;
+      cerr << "ZipDriver: cannot open archive (libzip error " << err << ")" << endl;
+      pthread_mutex_destroy(&zip_mux);
+      pthread_mutex_destroy(&inflater_mux);
       throw ArchiveError();
     }
+    archive_fd = ::open(_archive, O_RDONLY);
   }
   return;
 }
 
 
+#ifdef ZIP_RDONLY
+/* Čtení archivu ze zdroje dat (libzip >= 1.0)
+ * - archiv je čten pouze přes libzip (pod zip_mux), pozice stavu tedy
+ *   zámek nepotřebuje; přímé čtení a ZipInflater vyžadují deskriptor
+ * - stav uvolní libzip příkazem ZIP_SOURCE_FREE
+ */
+struct ZipSourceState {
+  DataSource* source;
+  zip_int64_t pos;
+  zip_error_t error;
+};
+
+static zip_int64_t sourceCallback(void* state, void* data, zip_uint64_t len,
+                                  enum zip_source_cmd cmd) {
+  ZipSourceState* src = reinterpret_cast<ZipSourceState*>(state);
+  switch (cmd) {
+    case ZIP_SOURCE_OPEN:
+      src->pos = 0;
+      return 0;
+
+    case ZIP_SOURCE_READ: {
+      ssize_t read_bytes = src->source->read((char*)data, len, src->pos);
+      if (read_bytes < 0) {
+        zip_error_set(&src->error, ZIP_ER_READ, EIO);
+        return -1;
+      }
+      src->pos += read_bytes;
+      return read_bytes;
+    }
+
+    case ZIP_SOURCE_CLOSE:
+      return 0;
+
+    case ZIP_SOURCE_STAT: {
+      struct zip_stat* info = reinterpret_cast<struct zip_stat*>(data);
+      zip_stat_init(info);
+      info->size = src->source->size();
+      info->valid |= ZIP_STAT_SIZE;
+      return sizeof(struct zip_stat);
+    }
+
+    case ZIP_SOURCE_SEEK: {
+      zip_int64_t pos = zip_source_seek_compute_offset(src->pos, src->source->size(),
+                                                       data, len, &src->error);
+      if (pos < 0) return -1;
+      src->pos = pos;
+      return 0;
+    }
+
+    case ZIP_SOURCE_TELL:
+      return src->pos;
+
+    case ZIP_SOURCE_ERROR:
+      return zip_error_to_data(&src->error, data, len);
+
+    case ZIP_SOURCE_FREE:
+      zip_error_fini(&src->error);
+      delete src;
+      return 0;
+
+    case ZIP_SOURCE_SUPPORTS:
+      return zip_source_make_command_bitmap(ZIP_SOURCE_OPEN, ZIP_SOURCE_READ,
+                                            ZIP_SOURCE_CLOSE, ZIP_SOURCE_STAT,
+                                            ZIP_SOURCE_SEEK, ZIP_SOURCE_TELL,
+                                            ZIP_SOURCE_ERROR, ZIP_SOURCE_FREE,
+                                            ZIP_SOURCE_SUPPORTS, -1);
+
+    default:
+      zip_error_set(&src->error, ZIP_ER_OPNOTSUPP, 0);
+      return -1;
+  }
+}
+
+ZipDriver::ZipDriver(const char* _name, DataSource* source)
+  : ArchiveDriver(_name),
+    archive_fd(-1) {
+  zip_error_t error;
+  zip_error_init(&error);
+
+  ZipSourceState* state = new ZipSourceState;
+  state->source = source;
+  state->pos = 0;
+  zip_error_init(&state->error);
+
+  zip_source_t* zip_src = zip_source_function_create(sourceCallback, state, &error);
+  if (zip_src == NULL) {
+    zip_error_fini(&state->error);
+    delete state;
+    zip_error_fini(&error);
+    throw ArchiveError();
+  }
+
+  zip_file = zip_open_from_source(zip_src, ZIP_RDONLY, &error);
+  zip_error_fini(&error);
+  if (zip_file == NULL) {
+    cerr << "ZipDriver: cannot open nested archive " << _name << endl;
+    zip_source_free(zip_src);
+    throw ArchiveError();
+  }
+
+  pthread_mutex_init(&zip_mux, NULL);
+  pthread_mutex_init(&inflater_mux, NULL);
+}
+#endif
+
+
 ZipDriver::~ZipDriver() {
-  if (zip_close(zip_file) == -1)
+  /* Po uložení změn je archiv již uzavřen */
+  if (zip_file != NULL && zip_close(zip_file) == -1)
     cerr << "ZipDriver: " << zip_strerror(zip_file) << endl;
+  if (archive_fd != -1) ::close(archive_fd);
+  pthread_mutex_destroy(&zip_mux);
+  pthread_mutex_destroy(&inflater_mux);
   return;
 }
 
+/* Otevření souboru
+ * - soubor uložený bez komprese je čten přímo z archivu (direct())
+ * - soubor komprimovaný metodou deflate je dekomprimován až při čtení
+ *   (ZipInflater), ostatní jsou dekomprimovány libzip celé do bufferu
+ * - velké soubory (stream_limit) jsou čteny proudem a buffer pro ně alokován
+ *   není
+ */
 bool ZipDriver::open(FileNode* node) {
   ZipFileData* casted_data = static_cast<ZipFileData*>(node->data);
+  offset_t bytes_to_read = node->getSize();
+  int fd;
+  off_t pos;
+
+  if (direct(node, fd, pos, true)) return true;
+
+  /* Soubor je již otevřen - plnění bufferu otevřeného souboru */
+  pthread_mutex_lock(&inflater_mux);
+  if (casted_data->inflater != NULL) {
+    ++casted_data->inflater->opens;
+    pthread_mutex_unlock(&inflater_mux);
+    return true;
+  }
+  pthread_mutex_unlock(&inflater_mux);
+  if (openInflater(casted_data, bytes_to_read)) return true;
 
-  casted_data->zip_file_data = zip_fopen_index(zip_file, casted_data->index, 0);
+  pthread_mutex_lock(&zip_mux);
+  struct zip_file* file = zip_fopen_index(zip_file, casted_data->index, 0);
+  if (file == NULL) {
+    pthread_mutex_unlock(&zip_mux);
+    return false;
+  }
+
+  if (streamed(bytes_to_read)) {
+    casted_data->zip_file_data = file;
+    casted_data->stream_pos = 0;
+    pthread_mutex_unlock(&zip_mux);
+    return true;
+  }
 
-  int bytes_to_read = node->getSize();
   pthread_rwlock_wrlock(&(node->lock));
   try {
     node->buffer = new Buffer(bytes_to_read);
@@ -74,34 +423,313 @@ bool ZipDriver::open(FileNode* node) {
   catch (...) {
     pthread_rwlock_unlock(&(node->lock));
     node->buffer = NULL;
+    zip_fclose(file);
+    pthread_mutex_unlock(&zip_mux);
     return false;
   }
 
-  int read_bytes;
-  int read_offset = 0;
+  zip_int64_t read_bytes;
+  offset_t read_offset = 0;
   char tmp_buf[Buffer::BLOCK_SIZE];
   while (bytes_to_read > 0) {
-    read_bytes = zip_fread(casted_data->zip_file_data, tmp_buf, Buffer::BLOCK_SIZE);
-    if (read_bytes < 0) return false;
+    read_bytes = zip_fread(file, tmp_buf, Buffer::BLOCK_SIZE);
+    if (read_bytes <= 0) break;
     node->buffer->write(tmp_buf, read_bytes, read_offset);
     bytes_to_read -= read_bytes;
     read_offset += read_bytes;
   }
   pthread_rwlock_unlock(&(node->lock));
-  zip_fclose(casted_data->zip_file_data);
+  zip_fclose(file);
+  pthread_mutex_unlock(&zip_mux);
+  return bytes_to_read == 0;
+}
+
+/* ZipDriver::openInflater
+ * - deflate bez šifrování, jehož data lze v archivu nalézt, je
+ *   dekomprimován přímo z deskriptoru archivu bez zámku libzip
+ */
+bool ZipDriver::openInflater(ZipFileData* data, offset_t size) {
+  if (archive_fd == -1 || data->header < 0) return false;
+  if (data->method != ZIP_CM_DEFLATE || data->encrypted) return false;
+
+  if (data->data_offset < 0 && !locateData(data)) {
+    data->header = -1;
+    return false;
+  }
+
+  ZipInflater* inflater;
+  try {
+    inflater = new ZipInflater(archive_fd, data->data_offset, data->packed_size,
+                               size, !streamed(size));
+  }
+  catch (...) {
+    return false;
+  }
+  pthread_mutex_lock(&inflater_mux);
+  data->inflater = inflater;
+  pthread_mutex_unlock(&inflater_mux);
   return true;
 }
 
+/* ZipDriver::locateData
+ * - data začínají za lokální hlavičkou, jejíž pole jména a extra se mohou
+ *   lišit od centrálního adresáře
+ * - jméno v hlavičce musí odpovídat jménu záznamu libzip, jinak pozice
+ *   z centrálního adresáře neplatí (např. data před archivem) a soubor je
+ *   čten přes libzip
+ */
+bool ZipDriver::locateData(ZipFileData* data) {
+  unsigned char header[30];
+  if (pread(archive_fd, header, sizeof(header), data->header) != sizeof(header))
+    return false;
+  if (le32(header) != 0x04034b50) return false;
+
+  unsigned name_len = le16(header + 26);
+  unsigned extra_len = le16(header + 28);
+  vector<char> local_name(name_len + 1);
+  if (pread(archive_fd, &local_name[0], name_len, data->header + 30) != ssize_t(name_len))
+    return false;
+
+  pthread_mutex_lock(&zip_mux);
+#ifdef ZIP_FL_ENC_RAW
+  const char* name = zip_get_name(zip_file, data->index, ZIP_FL_ENC_RAW);
+#else
+  const char* name = zip_get_name(zip_file, data->index, 0);
+#endif
+  bool same = (name != NULL && strlen(name) == name_len &&
+               memcmp(name, &local_name[0], name_len) == 0);
+  pthread_mutex_unlock(&zip_mux);
+  if (!same) return false;
+
+  data->data_offset = data->header + 30 + name_len + extra_len;
+  return true;
+}
+
+/* ZipDriver::readDirectory
+ * - libzip pozici dat souboru nezveřejňuje, pozice lokálních hlaviček jsou
+ *   proto přečteny z centrálního adresáře (i zip64)
+ * - záznamy centrálního adresáře jsou v pořadí indexů libzip
+ */
+bool ZipDriver::readDirectory(vector<off_t>& headers) {
+  static const unsigned EOCD = 22;
+  static const unsigned MAX_COMMENT = 65535;
+  struct stat info;
+
+  if (archive_fd == -1 || fstat(archive_fd, &info) != 0) return false;
+  if (info.st_size < off_t(EOCD)) return false;
+
+  /* Konec centrálního adresáře je v posledních EOCD + komentář bytech */
+  off_t tail_len = info.st_size;
+  if (tail_len > off_t(EOCD + MAX_COMMENT)) tail_len = EOCD + MAX_COMMENT;
+  vector<unsigned char> tail(tail_len);
+  if (pread(archive_fd, &tail[0], tail_len, info.st_size - tail_len) != tail_len)
+    return false;
+
+  off_t pos = tail_len - EOCD;
+  while (pos >= 0 && le32(&tail[pos]) != 0x06054b50) --pos;
+  if (pos < 0) return false;
+
+  unsigned long long entries = le16(&tail[pos + 10]);
+  unsigned long long dir_size = le32(&tail[pos + 12]);
+  unsigned long long dir_offset = le32(&tail[pos + 16]);
+
+  /* zip64 - lokátor před koncem centrálního adresáře */
+  if (pos >= 20 && le32(&tail[pos - 20]) == 0x07064b50) {
+    unsigned char end64[56];
+    off_t end64_offset = le64(&tail[pos - 20 + 8]);
+    if (pread(archive_fd, end64, sizeof(end64), end64_offset) != sizeof(end64)) return false;
+    if (le32(end64) != 0x06064b50) return false;
+    entries = le64(end64 + 32);
+    dir_size = le64(end64 + 40);
+    dir_offset = le64(end64 + 48);
+  }
+
+  if (dir_offset + dir_size > (unsigned long long)info.st_size) return false;
+
+  vector<unsigned char> dir(dir_size + 1);
+  if (pread(archive_fd, &dir[0], dir_size, dir_offset) != off_t(dir_size)) return false;
+
+  /* Centrální adresář (jména, CRC, velikosti a pozice souborů) a jeho konec
+   * tvoří otisk archivu */
+  hashMetadata(&dir[0], dir_size);
+  hashMetadata(&tail[pos], tail_len - pos);
+
+  size_t at = 0;
+  for (unsigned long long i = 0; i < entries; ++i) {
+    if (at + 46 > dir_size || le32(&dir[at]) != 0x02014b50) return false;
+
+    unsigned name_len = le16(&dir[at + 28]);
+    unsigned extra_len = le16(&dir[at + 30]);
+    unsigned comment_len = le16(&dir[at + 32]);
+    if (at + 46 + name_len + extra_len + comment_len > dir_size) return false;
+
+    unsigned long long header = le32(&dir[at + 42]);
+    if (header == 0xFFFFFFFFUL) {
+      /* Velikosti a pozice přesahující 32 bitů jsou v extra poli zip64 */
+      size_t extra = at + 46 + name_len;
+      size_t extra_end = extra + extra_len;
+      header = ~0ULL;
+      while (extra + 4 <= extra_end) {
+        unsigned id = le16(&dir[extra]);
+        unsigned len = le16(&dir[extra + 2]);
+        if (extra + 4 + len > extra_end) break;
+        if (id == 0x0001) {
+          size_t field = extra + 4;
+          if (le32(&dir[at + 24]) == 0xFFFFFFFFUL) field += 8;
+          if (le32(&dir[at + 20]) == 0xFFFFFFFFUL) field += 8;
+          if (field + 8 <= extra + 4 + len) header = le64(&dir[field]);
+          break;
+        }
+        extra += 4 + len;
+      }
+      if (header == ~0ULL) return false;
+    }
+
+    headers.push_back(header);
+    at += 46 + name_len + extra_len + comment_len;
+  }
+  return true;
+}
+
+/* ZipDriver::direct
+ * - pozice dat je zjištěna jednou (při prvním otevření), poté se čte bez
+ *   zámku libzip
+ * - bez locate je zjištěná pozice pouze čtena, volání read() a readSlices()
+ *   neběží pod zámkem ovladače FileSystému
+ */
+bool ZipDriver::direct(FileNode* node, int& fd, off_t& pos, bool locate) {
+  ZipFileData* casted_data = static_cast<ZipFileData*>(node->data);
+  if (casted_data == NULL || archive_fd == -1 || casted_data->header < 0) return false;
+  if (casted_data->method != ZIP_CM_STORE || casted_data->encrypted) return false;
+  if (casted_data->packed_size != node->getSize()) return false;
+
+  if (casted_data->data_offset < 0) {
+    if (!locate) return false;
+    if (!locateData(casted_data)) {
+      casted_data->header = -1;
+      return false;
+    }
+  }
+  fd = archive_fd;
+  pos = casted_data->data_offset;
+  return true;
+}
+
+/* Uložený soubor je čten přímo, deflate dekomprimuje ZipInflater až při
+ * čtení a velký soubor je čten proudem - buffer plní libzip při otevření
+ * jen u ostatních souborů */
+bool ZipDriver::inflates(FileNode* node) {
+  ZipFileData* casted_data = static_cast<ZipFileData*>(node->data);
+  int fd;
+  off_t pos;
+
+  if (casted_data == NULL || direct(node, fd, pos, true)) return false;
+  if (archive_fd != -1 && casted_data->header >= 0 &&
+      casted_data->method == ZIP_CM_DEFLATE && !casted_data->encrypted)
+    return false;
+  return !streamed(node->getSize());
+}
+
 int ZipDriver::read(FileNode* node, char* buffer, size_t bytes, offset_t offset) {
+  ZipFileData* casted_data = static_cast<ZipFileData*>(node->data);
+
+  /* Dekompresi otevřeného souboru uvolní až close(), které čtení
+   * souboru nepředbíhá (FUSE ani čtení s předstihem) */
+  pthread_mutex_lock(&inflater_mux);
+  ZipInflater* inflater = casted_data->inflater;
+  pthread_mutex_unlock(&inflater_mux);
+  if (inflater != NULL)
+    return inflater->read(buffer, bytes, offset);
+
+  int fd;
+  off_t pos;
+  if (direct(node, fd, pos, false)) {
+    offset_t size = node->getSize();
+    if (offset >= size) return 0;
+    if (offset_t(offset + bytes) > size) bytes = size - offset;
+    ssize_t read_bytes = pread(fd, buffer, bytes, pos + offset);
+    return (read_bytes < 0) ? -errno : read_bytes;
+  }
+
+  if (casted_data->zip_file_data != NULL)
+    return readStream(casted_data, buffer, bytes, offset);
+
+  if (node->buffer == NULL) return -EBADF;
   pthread_rwlock_rdlock(&(node->lock));
   int read_bytes = node->buffer->read(buffer, bytes, offset);
   pthread_rwlock_unlock(&(node->lock));
   return read_bytes;
 }
 
+/* ZipDriver::readStream
+ * - deflate nelze číst od libovolné pozice, vpřed jsou data přeskočena,
+ *   vzad je soubor otevřen znovu; sekvenční čtení tak dekomprimuje soubor
+ *   jen jednou a nikdy neuchovává celá data
+ */
+int ZipDriver::readStream(ZipFileData* data, char* buffer, size_t bytes, offset_t offset) {
+  char skip_buf[Buffer::BLOCK_SIZE];
+  zip_int64_t read_bytes;
+  size_t done = 0;
+
+  pthread_mutex_lock(&zip_mux);
+  if (offset < data->stream_pos) {
+    zip_fclose(data->zip_file_data);
+    data->zip_file_data = zip_fopen_index(zip_file, data->index, 0);
+    data->stream_pos = 0;
+    if (data->zip_file_data == NULL) {
+      pthread_mutex_unlock(&zip_mux);
+      return -EIO;
+    }
+  }
+
+  while (data->stream_pos < offset) {
+    offset_t skip = offset - data->stream_pos;
+    if (skip > offset_t(Buffer::BLOCK_SIZE)) skip = Buffer::BLOCK_SIZE;
+    read_bytes = zip_fread(data->zip_file_data, skip_buf, skip);
+    if (read_bytes <= 0) {
+      pthread_mutex_unlock(&zip_mux);
+      return (read_bytes == 0) ? 0 : -EIO;
+    }
+    data->stream_pos += read_bytes;
+  }
+
+  while (done < bytes) {
+    read_bytes = zip_fread(data->zip_file_data, buffer + done, bytes - done);
+    if (read_bytes < 0) {
+      pthread_mutex_unlock(&zip_mux);
+      return -EIO;
+    }
+    if (read_bytes == 0) break;
+    done += read_bytes;
+    data->stream_pos += read_bytes;
+  }
+  pthread_mutex_unlock(&zip_mux);
+  return done;
+}
+
 void ZipDriver::close(FileNode* node) {
+  ZipFileData* casted_data = static_cast<ZipFileData*>(node->data);
+  ZipInflater* unused = NULL;
+  pthread_mutex_lock(&inflater_mux);
+  if (casted_data->inflater != NULL && --casted_data->inflater->opens == 0) {
+    unused = casted_data->inflater;
+    casted_data->inflater = NULL;
+  }
+  pthread_mutex_unlock(&inflater_mux);
+  delete unused;
+
+  if (casted_data->zip_file_data != NULL) {
+    pthread_mutex_lock(&zip_mux);
+    zip_fclose(casted_data->zip_file_data);
+    casted_data->zip_file_data = NULL;
+    pthread_mutex_unlock(&zip_mux);
+    return;
+  }
+
+  /* Buffer vytvořený FileSystémem při otevření pro zápis (soubor nebyl
+   * změněn) je uvolněn i u souborů čtených bez bufferu */
   pthread_rwlock_wrlock(&(node->lock));
-  if (node->buffer->release())
+  if (node->buffer != NULL && node->buffer->release())
     node->buffer = NULL;
   pthread_rwlock_unlock(&(node->lock));
 }
@@ -119,7 +747,12 @@ bool ZipDriver::buildFileSystem(FileSystem* fs) {
   int retcode = 0;
   bool new_node;
   enum FileNode::NodeType node_type;
+  ZipFileData* data;
 
+  /* Bez pozic hlaviček jsou soubory čteny pouze přes libzip */
+  vector<off_t> headers;
+  if (!readDirectory(headers) || headers.size() != size_t(num_files))
+    headers.clear();
 
   for (int i = 0; i < num_files; ++i) {
     zip_pathname = const_cast<char*>(zip_get_name(zip_file, i, 0));
@@ -158,7 +791,16 @@ bool ZipDriver::buildFileSystem(FileSystem* fs) {
       cerr << "ZipDriver: " << zip_strerror(zip_file) << endl;
     }
 
-    node->setSize(signed(zip_info.size));
+    data = static_cast<ZipFileData*>(node->data);
+    if (retcode == 0 && !headers.empty()) {
+      data->header = headers[i];
+      data->packed_size = zip_info.comp_size;
+      data->method = zip_info.comp_method;
+      data->encrypted = (zip_info.encryption_method != ZIP_EM_NONE);
+    }
+
+    /* zip64 - velikost je 64bitová */
+    node->setSize(offset_t(zip_info.size));
     node->file_info.st_atime =
       node->file_info.st_ctime =
       node->file_info.st_mtime = zip_info.mtime;
@@ -190,7 +832,7 @@ ssize_t ZipDriver::zipUserFunctionCallback(void *state, void *data, size_t len,
         }
 
         case ZIP_SOURCE_READ: {
-            int read_bytes = callbck->buffer->read((char*)data, len, callbck->pos);
+            ssize_t read_bytes = callbck->buffer->read((char*)data, len, callbck->pos);
             callbck->pos += read_bytes;
             return read_bytes;
         }
@@ -302,8 +944,21 @@ bool ZipDriver::saveArchive(FileMap* files, FileList* deleted) {
    * původní handle
    */
   if (keep_original) {
-    zip_close(zip_file_new);
+    if (zip_close(zip_file_new) == -1) {
+      cerr << "ZipDriver: " << zip_strerror(zip_file_new) << endl;
+      return false;
+    }
+    return true;
+  }
+
+  /* Změny jsou zapsány až uzavřením archivu - teprve tak se dozvíme,
+   * zdali byly uloženy */
+  if (zip_close(zip_file) == -1) {
+    cerr << "ZipDriver: " << zip_strerror(zip_file) << endl;
+    zip_unchange_all(zip_file);
+    return false;
   }
+  zip_file = NULL;
 
   return true;
 }
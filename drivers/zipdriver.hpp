@@ -9,42 +9,199 @@
 #define ZIP_DRIVER_HPP
 
 #include <cstdio>
+#include <vector>
 #include <sys/stat.h>
+#include <pthread.h>
 #include <zip.h>
+#include <zlib.h>
 
 #include "archivedriver.hpp"
 
 using namespace std;
 
+class Buffer;
+
+/// Dekomprese souboru (deflate) čtená přímo z archivu
+/** \class ZipInflater
+ * Soubor je dekomprimován až při čtení a jen po nejvyšší dosud čtenou
+ * pozici. Dekomprimovaný začátek souboru je uchováván v bufferu (keep),
+ * velký soubor (viz ArchiveDriver::stream_limit) uchováván není - místo toho
+ * jsou v proudu zaznamenávány kontrolní body (stav dekompresoru na hranici
+ * bloku deflate a posledních 32 kB dat), čtení vzad nebo skok vpřed pak
+ * pokračuje od nejbližšího z nich.
+ */
+class ZipInflater {
+public:
+  /// Velikost okna deflate - data potřebná k pokračování dekomprese
+  static const unsigned WINDOW = 32768;
+
+  /// Velikost bloku komprimovaných dat čteného z archivu
+  static const unsigned INPUT = 16384;
+
+  /// Min. vzdálenost kontrolních bodů, bodů je nejvýše MAX_CHECKPOINTS
+  static const unsigned MIN_SPAN = 1024*1024;
+  static const unsigned MAX_CHECKPOINTS = 256;
+
+  /**
+   * @param _fd deskriptor archivu
+   * @param _start pozice komprimovaných dat v archivu
+   * @param _packed velikost komprimovaných dat
+   * @param _size velikost dekomprimovaného souboru
+   * @param keep uchovávat dekomprimovaná data v bufferu
+   * @throws std::bad_alloc, int errno
+   */
+  ZipInflater(int _fd, off_t _start, offset_t _packed, offset_t _size, bool keep);
+  ~ZipInflater();
+
+  /// Čte dekomprimovaná data, volají souběžně čtenáři otevřeného souboru
+  int read(char* buffer, size_t bytes, offset_t offset);
+
+  /// Počet otevření souboru ovladačem, chráněno ZipDriver::inflater_mux
+  unsigned opens;
+
+private:
+  /** \struct ZipInflater::Checkpoint
+   * Stav dekompresoru na hranici bloku deflate.
+   */
+  struct Checkpoint {
+    /// Pozice v dekomprimovaných a komprimovaných datech
+    offset_t out;
+    offset_t in;
+    /// Počet bitů bytu před pozicí in, které patří k následujícímu bloku
+    int bits;
+    /// Posledních WINDOW bytů dat před pozicí out
+    unsigned char* window;
+  };
+
+  int fd;
+  off_t start;
+  offset_t packed;
+  offset_t size;
+
+  z_stream strm;
+
+  /// Pozice v dekomprimovaných datech a přečtená komprimovaná data
+  offset_t out_pos;
+  offset_t in_pos;
+
+  /// Proud skončil (poškozený soubor může skončit před velikostí size)
+  bool finished;
+
+  unsigned char input[INPUT];
+
+  /// Naposledy dekomprimovaná data, pozice out je na indexu out % WINDOW
+  unsigned char window[WINDOW];
+
+  vector<Checkpoint> checkpoints;
+  offset_t span;
+
+  /// Dekomprimovaná data <0, out_pos), NULL pokud nejsou uchovávána
+  Buffer* cache;
+
+  pthread_mutex_t mux;
+
+  /// Dekomprimuje data až po pozici end, data od dest_start kopíruje do dest
+  /** @throws std::bad_alloc, int errno (zápis do cache) */
+  bool advance(offset_t end, char* dest, offset_t dest_start);
+
+  /// Pokračuje v dekompresi od kontrolního bodu, NULL od začátku
+  bool restart(const Checkpoint* checkpoint);
+
+  /// Kontrolní bod nejblíže před pozicí offset, NULL pokud žádný není
+  const Checkpoint* nearest(offset_t offset) const;
+
+  void addCheckpoint();
+
+  ZipInflater(const ZipInflater&);
+  ZipInflater& operator=(const ZipInflater&);
+};
+
 class ZipFileData: public FileData {
 public:
   ZipFileData(int _index = -1) {
     index = _index;
     zip_file_data = NULL;
+    stream_pos = 0;
+    header = -1;
+    data_offset = -1;
+    packed_size = 0;
+    method = 0;
+    encrypted = false;
+    inflater = NULL;
   }
+  /// Otevřený soubor čtený proudem (viz ArchiveDriver::stream_limit), jinak NULL
   struct zip_file* zip_file_data;
   int index;
+
+  /// Pozice v dekomprimovaných datech souboru čteného proudem
+  offset_t stream_pos;
+
+  /// Pozice lokální hlavičky souboru v archivu, -1 pokud není známa
+  off_t header;
+
+  /// Pozice dat za lokální hlavičkou, -1 dokud nebyla zjištěna
+  off_t data_offset;
+
+  /// Velikost komprimovaných dat, metoda komprese a šifrování
+  offset_t packed_size;
+  int method;
+  bool encrypted;
+
+  /// Dekomprese otevřeného souboru, jinak NULL (viz ZipDriver::inflater_mux)
+  ZipInflater* inflater;
+
+  offset_t order() const { return index; }
   ~ZipFileData() {
     if (zip_file_data) {
       zip_file_data = NULL;
     }
+    delete inflater;
   }
 };
 
 class ZipDriver: public ArchiveDriver {
 public:
   ZipDriver(const char* _archive, bool create_archive);
+#ifdef ZIP_RDONLY
+  /// Archiv uložený v jiném archivu, pouze pro čtení (libzip >= 1.0)
+  ZipDriver(const char* _name, DataSource* source);
+#endif
   ~ZipDriver();
 
   bool open(FileNode* node);
   int read(FileNode* node, char* buffer, size_t bytes, offset_t offset);
   void close(FileNode* node);
+  bool direct(FileNode* node, int& fd, off_t& pos, bool locate);
+  bool inflates(FileNode* node);
 
   bool buildFileSystem(FileSystem* fs);
 //   static bool createArchive(const char* source, const char* dest);
 
 private:
   struct zip* zip_file;
+
+  /// Deskriptor archivu pro přímé čtení dat souborů, -1 pokud není otevřen
+  int archive_fd;
+
+  /// libzip čte všechny soubory archivu jedním FILE*, čtení proudem
+  /// probíhá mimo zámek FileSystému
+  pthread_mutex_t zip_mux;
+
+  /// Chrání ZipFileData::inflater a ZipInflater::opens, read() nedrží
+  /// zámek ovladače FileSystému
+  pthread_mutex_t inflater_mux;
+
+  /// Přečte data souboru čteného proudem, vzad je proud otevřen znovu
+  int readStream(ZipFileData* data, char* buffer, size_t bytes, offset_t offset);
+
+  /// Přečte pozice lokálních hlaviček z centrálního adresáře (v pořadí indexů)
+  bool readDirectory(vector<off_t>& headers);
+
+  /// Zjistí pozici dat souboru z jeho lokální hlavičky
+  bool locateData(ZipFileData* data);
+
+  /// Otevře soubor komprimovaný metodou deflate bez libzip (ZipInflater)
+  bool openInflater(ZipFileData* data, offset_t size);
   bool saveArchive(FileMap* files, FileList* deleted);
 //   static void addDir(struct zip* archive, const char* path, int prefix_len);
   static ssize_t zipUserFunctionCallback(void*, void*, size_t, enum zip_source_cmd);
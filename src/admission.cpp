@@ -0,0 +1,121 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     File implementing admission control of decompressions
+ * Modified: 04/2012
+ */
+
+#include <iostream>
+
+#include "admission.hpp"
+#include "buffer.hpp"
+
+unsigned Admission::MAX_ACTIVE = 4;
+offset_t Admission::MEMORY = 512*1024*1024;
+Admission* Admission::global_admission = NULL;
+pthread_mutex_t Admission::global_mux = PTHREAD_MUTEX_INITIALIZER;
+
+Admission* Admission::global() {
+  pthread_mutex_lock(&global_mux);
+  if (global_admission == NULL)
+    global_admission = new Admission;
+  pthread_mutex_unlock(&global_mux);
+  return global_admission;
+}
+
+void Admission::destroyGlobal() {
+  pthread_mutex_lock(&global_mux);
+  delete global_admission;
+  global_admission = NULL;
+  pthread_mutex_unlock(&global_mux);
+}
+
+/* Buffer větší než MEM_LIMIT drží v paměti pouze prvních MEM_LIMIT bytů */
+offset_t Admission::reservation(offset_t size) {
+  if (Buffer::MEM_LIMIT == 0) return 0;
+  if (Buffer::MEM_LIMIT > 0 && size > Buffer::MEM_LIMIT) return Buffer::MEM_LIMIT;
+  return size;
+}
+
+Admission::Ticket::Ticket(const void* _archive, Priority priority, offset_t size)
+  : admission(Admission::global()),
+    archive(_archive) {
+  bytes = admission->acquire(archive, priority, reservation(size));
+}
+
+Admission::Ticket::~Ticket() {
+  admission->release(archive, bytes);
+}
+
+Admission::Admission()
+  : sequence(0),
+    active(0),
+    reserved(0) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+}
+
+Admission::~Admission() {
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+offset_t Admission::acquire(const void* archive, Priority priority, offset_t bytes) {
+  Waiter waiter;
+  waiter.archive = archive;
+  waiter.bytes = bytes;
+  waiter.admitted = false;
+
+  pthread_mutex_lock(&mutex);
+  waiters[pair<int, unsigned long>(priority, sequence++)] = &waiter;
+  admit();
+  while (!waiter.admitted)
+    pthread_cond_wait(&cond, &mutex);
+  pthread_mutex_unlock(&mutex);
+
+  return bytes;
+}
+
+void Admission::release(const void* archive, offset_t bytes) {
+  pthread_mutex_lock(&mutex);
+  --active;
+  if (--per_archive[archive] == 0) per_archive.erase(archive);
+  reserved -= bytes;
+  admit();
+  pthread_mutex_unlock(&mutex);
+}
+
+void Admission::admit() {
+  bool changed = false;
+  map<pair<int, unsigned long>, Waiter*>::iterator it = waiters.begin();
+  map<pair<int, unsigned long>, Waiter*>::iterator current;
+  map<const void*, unsigned>::iterator archive;
+  Waiter* waiter;
+
+  while (it != waiters.end()) {
+    waiter = it->second;
+
+    /* Archiv je vytížen - mohou pokračovat žadatelé jiných archivů */
+    archive = per_archive.find(waiter->archive);
+    if (archive != per_archive.end() && archive->second >= MAX_PER_ARCHIVE) {
+      ++it;
+      continue;
+    }
+
+    /* Globální prostředky dochází - méně důležití žadatelé nepředbíhají.
+     * Požadavek větší než celá mez projde, pokud není nic rezervováno. */
+    if (active >= MAX_ACTIVE) break;
+    if (MEMORY > 0 && reserved > 0 && reserved + waiter->bytes > MEMORY) break;
+
+    ++active;
+    ++per_archive[waiter->archive];
+    reserved += waiter->bytes;
+    waiter->admitted = true;
+    changed = true;
+
+    current = it++;
+    waiters.erase(current);
+  }
+
+  if (changed) pthread_cond_broadcast(&cond);
+}
@@ -0,0 +1,109 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     Header file for admission.cpp
+ * Modified: 04/2012
+ */
+
+#ifndef ADMISSION_HPP
+#define ADMISSION_HPP
+
+#include <map>
+#include <pthread.h>
+
+#include "bufferiface.hpp"
+
+using namespace std;
+
+/// Řízení počtu současně probíhajících dekompresí
+/** \class Admission
+ * Před otevřením souboru ovladačem (a tedy před dekompresí celého souboru
+ * do bufferu) je třeba získat povolení - Admission::Ticket. Povolení je
+ * vydáno, pokud neprobíhá více než MAX_ACTIVE dekompresí celkem, více než
+ * MAX_PER_ARCHIVE dekompresí jednoho archivu a pokud lze rezervovat paměť
+ * pro buffer (celkem nejvýše MEMORY bytů). Jinak žadatel čeká.
+ *
+ * Čekající jsou obslouženi podle priority (INTERACTIVE před PREFETCH před
+ * SAVE), v rámci priority v pořadí příchodu. Žadatel čekající pouze kvůli
+ * omezení svého archivu nezdržuje žadatele jiných archivů.
+ */
+class Admission {
+public:
+  /// Priority - nižší hodnota je obsloužena dříve
+  enum Priority {INTERACTIVE, PREFETCH, SAVE};
+
+  /// Maximální počet současných dekompresí
+  static unsigned MAX_ACTIVE;
+
+  /// Maximální počet současných dekompresí jednoho archivu
+  /** Ovladače (libzip, libtar) nejsou vláknově bezpečné, FileSystem
+   *  přístup k ovladači navíc serializuje - hodnota větší než 1 nemá smysl.
+   */
+  static const unsigned MAX_PER_ARCHIVE = 1;
+
+  /// Mez paměti rezervované pro buffery probíhajících dekompresí v bytech, 0 neomezuje
+  static offset_t MEMORY;
+
+  /// Globální objekt, vytvořený při prvním použití
+  static Admission* global();
+
+  /// Uvolní globální objekt
+  static void destroyGlobal();
+
+  /// Paměť, kterou zabere buffer souboru o velikosti size
+  static offset_t reservation(offset_t size);
+
+  /** \class Admission::Ticket
+   * Povolení k dekompresi. Konstruktor čeká na jeho vydání, destruktor
+   * povolení vrací.
+   */
+  class Ticket {
+  public:
+    Ticket(const void* archive, Priority priority, offset_t size);
+    ~Ticket();
+  private:
+    Admission* admission;
+    const void* archive;
+    offset_t bytes;
+
+    Ticket(const Ticket&);
+    Ticket& operator=(const Ticket&);
+  };
+
+  Admission();
+  ~Admission();
+
+private:
+  /** \struct Admission::Waiter
+   * Žadatel čekající na vydání povolení.
+   */
+  struct Waiter {
+    const void* archive;
+    offset_t bytes;
+    bool admitted;
+  };
+
+  /// Čekající žadatelé, řazeno podle priority a pořadí příchodu
+  map<pair<int, unsigned long>, Waiter*> waiters;
+  unsigned long sequence;
+
+  unsigned active;
+  map<const void*, unsigned> per_archive;
+  offset_t reserved;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  static Admission* global_admission;
+  static pthread_mutex_t global_mux;
+
+  /// Čeká na povolení, vrací rezervovanou paměť
+  offset_t acquire(const void* archive, Priority priority, offset_t bytes);
+
+  void release(const void* archive, offset_t bytes);
+
+  /// Vydá povolení čekajícím, pro které jsou volné prostředky
+  void admit();
+};
+
+#endif
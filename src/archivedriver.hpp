@@ -18,6 +18,7 @@
 #include <dlfcn.h>
 
 #include "filenode.hpp"
+#include "datasource.hpp"
 
 #define STANDART_BLOCK_SIZE 4096
 
@@ -32,6 +33,13 @@ class ArchiveDriver;
 class AbstractFactory {
 public:
   virtual ArchiveDriver* getDriver(const char*, bool) = 0;
+
+  /**
+   * Vytvoří ovladač archivu čteného ze zdroje dat (archiv v archivu),
+   * první parametr je jméno archivu. Ovladač je pouze pro čtení.
+   * @return NULL pokud ovladač čtení ze zdroje dat nepodporuje
+   */
+  virtual ArchiveDriver* getDriver(const char*, DataSource*) {return NULL;}
 };
 
 /** \struct ArchiveType
@@ -102,6 +110,8 @@ class ArchiveDriver {
      */
     ArchiveDriver (const char* archive) {
       archive_path = strdup(archive);
+      metadata_hash = 14695981039346656037ULL;
+      hashed = false;
     }
 
     /**
@@ -116,6 +126,13 @@ class ArchiveDriver {
      */
     virtual bool buildFileSystem(FileSystem*) = 0;
 
+    /**
+     * Doplní do FileSystemu soubory připojené na konec archivu od jeho
+     * vybudování. Ovladač, který to neumí, vrací false - archiv je pak
+     * vybudován znovu.
+     */
+    virtual bool updateFileSystem(FileSystem*) {return false;}
+
     /**
      * Otevře uzel předaný parametrem ke čtení.
      */
@@ -132,6 +149,42 @@ class ArchiveDriver {
      */
     virtual void close(FileNode*) = 0;
 
+    /**
+     * Vrací true, pokud jsou data souboru uložena v archivu bez komprese
+     * a lze je číst přímo z deskriptoru fd od pozice pos (bez bufferu, FUSE
+     * je může předat bez kopírování). Deskriptor je platný po dobu života
+     * ovladače.
+     * @param locate smí pozici dat v archivu zjistit (volající drží zámek
+     *        ovladače FileSystému), jinak je použita jen pozice zjištěná
+     *        dříve, např. při otevření souboru
+     */
+    virtual bool direct(FileNode*, int& fd, off_t& pos, bool locate) {
+      (void)fd;
+      (void)pos;
+      (void)locate;
+      return false;
+    }
+
+    /**
+     * Vrací true, pokud open() dekomprimuje data souboru do bufferu - jen
+     * takové otevření čeká na povolení k dekompresi (Admission). Soubory
+     * čtené přímo z archivu nebo dekomprimované až při čtení vrací false.
+     * Volající drží zámek ovladače FileSystému.
+     */
+    virtual bool inflates(FileNode*) {
+      return true;
+    }
+
+    /**
+     * Otisk metadat archivu (centrální adresář zip, hlavičky tar) zjištěný
+     * při budování, archivy se stejnou velikostí a otiskem jsou považovány
+     * za totožné. Vrací false, pokud ovladač otisk nezjišťuje.
+     */
+    bool fingerprint(unsigned long long& hash) const {
+      hash = metadata_hash;
+      return hashed;
+    }
+
     /**
      * Uloží obsah souborového archivu. Předává se asociativní pole FileMap
      * obsahující jako hodnoty ukazatele na objekty FileNode. A vektor FileList
@@ -142,6 +195,20 @@ class ArchiveDriver {
     static bool respect_rights;
     static bool keep_original;
 
+    /// Mez paměti pro data souborů dekomprimovaných při průchodu proudem (v bytech)
+    static offset_t scan_buffer_limit;
+
+    /**
+     * Soubory větší než tato mez (v bytech) nejsou při otevření celé
+     * dekomprimovány do bufferu, ovladač je čte proudem. 0 = vždy buffer.
+     */
+    static offset_t stream_limit;
+
+    /// Má být soubor o velikosti size čten proudem (viz stream_limit)?
+    static inline bool streamed(offset_t size) {
+      return stream_limit > 0 && size > stream_limit;
+    }
+
     /** \class ArchiveError
      *  Objekty této třídy jsou použity pro vyjímky, kdy dojde k chybě při
      *  inicializaci ovladače - většinou otevření souboru.
@@ -152,6 +219,20 @@ class ArchiveDriver {
     ///Ukazatel na řetězec s cestou k souborovému archivu.
     char* archive_path;
 
+    /// Přidá metadata archivu do otisku (FNV-1a), volá se při budování
+    void hashMetadata(const void* data, size_t len) {
+      const unsigned char* bytes = static_cast<const unsigned char*>(data);
+      for (size_t i = 0; i < len; ++i) {
+        metadata_hash ^= bytes[i];
+        metadata_hash *= 1099511628211ULL;
+      }
+      hashed = true;
+    }
+
+  private:
+    unsigned long long metadata_hash;
+    bool hashed;
+
 };
 
 #endif // ARCHIVEDRIVER_H
@@ -13,11 +13,15 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "archivefs.hpp"
 
 bool ArchiveDriver::respect_rights = false;
 bool ArchiveDriver::keep_original  = false;
+offset_t ArchiveDriver::scan_buffer_limit = 64*1024*1024;
+offset_t ArchiveDriver::stream_limit = offset_t(2048)*1024*1024;
 
 struct fuse_operations fuse_oper;
 
@@ -109,6 +113,14 @@ int main(int argc, char* argv[]) {
     exit(-1);
   }
 
+  /* Začlenění úložiště změn do archivu - nic se nepřipojuje, změny jsou
+   * zapsány při uvolnění FileSystémů */
+  if (fuse_data->compact && fuse_data->mounted) {
+    retcode = initialize(fuse_data) ? 0 : -1;
+    delete fuse_data;
+    return retcode;
+  }
+
   if (!fuse_data->mounted || !fuse_data->mountpoint) {
     cout << "usage: afs <source_file> <mountpoint> [OPTIONS]" << endl;
     fuse_data->mounted = NULL;
@@ -129,6 +141,9 @@ int main(int argc, char* argv[]) {
   fuse_oper.getattr    = archivefs_getattr;
   fuse_oper.open       = archivefs_open;
   fuse_oper.read       = archivefs_read;
+#if FUSE_VERSION >= 29
+  fuse_oper.read_buf   = archivefs_read_buf;
+#endif
   fuse_oper.release    = archivefs_release;
   fuse_oper.opendir    = archivefs_opendir;
   fuse_oper.readdir    = archivefs_readdir;
@@ -158,6 +173,653 @@ int main(int argc, char* argv[]) {
   return retcode;
 }
 
+/** \class SaveTask
+ * Úloha ukládající změny archivů, jenž jsou uloženy v témž souboru.
+ */
+class SaveTask: public Task {
+public:
+  SaveTask(const vector<FileSystem*>& _group) : Task(NORMAL), group(_group), failed(0) {}
+
+  void run() {
+    for (vector<FileSystem*>::iterator it = group.begin(); it != group.end(); ++it)
+      if (!(*it)->save()) ++failed;
+  }
+
+  vector<FileSystem*> group;
+  unsigned failed;
+};
+
+/* FileSystemS::save
+ * - reference brání uvolnění FileSystémů, na úlohy a ukládání se čeká
+ *   bez zámku
+ */
+unsigned FileSystemS::save() {
+  typedef std::map<pair<dev_t, ino_t>, vector<FileSystem*> > Groups;
+  Groups groups;
+  vector<FileSystem*> loaded;
+  struct stat info;
+  unsigned count = 0;
+
+  pthread_mutex_lock(&mutex);
+  for (FSMap::iterator it = map.begin(); it != map.end(); ++it) {
+    FileSystem* fs = it->second;
+    if (fs->refs++ == 0) idle.erase(make_pair(fs->last_used, fs));
+    loaded.push_back(fs);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  for (vector<FileSystem*>::iterator it = loaded.begin(); it != loaded.end(); ++it) {
+    FileSystem* fs = *it;
+    /* Úlohy na pozadí by s ukládáním soupeřily o ovladač */
+    fs->waitForTasks();
+    if (!fs->needsSave()) continue;
+
+    /* Archiv, jehož soubor nelze zjistit, tvoří samostatnou skupinu */
+    if (stat(fs->archive_name, &info) != 0) {
+      info.st_dev = 0;
+      info.st_ino = count;
+    }
+    groups[make_pair(info.st_dev, info.st_ino)].push_back(fs);
+    ++count;
+  }
+
+  if (count == 0) {
+    for (vector<FileSystem*>::iterator it = loaded.begin(); it != loaded.end(); ++it)
+      release(*it);
+    return 0;
+  }
+  if (count > 1)
+    cout << "Saving changes in " << count << " archives" << endl;
+
+  vector<SaveTask*> tasks;
+  for (Groups::iterator it = groups.begin(); it != groups.end(); ++it) {
+    SaveTask* task = new SaveTask(it->second);
+    task->acquire();
+    if (!Executor::global()->submit(task))
+      Executor::execute(task);
+    tasks.push_back(task);
+  }
+
+  unsigned failed = 0;
+  for (vector<SaveTask*>::iterator it = tasks.begin(); it != tasks.end(); ++it) {
+    (*it)->wait();
+    failed += (*it)->failed;
+    (*it)->release();
+  }
+  for (vector<FileSystem*>::iterator it = loaded.begin(); it != loaded.end(); ++it)
+    release(*it);
+
+  if (count > 1)
+    cout << count - failed << " of " << count << " archives saved" << endl;
+  return failed;
+}
+
+/* FileSystemS::freezeIdle
+ * - reference brání uvolnění FileSystému během komprese, komprimuje se
+ *   bez zámku
+ */
+void FileSystemS::freezeIdle(time_t before, unsigned ratio) {
+  vector<FileSystem*> changed;
+
+  pthread_mutex_lock(&mutex);
+  for (FSMap::iterator it = map.begin(); it != map.end(); ++it) {
+    FileSystem* fs = it->second;
+    if (!fs->needsSave()) continue;
+    if (fs->refs++ == 0) idle.erase(make_pair(fs->last_used, fs));
+    changed.push_back(fs);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  for (vector<FileSystem*>::iterator it = changed.begin(); it != changed.end(); ++it) {
+    (*it)->freezeIdle(before, ratio);
+    release(*it);
+  }
+}
+
+unsigned FileSystemS::MAX_LOADED = 0;
+offset_t FileSystemS::MEMORY = 0;
+bool FileSystemS::SHARE_IDENTICAL = false;
+
+void FileSystemS::insert(FileSystem* fs) {
+  vector<FileSystem*> victims;
+
+  pthread_mutex_lock(&mutex);
+  map[fs->archive_name] = fs;
+  memory += fs->footprint();
+  fs->last_used = ++clock;
+  if (fs->refs == 0) idle.insert(make_pair(fs->last_used, fs));
+  evict(victims);
+  pthread_mutex_unlock(&mutex);
+
+  dispose(victims);
+}
+
+void FileSystemS::erase(const char* key) {
+  pthread_mutex_lock(&mutex);
+  FSMap::iterator it = map.find(key);
+  if (it != map.end()) {
+    memory -= it->second->footprint();
+    idle.erase(make_pair(it->second->last_used, it->second));
+    map.erase(it);
+  }
+  types.erase(key);
+  dropShares(key);
+  pthread_mutex_unlock(&mutex);
+}
+
+FileSystem* FileSystemS::acquire(const char* key) {
+  FileSystem* fs = NULL;
+
+  pthread_mutex_lock(&mutex);
+  FSMap::iterator it = map.find(key);
+  if (it != map.end()) {
+    fs = it->second;
+    if (fs->refs++ == 0) idle.erase(make_pair(fs->last_used, fs));
+  }
+  pthread_mutex_unlock(&mutex);
+  return fs;
+}
+
+void FileSystemS::acquire(FileSystem* fs) {
+  pthread_mutex_lock(&mutex);
+  if (fs->refs++ == 0) idle.erase(make_pair(fs->last_used, fs));
+  pthread_mutex_unlock(&mutex);
+}
+
+FileSystem* FileSystemS::load(const char* archive_name) {
+  FileSystem* fs = NULL;
+  ArchiveType* type = NULL;
+
+  /* Archiv totožný s jiným archivem používá jeho FileSystem */
+  if (SHARE_IDENTICAL) {
+    string owner;
+    pthread_mutex_lock(&mutex);
+    std::map<string, string>::iterator sh = shared.find(archive_name);
+    if (sh != shared.end()) owner = sh->second;
+    pthread_mutex_unlock(&mutex);
+
+    if (!owner.empty()) {
+      fs = load(owner.c_str());
+      if (fs != NULL) return fs;
+      unshare(archive_name);
+    }
+  }
+
+  pthread_mutex_lock(&mutex);
+  for (;;) {
+    FSMap::iterator it = map.find(archive_name);
+    if (it != map.end()) {
+      fs = it->second;
+      if (fs->refs++ == 0) idle.erase(make_pair(fs->last_used, fs));
+      pthread_mutex_unlock(&mutex);
+      return fs;
+    }
+
+    /* Archiv již buduje jiné vlákno */
+    if (building.find(archive_name) == building.end()) break;
+    pthread_cond_wait(&built, &mutex);
+  }
+  building.insert(archive_name);
+
+  std::map<string, ArchiveType*>::iterator known = types.find(archive_name);
+  if (known != types.end()) type = known->second;
+  pthread_mutex_unlock(&mutex);
+
+  /* Budování trvá - probíhá bez zámku */
+  if (type == NULL) type = GET_TYPE(archive_name);
+  if (type != NULL) {
+    try {
+      fs = new FileSystem(archive_name, false, type);
+    }
+    catch (ArchiveDriver::ArchiveError&) {
+      fs = NULL;
+    }
+  }
+
+  /* Otisk metadat zjistí ovladač při budování, archiv totožný s již
+   * načteným archivem používá jeho FileSystem (a jeho buffery) */
+  Fingerprint print;
+  bool printed = SHARE_IDENTICAL && fs != NULL && fs->evictable() &&
+                 fs->fingerprint(print.second);
+  if (printed) print.first = fs->sourceInfo().st_size;
+
+  vector<FileSystem*> victims;
+  string owner;
+  pthread_mutex_lock(&mutex);
+  building.erase(archive_name);
+  if (printed) {
+    std::map<Fingerprint, string>::iterator known = fingerprints.find(print);
+    if (known != fingerprints.end() && known->second != archive_name &&
+        map.find(known->second.c_str()) != map.end()) {
+      owner = known->second;
+      shared[archive_name] = owner;
+      victims.push_back(fs);
+      fs = NULL;
+    } else
+      fingerprints[print] = archive_name;
+  }
+  if (fs != NULL) {
+    types[archive_name] = type;
+    map[fs->archive_name] = fs;
+    memory += fs->footprint();
+    fs->refs = 1;
+    fs->last_used = ++clock;
+    evict(victims);
+  }
+  pthread_cond_broadcast(&built);
+  pthread_mutex_unlock(&mutex);
+
+  dispose(victims);
+  if (!owner.empty()) {
+    fs = load(owner.c_str());
+    if (fs == NULL) unshare(archive_name);
+  }
+  return fs;
+}
+
+/* FileSystemS::loadNested
+ * - vnořený FileSystem drží po dobu své existence referenci na vnější
+ *   archiv, vrácena je funkcí dispose()
+ * - po nahrazení vnějšího archivu novou verzí (refresh()) je původní vnořený
+ *   FileSystem vyřazen a archiv vybudován znovu
+ */
+FileSystem* FileSystemS::loadNested(FileSystem* outer, FileNode* node,
+                                    const char* key, ArchiveType* type) {
+  FileSystem* fs = NULL;
+  vector<FileSystem*> victims;
+
+  pthread_mutex_lock(&mutex);
+  for (;;) {
+    FSMap::iterator it = map.find(key);
+    if (it != map.end()) {
+      fs = it->second;
+      if (fs->container() == outer) {
+        if (fs->refs++ == 0) idle.erase(make_pair(fs->last_used, fs));
+        pthread_mutex_unlock(&mutex);
+        dispose(victims);
+        return fs;
+      }
+      retire(fs);
+      sweep(victims);
+      fs = NULL;
+      continue;
+    }
+
+    if (building.find(key) == building.end()) break;
+    pthread_cond_wait(&built, &mutex);
+  }
+  building.insert(key);
+  ++outer->refs;  // volající drží referenci, outer tedy není mezi idle
+  pthread_mutex_unlock(&mutex);
+
+  try {
+    fs = new FileSystem(key, type, outer, node);
+  }
+  catch (ArchiveDriver::ArchiveError&) {
+    fs = NULL;
+  }
+
+  pthread_mutex_lock(&mutex);
+  building.erase(key);
+  if (fs != NULL) {
+    map[fs->archive_name] = fs;
+    memory += fs->footprint();
+    fs->refs = 1;
+    fs->last_used = ++clock;
+    ++nested;
+    evict(victims);
+  }
+  pthread_cond_broadcast(&built);
+  pthread_mutex_unlock(&mutex);
+
+  if (fs == NULL) release(outer);
+  dispose(victims);
+  return fs;
+}
+
+/* FileSystemS::dispose
+ * - vnořený archiv je uvolněn před vrácením reference na vnější archiv,
+ *   při uvolnění zavírá svůj soubor ve vnějším archivu
+ */
+void FileSystemS::dispose(vector<FileSystem*>& victims) {
+  for (vector<FileSystem*>::iterator it = victims.begin(); it != victims.end(); ++it) {
+    FileSystem* outer = (*it)->container();
+    delete *it;
+    if (outer != NULL) release(outer);
+  }
+}
+
+void FileSystemS::unshare(const char* archive_name) {
+  if (!SHARE_IDENTICAL) return;
+
+  pthread_mutex_lock(&mutex);
+  dropShares(archive_name);
+  pthread_mutex_unlock(&mutex);
+}
+
+/* FileSystemS::dropShares
+ * - archiv přestane používat cizí FileSystem, archivy používající jeho
+ *   FileSystem jej přestanou používat (otevřené soubory čtou dál původní)
+ * - otisk archivu je zapomenut, změněný archiv již nemůže být sdílen
+ */
+void FileSystemS::dropShares(const string& archive_name) {
+  shared.erase(archive_name);
+
+  std::map<string, string>::iterator sh = shared.begin();
+  while (sh != shared.end()) {
+    if (sh->second == archive_name) shared.erase(sh++);
+    else ++sh;
+  }
+
+  std::map<Fingerprint, string>::iterator fp = fingerprints.begin();
+  while (fp != fingerprints.end()) {
+    if (fp->second == archive_name) fingerprints.erase(fp++);
+    else ++fp;
+  }
+}
+
+void FileSystemS::registerArchive(const char* archive_name, ArchiveType* type) {
+  pthread_mutex_lock(&mutex);
+  types[archive_name] = type;
+  pthread_mutex_unlock(&mutex);
+}
+
+ArchiveType* FileSystemS::typeOf(const char* archive_name) {
+  pthread_mutex_lock(&mutex);
+  std::map<string, ArchiveType*>::iterator it = types.find(archive_name);
+  if (it != types.end()) {
+    pthread_mutex_unlock(&mutex);
+    return it->second;
+  }
+  pthread_mutex_unlock(&mutex);
+
+  ArchiveType* type = GET_TYPE(archive_name);
+  if (type != NULL) registerArchive(archive_name, type);
+  return type;
+}
+
+void FileSystemS::release(FileSystem* fs) {
+  vector<FileSystem*> victims;
+
+  pthread_mutex_lock(&mutex);
+  fs->last_used = ++clock;
+  if (--fs->refs == 0) {
+    FSMap::iterator it = map.find(fs->archive_name);
+    if (it != map.end() && it->second == fs)
+      idle.insert(make_pair(fs->last_used, fs));
+  }
+  evict(victims);
+  sweep(victims);
+  pthread_mutex_unlock(&mutex);
+
+  /* FileSystem je uvolňován mimo zámek - čeká na úlohy na pozadí */
+  dispose(victims);
+}
+
+bool FileSystemS::detach(FileSystem* fs) {
+  vector<FileSystem*> children;
+
+  pthread_mutex_lock(&mutex);
+  /* Nepoužívané vnořené archivy drží referenci na fs, jsou uvolněny */
+  set<pair<unsigned long, FileSystem*> >::iterator idle_it = idle.begin();
+  while (idle_it != idle.end()) {
+    FileSystem* inner = idle_it->second;
+    if (inner->container() != fs) {
+      ++idle_it;
+      continue;
+    }
+    idle.erase(idle_it++);
+    map.erase(inner->archive_name);
+    memory -= inner->footprint();
+    --fs->refs;
+    children.push_back(inner);
+  }
+
+  if (fs->refs > 1) {
+    pthread_mutex_unlock(&mutex);
+    for (vector<FileSystem*>::iterator it = children.begin(); it != children.end(); ++it)
+      delete *it;
+    return false;
+  }
+
+  FSMap::iterator it = map.find(fs->archive_name);
+  if (it != map.end() && it->second == fs) {
+    memory -= fs->footprint();
+    map.erase(it);
+  }
+  types.erase(fs->archive_name);
+  dropShares(fs->archive_name);
+  fs->refs = 0;
+  pthread_mutex_unlock(&mutex);
+
+  for (vector<FileSystem*>::iterator it = children.begin(); it != children.end(); ++it)
+    delete *it;
+  return true;
+}
+
+/* FileSystemS::refresh
+ * - změnu zachytí pouze vybudovaná verze, na budování se tedy čeká
+ * - FileSystem doplňovaný ovladačem není v poli, přístupy k archivu čekají
+ *   jako na budování
+ */
+void FileSystemS::refresh(const char* archive_name) {
+  struct stat info;
+  bool present = ::stat(archive_name, &info) == 0 && S_ISREG(info.st_mode);
+  vector<FileSystem*> victims;
+
+  pthread_mutex_lock(&mutex);
+  while (building.find(archive_name) != building.end())
+    pthread_cond_wait(&built, &mutex);
+
+  /* Změněný archiv již není totožný s ostatními */
+  dropShares(archive_name);
+
+  /* Nová verze je již budována, po dokončení bude vybudována znovu */
+  if (refreshing.find(archive_name) != refreshing.end()) {
+    dirty.insert(archive_name);
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+
+  FSMap::iterator it = map.find(archive_name);
+  if (it == map.end()) {
+    /* Nenačtený archiv - stačí znovu zjistit jeho typ */
+    types.erase(archive_name);
+    pthread_mutex_unlock(&mutex);
+    if (present) typeOf(archive_name);
+    return;
+  }
+
+  FileSystem* fs = it->second;
+  const struct stat& source = fs->sourceInfo();
+  bool same_file = present && source.st_dev == info.st_dev && source.st_ino == info.st_ino;
+  if (same_file && source.st_size == info.st_size && source.st_mtime == info.st_mtime) {
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+
+  if (fs->needsSave()) {
+    pthread_mutex_unlock(&mutex);
+    cerr << "Archive " << archive_name << " has changed on disk, but it contains "
+         << "unsaved changes - it is NOT reloaded" << endl;
+    return;
+  }
+
+  if (!present) {
+    retire(fs);
+    types.erase(archive_name);
+    sweep(victims);
+    pthread_mutex_unlock(&mutex);
+
+    dispose(victims);
+    return;
+  }
+
+  if (same_file && info.st_size > source.st_size && fs->refs == 0 &&
+      fs->evictable() && !Prefetcher::global()->uses(fs)) {
+    map.erase(it);
+    idle.erase(make_pair(fs->last_used, fs));
+    memory -= fs->footprint();
+    building.insert(archive_name);
+    pthread_mutex_unlock(&mutex);
+
+    bool ok = fs->update();
+
+    pthread_mutex_lock(&mutex);
+    building.erase(archive_name);
+    map[fs->archive_name] = fs;
+    memory += fs->footprint();
+    fs->last_used = ++clock;
+    idle.insert(make_pair(fs->last_used, fs));
+    if (ok) ++updated;
+    pthread_cond_broadcast(&built);
+
+    if (ok) {
+      pthread_mutex_unlock(&mutex);
+      return;
+    }
+  }
+
+  refreshing.insert(archive_name);
+  pthread_mutex_unlock(&mutex);
+  reload(archive_name);
+}
+
+/* FileSystemS::reload
+ * - nová verze je budována bez zámku, do jejího vložení jsou přístupy
+ *   obsluhovány původní verzí
+ */
+void FileSystemS::reload(const char* archive_name) {
+  vector<FileSystem*> victims;
+  bool again;
+
+  do {
+    pthread_mutex_lock(&mutex);
+    dirty.erase(archive_name);
+    types.erase(archive_name);
+    pthread_mutex_unlock(&mutex);
+
+    FileSystem* fresh = NULL;
+    ArchiveType* type = typeOf(archive_name);
+    if (type != NULL) {
+      try {
+        fresh = new FileSystem(archive_name, false, type);
+      }
+      catch (ArchiveDriver::ArchiveError&) {
+        fresh = NULL;
+      }
+    }
+
+    pthread_mutex_lock(&mutex);
+    FSMap::iterator it = map.find(archive_name);
+    FileSystem* old = (it != map.end()) ? it->second : NULL;
+
+    if (old != NULL && old->needsSave()) {
+      cerr << "Archive " << archive_name << " has changed on disk, but it contains "
+           << "unsaved changes - it is NOT reloaded" << endl;
+      if (fresh != NULL) victims.push_back(fresh);
+    } else {
+      if (old != NULL) retire(old);
+      if (fresh != NULL) {
+        map[fresh->archive_name] = fresh;
+        memory += fresh->footprint();
+        fresh->last_used = ++clock;
+        idle.insert(make_pair(fresh->last_used, fresh));
+        ++reloaded;
+      } else
+        types.erase(archive_name);
+    }
+
+    evict(victims);
+    sweep(victims);
+    again = dirty.find(archive_name) != dirty.end();
+    if (!again) refreshing.erase(archive_name);
+    pthread_mutex_unlock(&mutex);
+
+    dispose(victims);
+    victims.clear();
+  } while (again);
+}
+
+void FileSystemS::retire(FileSystem* fs) {
+  FSMap::iterator it = map.find(fs->archive_name);
+  if (it != map.end() && it->second == fs) {
+    memory -= fs->footprint();
+    map.erase(it);
+  }
+  idle.erase(make_pair(fs->last_used, fs));
+  fs->abandon();
+  retired.insert(fs);
+}
+
+void FileSystemS::sweep(vector<FileSystem*>& victims) {
+  set<FileSystem*>::iterator it = retired.begin();
+  while (it != retired.end()) {
+    if ((*it)->refs == 0) {
+      victims.push_back(*it);
+      retired.erase(it++);
+    } else
+      ++it;
+  }
+}
+
+void FileSystemS::evict(vector<FileSystem*>& victims) {
+  if (!eviction) return;
+
+  set<pair<unsigned long, FileSystem*> >::iterator it = idle.begin();
+  while (it != idle.end() &&
+         ((MAX_LOADED > 0 && map.size() > MAX_LOADED) ||
+          (MEMORY > 0 && memory > MEMORY))) {
+    FileSystem* fs = it->second;
+
+    /* Změněné archivy zůstávají, načítání s předstihem je při uvolnění
+     * archivu ukončeno (Prefetcher::forget()) */
+    if (!fs->evictable()) {
+      ++it;
+      continue;
+    }
+
+    idle.erase(it++);
+    map.erase(fs->archive_name);
+    memory -= fs->footprint();
+    victims.push_back(fs);
+    ++evicted;
+  }
+}
+
+void FileSystemS::report(ostream& out) {
+  pthread_mutex_lock(&mutex);
+  out << "archives_loaded " << map.size() << '\n';
+  out << "archives_memory " << memory << '\n';
+  out << "archives_idle " << idle.size() << '\n';
+  out << "archives_evicted " << evicted << '\n';
+  out << "archives_updated " << updated << '\n';
+  out << "archives_reloaded " << reloaded << '\n';
+  out << "archives_retired " << retired.size() << '\n';
+  out << "archives_nested " << nested << '\n';
+  out << "archives_shared " << shared.size() << '\n';
+  pthread_mutex_unlock(&mutex);
+}
+
+FileSystemRef::~FileSystemRef() {
+  reset(NULL);
+}
+
+void FileSystemRef::reset(FileSystem* _fs) {
+  if (fs != NULL) PRIVATE_DATA->filesystems->release(fs);
+  fs = _fs;
+}
+
+FileHandle::FileHandle(FileSystem* fs, FileNode* node)
+  : first(fs), second(node), readahead(NULL) {
+  PRIVATE_DATA->filesystems->acquire(fs);
+}
+
+FileHandle::~FileHandle() {
+  delete readahead;
+  PRIVATE_DATA->filesystems->release(first);
+}
+
 void printHelp() {
   cout << HELP_TEXT << endl << endl;
 }
@@ -172,6 +834,19 @@ bool controlArgs(FusePrivate* data) {
   if (data->respect_rights && data->create_archive)
     return false;
 
+  if (data->overlay && (data->compact || data->create_archive))
+    return false;
+
+  if (data->async_index && (data->mode == FusePrivate::FOLDER_MOUNTED ||
+                            data->create_archive || data->compact))
+    return false;
+
+  if (data->watch && data->mode != FusePrivate::FOLDER_MOUNTED)
+    return false;
+
+  if (data->share_identical && data->mode != FusePrivate::FOLDER_MOUNTED)
+    return false;
+
   return true;
 }
 
@@ -186,9 +861,36 @@ bool initialize(FusePrivate* data) {
   if (drivers->empty()) return false;
 
   FileSystem::setBufferLimit(data->buffer_limit);
+  MemBuffer::huge_pages = data->huge_pages;
+  if (data->spill_dir) {
+    char* path = realpath(data->spill_dir, NULL);
+    if (path == NULL) {
+      cerr << "Error: Cannot find spill directory " << data->spill_dir << endl;
+      return false;
+    }
+    free(data->spill_dir);
+    data->spill_dir = path;
+    FileBuffer::spill_dir = path;
+  }
+  ColdTier::IDLE = (data->cold_after > 0) ? data->cold_after : 0;
+  if (data->cold_ratio > 0 && data->cold_ratio <= 100) ColdTier::RATIO = data->cold_ratio;
+  FileSystem::setSmallCacheLimit(data->cache_limit, data->cache_file_size);
+  ReadAhead::MAX_WINDOW = (data->readahead > 0) ? data->readahead * 1024 : 0;
+  if (data->workers > 0) Executor::WORKERS = data->workers;
+  Prefetcher::LIMIT = offset_t(data->prefetch_limit > 0 ? data->prefetch_limit : 0) * 1024 * 1024;
+  Prefetcher::DIRECTORY_HITS = (data->dir_prefetch > 0) ? data->dir_prefetch : 0;
+  ArchiveDriver::scan_buffer_limit = offset_t(data->scan_buffer > 0 ? data->scan_buffer : 0) * 1024 * 1024;
+  ArchiveDriver::stream_limit = offset_t(data->stream_size > 0 ? data->stream_size : 0) * 1024 * 1024;
+  if (data->max_inflates > 0) Admission::MAX_ACTIVE = data->max_inflates;
+  Admission::MEMORY = offset_t(data->inflate_memory > 0 ? data->inflate_memory : 0) * 1024 * 1024;
   if (data->keep_trash)     FileSystem::keep_trash = true;
   if (data->respect_rights) ArchiveDriver::respect_rights = true;
   if (data->keep_original)  ArchiveDriver::keep_original = true;
+  if (data->overlay)        FileSystem::overlay = true;
+  if (data->compact)        FileSystem::compact = true;
+  FileSystemS::MAX_LOADED = (data->max_archives > 0) ? data->max_archives : 0;
+  FileSystemS::MEMORY = offset_t(data->archive_memory > 0 ? data->archive_memory : 0) * 1024 * 1024;
+  FileSystemS::SHARE_IDENTICAL = data->share_identical;
 
   /* První část inicializace */
   if (data->create_archive) {
@@ -264,7 +966,8 @@ bool initialize(FusePrivate* data) {
     }
 
     try {
-      fs = new FileSystem(data->mounted, data->create_archive, archive_type);
+      fs = new FileSystem(data->mounted, data->create_archive, archive_type,
+                          data->async_index);
     }
     catch (ArchiveDriver::ArchiveError&) {
       cerr << "Error: Failed to open/process archive file" << endl;
@@ -285,8 +988,13 @@ bool initialize(FusePrivate* data) {
     filename[mounted_len] = '/';
     filename_ptr = filename + mounted_len + 1;
 
-    /* Projdu celý připojený adresář a pokud obsahuje archivy podporovaných typů
-     * vytvořím jejich filesystémy */
+    /* Nepoužívané archivy lze uvolnit, při dalším přístupu jsou vybudovány
+     * znovu funkcí getFile() */
+    data->filesystems->enableEviction();
+
+    /* Projdu celý připojený adresář a archivy podporovaných typů pouze
+     * zaznamenám - jejich filesystémy budou vybudovány až při přístupu,
+     * případně na pozadí (--eager-index) */
     dir = opendir(data->mounted);
     while ((file = readdir(dir)) != NULL) {
       if (strcmp(file->d_name, ".") == 0 || strcmp(file->d_name, "..") == 0)
@@ -302,14 +1010,8 @@ bool initialize(FusePrivate* data) {
       if (S_ISREG(info.st_mode) || S_ISLNK(info.st_mode)) {
         archive_type = GET_TYPE(filename);
         if (archive_type != NULL) {
-          try {
-            fs = new FileSystem(filename, false, archive_type);
-          }
-          catch (...) {
-            continue;
-          }
-
-          data->filesystems->insert(fs);
+          data->filesystems->registerArchive(filename, archive_type);
+          if (data->eager_index) data->archives.push_back(filename);
         }
       }
     }
@@ -317,11 +1019,234 @@ bool initialize(FusePrivate* data) {
     closedir(dir);
   }
 
+  /* Démon mění pracovní adresář - cesty k souborům musí být absolutní */
+  if (data->record_manifest) {
+    data->record_manifest = absolutePath(data->record_manifest);
+    Prefetcher::global()->record(data->record_manifest);
+  }
+
+  if (data->stats_file) {
+    data->stats_file = absolutePath(data->stats_file);
+    Stats::PATH = data->stats_file;
+    if (data->stats_interval > 0) Stats::INTERVAL = data->stats_interval;
+    Stats::global()->add(data->filesystems);
+  }
+
+  if (data->replay_manifest) {
+    char* path = realpath(data->replay_manifest, NULL);
+    if (path == NULL) {
+      cerr << "Error: Cannot find prefetch manifest " << data->replay_manifest << endl;
+      return false;
+    }
+    free(data->replay_manifest);
+    data->replay_manifest = path;
+  }
+
 //   cout << "FILESYSTEM IS INITIALIZED" << endl;
 
   return true;
 }
 
+/* absolutePath()
+ *  relativní cestu doplní o aktuální pracovní adresář
+ */
+char* absolutePath(char* path) {
+  if (path[0] == '/') return path;
+
+  char* abs_path = (char*)malloc(PATH_MAX);
+  if (getcwd(abs_path, PATH_MAX) == NULL) abs_path[0] = '\0';
+  strncat(abs_path, "/", PATH_MAX - strlen(abs_path) - 1);
+  strncat(abs_path, path, PATH_MAX - strlen(abs_path) - 1);
+  free(path);
+  return abs_path;
+}
+
+/** \class IndexTask
+ * Úloha budující FileSystem archivu s předstihem (--eager-index).
+ */
+class IndexTask: public Task {
+public:
+  IndexTask(FileSystemS* _filesystems, const string& _archive)
+    : Task(LOW), filesystems(_filesystems), archive(_archive) {}
+
+  void run() {
+    FileSystem* fs = filesystems->load(archive.c_str());
+    if (fs != NULL) filesystems->release(fs);
+  }
+
+private:
+  FileSystemS* filesystems;
+  string archive;
+};
+
+/** \class RefreshTask
+ * Úloha zpracovávající změnu archivu na disku (--watch).
+ */
+class RefreshTask: public Task {
+public:
+  RefreshTask(FileSystemS* _filesystems, const string& _archive)
+    : Task(LOW), filesystems(_filesystems), archive(_archive) {}
+
+  void run() {
+    filesystems->refresh(archive.c_str());
+  }
+
+private:
+  FileSystemS* filesystems;
+  string archive;
+};
+
+/** \class ArchiveWatcher
+ * Sledování archivů připojeného adresáře (--watch). Změny zpracovávají
+ * úlohy Executoru, vlákno sledování tak nečeká na budování archivů.
+ */
+class ArchiveWatcher: public DirWatcher {
+public:
+  ArchiveWatcher(FileSystemS* _filesystems, const char* dir)
+    : DirWatcher(dir), filesystems(_filesystems) {}
+
+  ~ArchiveWatcher() {
+    stop();
+    for (vector<Task*>::iterator it = tasks.begin(); it != tasks.end(); ++it) {
+      (*it)->cancel();
+      (*it)->wait();
+      (*it)->release();
+    }
+  }
+
+protected:
+  void changed(const string& path) {
+    /* Dokončené úlohy jsou uvolněny */
+    vector<Task*>::iterator it = tasks.begin();
+    while (it != tasks.end()) {
+      if ((*it)->finished()) {
+        (*it)->release();
+        it = tasks.erase(it);
+      } else
+        ++it;
+    }
+
+    Task* task = new RefreshTask(filesystems, path);
+    task->acquire();
+    if (!Executor::global()->submit(task)) {
+      /* Bez vlákna je archiv obnoven hned, jinak by zůstal zastaralý */
+      Executor::execute(task);
+      task->release();
+      return;
+    }
+    tasks.push_back(task);
+  }
+
+private:
+  FileSystemS* filesystems;
+
+  /// Zařazené úlohy, volá jen vlákno sledování
+  vector<Task*> tasks;
+};
+
+/** \class ArchiveColdTier
+ * Komprese nepoužívaných dat bufferů změněných archivů (--cold-after).
+ */
+class ArchiveColdTier: public ColdTier {
+public:
+  ArchiveColdTier(FileSystemS* _filesystems)
+    : filesystems(_filesystems) {}
+
+  ~ArchiveColdTier() {
+    Stats::global()->remove(this);
+    stop();
+  }
+
+protected:
+  void sweep(time_t before) {
+    filesystems->freezeIdle(before, RATIO);
+  }
+
+private:
+  FileSystemS* filesystems;
+};
+
+/** \class ReplayTask
+ * Úloha spouštějící přehrání manifestu, pokud je archiv budován na pozadí
+ * (--async-index) - vyhledání položek čeká na jejich připojení.
+ */
+class ReplayTask: public Task {
+public:
+  ReplayTask(FusePrivate* _data)
+    : Task(LOW), data(_data) {}
+
+  void run() {
+    startReplay(data);
+  }
+
+private:
+  FusePrivate* data;
+};
+
+/* startIndexing()
+ *  zařadí budování zaznamenaných archivů do Executoru - archivy jsou tak
+ *  budovány paralelně, nejvýše tolik, kolik jich může zůstat načteno
+ */
+void startIndexing(FusePrivate* data) {
+  Task* task;
+  unsigned count = 0;
+
+  for (vector<string>::iterator it = data->archives.begin(); it != data->archives.end(); ++it) {
+    if (FileSystemS::MAX_LOADED > 0 && count >= FileSystemS::MAX_LOADED) break;
+
+    task = new IndexTask(data->filesystems, *it);
+    task->acquire();
+    if (!Executor::global()->submit(task)) {
+      /* Zrušená úloha je pouze uvolněna */
+      task->cancel();
+      Executor::execute(task);
+      task->release();
+      break;
+    }
+    data->index_tasks.push_back(task);
+    ++count;
+  }
+  data->archives.clear();
+}
+
+/* startReplay()
+ *  převede položky manifestu na uzly připojených FileSystémů a předá je
+ *  Prefetcheru, položky, které se nepodařilo nalézt, jsou přeskočeny
+ */
+void startReplay(FusePrivate* data) {
+  vector<Prefetcher::Entry> entries;
+  vector<pair<FileSystem*, FileNode*> > nodes;
+  FileSystem* fs;
+  FileNode* node;
+
+  if (!Prefetcher::loadManifest(data->replay_manifest, entries)) return;
+
+  for (vector<Prefetcher::Entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+    /* Reference drží FileSystem do předání Prefetcheru, ten jej nedrží -
+     * položky uvolněného archivu zapomene (Prefetcher::forget()).
+     * Archivy v připojeném adresáři nemusí být načteny - jsou vybudovány */
+    if (data->mode == FusePrivate::FOLDER_MOUNTED &&
+        STARTS_WITH(it->first, string(data->mounted) + "/"))
+      fs = data->filesystems->load(it->first.c_str());
+    else
+      fs = data->filesystems->acquire(it->first.c_str());
+    if (fs == NULL) continue;
+
+    node = fs->lookup(it->second.c_str());
+    if (node == NULL || node->type != FileNode::FILE_NODE) {
+      data->filesystems->release(fs);
+      continue;
+    }
+
+    nodes.push_back(pair<FileSystem*, FileNode*>(fs, node));
+  }
+
+  Prefetcher::global()->replay(nodes);
+
+  for (vector<pair<FileSystem*, FileNode*> >::iterator it = nodes.begin(); it != nodes.end(); ++it)
+    data->filesystems->release(it->first);
+}
+
 
 /* setMountMode()
  *  nastavuje v jakém modu bude program pracovat, což rozhodne podle toho,
@@ -423,17 +1348,63 @@ bool parsePathName(char* path, char** file) {
   return true;
 }
 
+/* enterNested()
+ *  prochází cestu file uvnitř archivu fs, pokud je některým z jejích
+ *  prefixů soubor archivu (podle přípony), nahradí fs FileSystémem
+ *  vnořeného archivu a file zbytkem cesty (NULL pro kořen vnořeného archivu)
+ *
+ *  vnořen může být pouze nezměněný soubor uložený v archivu
+ */
+static void enterNested(FileSystemRef& fs, char** file) {
+  FusePrivate* fuse_data = PRIVATE_DATA;
+
+  char* end = *file;
+  while (*file != NULL) {
+    while (*end != '\0' && *end != '/') ++end;
+
+    char c = *end;
+    *end = '\0';
+    FileNode* prefix = fs->lookup(*file);
+    ArchiveType* type = NULL;
+    if (prefix != NULL && prefix->type == FileNode::FILE_NODE &&
+        prefix->data != NULL && !prefix->changed)
+      type = TYPE_BY_NAME(prefix->name_ptr);
+
+    if (type == NULL) {
+      *end = c;
+      if (prefix == NULL || prefix->type == FileNode::FILE_NODE || c == '\0') return;
+      ++end;
+      continue;
+    }
+
+    string key(fs->archive_name);
+    key.push_back('/');
+    key.append(*file);
+    *end = c;
+
+    FileSystem* inner = fuse_data->filesystems->loadNested(fs, prefix, key.c_str(), type);
+    if (inner == NULL) return;
+    fs.reset(inner);
+
+    if (c == '\0' || *(end+1) == '\0') {
+      *file = NULL;
+    } else {
+      *file = end+1;
+      end = *file;
+    }
+  }
+}
+
 /* getFile()
- *  naplní ukazatele na FileSystem a FileNode, patřící k souboru, předanému
- *  přes fpath
+ *  naplní referenci na FileSystem a ukazatel na FileNode, patřící k souboru,
+ *  předanému přes fpath
  *
  *  pokud filesystém k danému archivu ještě není vytvořen, zkusí jej vytvořit
  *
  *  v pokud se patřičné objekty nepodaří nalézt, vrací false
  */
-bool getFile(char* fpath, FileSystem** fs, FileNode** node) {
+bool getFile(char* fpath, FileSystemRef& fs, FileNode** node, bool modify) {
   FusePrivate* fuse_data = PRIVATE_DATA;
-  ArchiveType* archive_type = NULL;
 
   char* fpath_dup = strdup(fpath);
   char* file = NULL;
@@ -443,34 +1414,12 @@ bool getFile(char* fpath, FileSystem** fs, FileNode** node) {
     return false;
   }
 
-  *fs = fuse_data->filesystems->find(fpath_dup);
-  if (*fs == NULL) {
-
-    /* Pokud nebyl odpovídající FileSystem nalezen, je možné, že
-     * ještě nebyl vytvořen ==> zkusím jej vytvořit.
-     * Pokud bude vyvolána vyjímka SourceFileError, znamená to, že
-     * FileSystem nemohl být vytvořen - není třeba jej uvolňovat.
-     * Pokud je zachycena jakákoliv jiná vyjímka, musel ji vyvolat ovladač
-     * patříčného archivu, přičemž objekt již byl vytvořen, proto jej
-     * třeba uvolnit.
-     */
-    if ((archive_type = GET_TYPE(fpath_dup)) != NULL) {
-      try {
-        *fs = new FileSystem(fpath_dup, false, archive_type);
-      }
-      catch (ArchiveDriver::ArchiveError&) {
-        free((void*)fpath_dup);
-        return false;
-      }
-
-      if (fuse_data->keep_trash) FileSystem::keep_trash = true;
+  if (modify) fuse_data->filesystems->unshare(fpath_dup);
 
-      fuse_data->filesystems->insert(*fs);
-    } else {
-      free((void*)fpath_dup);
-      *fs = NULL;
-      return false;
-    }
+  fs.reset(fuse_data->filesystems->load(fpath_dup));
+  if (fs == NULL) {
+    free((void*)fpath_dup);
+    return false;
   }
 
   // Neni potřeba vyhledavat soubor
@@ -479,11 +1428,14 @@ bool getFile(char* fpath, FileSystem** fs, FileNode** node) {
     return true;
   }
 
+  if (fuse_data->nested && file != NULL)
+    enterNested(fs, &file);
+
   // Pokud je cesta prázdná - jedná se o kořen filesystému
   if (file == NULL)
-    (*node) = (*fs)->getRoot();
+    (*node) = fs->getRoot();
   else
-    (*node) = (*fs)->find(file);
+    (*node) = fs->lookup(file);
 
   free((void*)fpath_dup);
   if (*node == NULL) {
@@ -494,6 +1446,35 @@ bool getFile(char* fpath, FileSystem** fs, FileNode** node) {
 }
 
 
+/* archiveRootAttr()
+ *  pokud je fpath cestou k souboru v připojeném adresáři, jehož FileSystem
+ *  není načten, vyplní jeho atributy bez budování FileSystému - archiv
+ *  jako kořenový adresář, jiný soubor podle stat()
+ *
+ *  vrací false, pokud je třeba soubor zpracovat funkcí getFile()
+ */
+bool archiveRootAttr(char* fpath, struct stat* info, int* ret) {
+  FusePrivate* fuse_data = PRIVATE_DATA;
+  if (fuse_data->mode != FusePrivate::FOLDER_MOUNTED) return false;
+
+  char* fpath_dup = strdup(fpath);
+  char* file = NULL;
+  bool handled = parsePathName(fpath_dup, &file) && file == NULL &&
+                 fuse_data->filesystems->find(fpath_dup) == NULL;
+
+  if (handled) {
+    *ret = 0;
+    if (fuse_data->filesystems->typeOf(fpath_dup) != NULL) {
+      FileNode root(NULL, NULL, FileNode::ROOT_NODE);
+      memcpy(info, &root.file_info, sizeof(struct stat));
+    } else if (stat(fpath, info) != 0)
+      *ret = errno;
+  }
+
+  free((void*)fpath_dup);
+  return handled;
+}
+
 /* convertFlagsToDir()
  *  struktuře předané parametrem nastaví práva a typ souboru = adresář
  */
@@ -516,6 +1497,51 @@ void print_err(const char* operation, const char* path, int err) {
 void* archivefs_init(struct fuse_conn_info* conn) {
   (void)conn;
   FusePrivate* fuse_data = PRIVATE_DATA;
+
+  /* Vlákna lze spouštět až v démonu */
+  if (!fuse_data->archives.empty())
+    startIndexing(fuse_data);
+
+  if (fuse_data->watch) {
+    fuse_data->watcher = new ArchiveWatcher(fuse_data->filesystems, fuse_data->mounted);
+    fuse_data->watcher->start();
+  }
+
+  /* Přípojný bod je k dispozici hned, archiv je budován na pozadí */
+  if (fuse_data->async_index) {
+    FileSystem* fs = fuse_data->filesystems->acquire(fuse_data->mounted);
+    if (fs != NULL) {
+      if (!fs->startIndexing())
+        cerr << "Error: Cannot start indexing of " << fuse_data->mounted << endl;
+      fuse_data->filesystems->release(fs);
+    }
+  }
+
+  if (fuse_data->replay_manifest) {
+    if (fuse_data->async_index) {
+      Task* task = new ReplayTask(fuse_data);
+      task->acquire();
+      if (Executor::global()->submit(task))
+        fuse_data->index_tasks.push_back(task);
+      else {
+        task->cancel();
+        Executor::execute(task);
+        task->release();
+      }
+    }
+    else
+      startReplay(fuse_data);
+  }
+
+  if (ColdTier::IDLE > 0) {
+    fuse_data->cold_tier = new ArchiveColdTier(fuse_data->filesystems);
+    if (fuse_data->cold_tier->start() && Stats::PATH)
+      Stats::global()->add(fuse_data->cold_tier);
+  }
+
+  if (Stats::PATH)
+    Stats::global()->start();
+
   return ((void*)fuse_data);
 }
 
@@ -529,11 +1555,17 @@ int archivefs_getattr(const char* path, struct stat* info) {
   char fpath[PATH_MAX];
   fullpath(fpath, path);
 
-  FileSystem* fs = NULL;
+  FileSystemRef fs;
   FileNode* node;
   int ret;
 
-  if (!getFile(fpath, &fs, &node)) {
+  /* Výpis připojeného adresáře nemá budovat všechny archivy */
+  if (archiveRootAttr(fpath, info, &ret)) {
+    if (ret) print_err("GETATTR", path, ret);
+    return -ret;
+  }
+
+  if (!getFile(fpath, fs, &node)) {
     /* fs byl nalezen, ale soubor ne */
     if (fs != NULL) {
       print_err("GETATTR", path, ENOENT);
@@ -563,8 +1595,8 @@ int archivefs_statfs(const char *path, struct statvfs *info) {
     return 0;
   }
 
-  FileSystem* fs;
-  if (!getFile(fpath, &fs, NULL)) {
+  FileSystemRef fs;
+  if (!getFile(fpath, fs, NULL)) {
     print_err("STATFS", path, ENOENT);
     return -ENOENT;
   }
@@ -577,9 +1609,9 @@ int archivefs_mknod(const char* path, mode_t mode, dev_t dev) {
   char fpath[PATH_MAX];
   fullpath(fpath, path);
 
-  FileSystem* fs;
+  FileSystemRef fs;
   int ret;
-  if (!getFile(fpath, &fs, NULL)) {
+  if (!getFile(fpath, fs, NULL, true)) {
     ret = mknod(fpath, mode, dev);
     if (ret) {
       ret = errno;
@@ -607,10 +1639,10 @@ int archivefs_create(const char *path, mode_t mode, struct fuse_file_info *info)
   char fpath[PATH_MAX];
   fullpath(fpath, path);
 
-  FileSystem* fs;
+  FileSystemRef fs;
   int ret;
 
-  if (!getFile(fpath, &fs, NULL)) {
+  if (!getFile(fpath, fs, NULL, true)) {
     ret = creat(fpath, mode);
     if (ret == -1) {
       ret = errno;
@@ -630,21 +1662,23 @@ int archivefs_create(const char *path, mode_t mode, struct fuse_file_info *info)
     return -EACCES;
 
   ret = fs->create(file, mode, &node);
-  if (ret)
+  if (ret) {
     print_err("CREATE", path, ret);
+    return -ret;
+  }
 
   info->fh = intptr_t(new FileHandle(fs, node));
-  return -ret;
+  return 0;
 }
 
 int archivefs_mkdir(const char* path, mode_t mode) {
   char fpath[PATH_MAX];
   fullpath(fpath, path);
 
-  FileSystem* fs;
+  FileSystemRef fs;
   int ret;
 
-  if (getFile(fpath, &fs, NULL)) {
+  if (getFile(fpath, fs, NULL, true)) {
     char* file;
     parsePathName(fpath, &file);
 
@@ -666,14 +1700,15 @@ int archivefs_mkdir(const char* path, mode_t mode) {
   const char* ext = findFileExt(fpath, NULL);
   if ((archive_type = TYPE_BY_EXT(ext)) != NULL) {
     FusePrivate* data = PRIVATE_DATA;
+    FileSystem* archive;
     try {
-      fs = new FileSystem(fpath, true, archive_type);
+      archive = new FileSystem(fpath, true, archive_type);
     }
     catch (...) {
       goto end_if;
     }
 
-    data->filesystems->insert(fs);
+    data->filesystems->insert(archive);
     cout << "New archive file was created" << endl;
     return 0;
   }
@@ -698,11 +1733,11 @@ int archivefs_rename(const char* old_path, const char* new_path) {
   char fpath_new[PATH_MAX];
   fullpath(fpath_new, new_path);
 
-  FileSystem* fs;
+  FileSystemRef fs;
   FileNode* node;
   int ret;
 
-  if (!getFile(fpath_old, &fs, &node)) {
+  if (!getFile(fpath_old, fs, &node, true)) {
     ret = rename(fpath_old, fpath_new);
     if (ret) {
       ret = errno;
@@ -713,6 +1748,11 @@ int archivefs_rename(const char* old_path, const char* new_path) {
 
   /* Přejmenovává se celý archív */
   if (node->type == FileNode::ROOT_NODE) {
+    if (fs->container() != NULL) {
+      print_err("RENAME", old_path, ENOTSUP);
+      return -ENOTSUP;
+    }
+
     ret = rename(fpath_old, fpath_new);
     if (ret) {
       ret = errno;
@@ -752,10 +1792,10 @@ int archivefs_open(const char* path, struct fuse_file_info* info) {
     return 0;
   }
 
-  FileSystem* fs;
+  FileSystemRef fs;
   FileNode* node;
 
-  if (!getFile(fpath, &fs, &node)) {
+  if (!getFile(fpath, fs, &node, info->flags & (O_WRONLY|O_RDWR))) {
     print_err("OPEN", path, ENOENT);
     return -ENOENT;
   }
@@ -778,7 +1818,10 @@ int archivefs_open(const char* path, struct fuse_file_info* info) {
     return -ret;
   }
 
-  info->fh = intptr_t(new FileHandle(fs, node));
+  FileHandle* fh = new FileHandle(fs, node);
+  if (ReadAhead::enabled())
+    fh->readahead = new ReadAhead(fs, node);
+  info->fh = intptr_t(fh);
 
   return 0;
 }
@@ -786,7 +1829,6 @@ int archivefs_open(const char* path, struct fuse_file_info* info) {
 int archivefs_read(const char *path, char *buffer, size_t bufsize,
                    off_t offset, struct fuse_file_info *info) {
   (void)path;
-  memset(buffer, 0, bufsize);
 
   FusePrivate* fuse_data = PRIVATE_DATA;
   FileHandle* fh = NULL;
@@ -801,7 +1843,7 @@ int archivefs_read(const char *path, char *buffer, size_t bufsize,
    */
   if (fuse_data->mode == FusePrivate::ARCHIVE_MOUNTED) {
     fh = reinterpret_cast<FileHandle*>(info->fh);
-    ret = (fh->first->read(fh->second, buffer, bufsize, offset));
+    ret = (fh->first->read(fh->second, buffer, bufsize, offset, fh->readahead));
   } else {
     char fpath[PATH_MAX];
     fullpath(fpath, path);
@@ -815,7 +1857,7 @@ int archivefs_read(const char *path, char *buffer, size_t bufsize,
       }
     } else {
       fh = reinterpret_cast<FileHandle*>(info->fh);
-      ret = (fh->first->read(fh->second, buffer, bufsize, offset));
+      ret = (fh->first->read(fh->second, buffer, bufsize, offset, fh->readahead));
       if (ret < 0)
         print_err("READ", path, ret);
     }
@@ -823,6 +1865,92 @@ int archivefs_read(const char *path, char *buffer, size_t bufsize,
   return ret;
 }
 
+#if FUSE_VERSION >= 29
+/* newBufvec()
+ *  alokuje fuse_bufvec s count úseky - libfuse jej po odeslání uvolní
+ *  funkcí free(), stejně jako paměť úseků
+ */
+static struct fuse_bufvec* newBufvec(size_t count) {
+  size_t size = sizeof(struct fuse_bufvec) + (count - 1) * sizeof(struct fuse_buf);
+  struct fuse_bufvec* bufvec = static_cast<struct fuse_bufvec*>(malloc(size));
+  if (bufvec == NULL) return NULL;
+  memset(bufvec, 0, size);
+  bufvec->count = count;
+  for (size_t i = 0; i < count; ++i) bufvec->buf[i].fd = -1;
+  return bufvec;
+}
+
+/* archivefs_read_buf()
+ *  soubor na disku a soubor uložený v archivu bez komprese (zip stored,
+ *  nekomprimovaný tar) předá libfuse jako úsek deskriptoru (jádro data
+ *  přenese spliceem); data bufferu jsou pod zámkem kopírována jen jednou
+ *  do odpovědi - libfuse paměť odpovědi uvolní free(), úsek bufferu tedy
+ *  předat nelze; soubor bez bufferu je čten ovladačem jako v archivefs_read
+ */
+int archivefs_read_buf(const char* path, struct fuse_bufvec** bufp, size_t size,
+                       off_t offset, struct fuse_file_info* info) {
+  FusePrivate* fuse_data = PRIVATE_DATA;
+  struct fuse_bufvec* bufvec;
+
+  if (fuse_data->mode != FusePrivate::ARCHIVE_MOUNTED) {
+    char fpath[PATH_MAX];
+    fullpath(fpath, path);
+
+    if (access(fpath, F_OK) == 0) {
+      if ((bufvec = newBufvec(1)) == NULL) return -ENOMEM;
+      bufvec->buf[0].flags = fuse_buf_flags(FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK);
+      bufvec->buf[0].fd = info->fh;
+      bufvec->buf[0].pos = offset;
+      bufvec->buf[0].size = size;
+      *bufp = bufvec;
+      return 0;
+    }
+  }
+
+  FileHandle* fh = reinterpret_cast<FileHandle*>(info->fh);
+  vector<BufferSlice> slices;
+
+  if (fh->first->readSlices(fh->second, size, offset, slices)) {
+    if ((bufvec = newBufvec(slices.empty() ? 1 : slices.size())) == NULL) {
+      for (vector<BufferSlice>::iterator it = slices.begin(); it != slices.end(); ++it)
+        if (it->data != NULL) free(const_cast<char*>(it->data));
+      return -ENOMEM;
+    }
+    for (size_t i = 0; i < slices.size(); ++i) {
+      struct fuse_buf& buf = bufvec->buf[i];
+      buf.size = slices[i].size;
+      if (slices[i].data != NULL) {
+        buf.mem = const_cast<char*>(slices[i].data);
+      } else {
+        buf.flags = fuse_buf_flags(FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK);
+        buf.fd = slices[i].fd;
+        buf.pos = slices[i].pos;
+      }
+    }
+    *bufp = bufvec;
+    return 0;
+  }
+
+  char* buffer = static_cast<char*>(malloc(size));
+  if (buffer == NULL || (bufvec = newBufvec(1)) == NULL) {
+    free(buffer);
+    return -ENOMEM;
+  }
+
+  int ret = fh->first->read(fh->second, buffer, size, offset, fh->readahead);
+  if (ret < 0) {
+    print_err("READ", path, ret);
+    free(buffer);
+    free(bufvec);
+    return ret;
+  }
+  bufvec->buf[0].mem = buffer;
+  bufvec->buf[0].size = ret;
+  *bufp = bufvec;
+  return 0;
+}
+#endif
+
 int archivefs_write(const char* path, const char* buffer, size_t len,
                     off_t offset, struct fuse_file_info* info) {
 
@@ -859,11 +1987,11 @@ int archivefs_truncate(const char* path, off_t size) {
   char fpath[PATH_MAX];
   fullpath(fpath, path);
 
-  FileSystem* fs;
+  FileSystemRef fs;
   FileNode* node;
   int ret;
 
-  if (!getFile(fpath, &fs, &node)) {
+  if (!getFile(fpath, fs, &node, true)) {
     ret = truncate(fpath, size);
     if (ret) {
       ret = errno;
@@ -885,11 +2013,11 @@ int archivefs_unlink(const char *path) {
   char fpath[PATH_MAX];
   fullpath(fpath, path);
 
-  FileSystem* fs;
+  FileSystemRef fs;
   FileNode* node;
   int ret;
 
-  if (!getFile(fpath, &fs, &node)) {
+  if (!getFile(fpath, fs, &node, true)) {
     ret = unlink(fpath);
     if (ret) {
       ret = errno;
@@ -907,11 +2035,11 @@ int archivefs_rmdir(const char* path) {
   char fpath[PATH_MAX];
   fullpath(fpath, path);
 
-  FileSystem* fs;
+  FileSystemRef fs;
   FileNode* node;
   int ret = 0;
 
-  if (!getFile(fpath, &fs, &node)) {
+  if (!getFile(fpath, fs, &node, true)) {
     ret = rmdir(fpath);
     if (ret) {
       ret = errno;
@@ -922,9 +2050,19 @@ int archivefs_rmdir(const char* path) {
 
   /* Je požadováno smazání archivu */
   if (node->type == FileNode::ROOT_NODE) {
+    /* Vnořený archiv je pouze pro čtení */
+    if (fs->container() != NULL) {
+      print_err("RMDIR", path, ENOTSUP);
+      return -ENOTSUP;
+    }
+
     FusePrivate* fuse_data = PRIVATE_DATA;
-    fuse_data->filesystems->erase(fs->archive_name);
-    delete fs;
+    /* Archiv má otevřené soubory */
+    if (!fuse_data->filesystems->detach(fs)) {
+      print_err("RMDIR", path, EBUSY);
+      return -EBUSY;
+    }
+    delete fs.take();
     ret = unlink(fpath);
     if (ret) {
       ret = errno;
@@ -950,6 +2088,9 @@ int archivefs_release(const char *path, struct fuse_file_info *info) {
    */
   if (fuse_data->mode == FusePrivate::ARCHIVE_MOUNTED) {
     fh = reinterpret_cast<FileHandle*>(info->fh);
+    /* Čtení s předstihem musí doběhnout před uzavřením souboru ovladačem */
+    delete fh->readahead;
+    fh->readahead = NULL;
     fh->first->close(fh->second);
     delete fh;
   } else {
@@ -960,6 +2101,8 @@ int archivefs_release(const char *path, struct fuse_file_info *info) {
       close(info->fh);
     } else {
       fh = reinterpret_cast<FileHandle*>(info->fh);
+      delete fh->readahead;
+      fh->readahead = NULL;
       fh->first->close(fh->second);
       delete fh;
     }
@@ -980,10 +2123,10 @@ int archivefs_opendir(const char *path, struct fuse_file_info *info) {
     return 0;
   }
 
-  FileSystem* fs;
+  FileSystemRef fs;
   FileNode* node;
 
-  if (!getFile(fpath, &fs, &node)) {
+  if (!getFile(fpath, fs, &node)) {
     print_err("OPENDIR", path, ENOENT);
     return -ENOENT;
   }
@@ -1029,6 +2172,8 @@ int archivefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         return -ret;
       } else {
         do {
+          /* Úložiště změn archivů (overlay) nejsou zobrazována */
+          if (ENDS_WITH(file->d_name, DeltaStore::SUFFIX)) continue;
           if (filler(buf, file->d_name, NULL, 0) != 0) {
             return -ENOMEM;
           }
@@ -1071,8 +2216,8 @@ int archivefs_releasedir(const char *path, struct fuse_file_info *info) {
     char fpath[PATH_MAX];
     fullpath(fpath, path);
 
-    FileSystem* fs;
-    if (getFile(fpath, &fs, NULL)) {
+    FileSystemRef fs;
+    if (getFile(fpath, fs, NULL)) {
       delete reinterpret_cast<FileHandle*>(info->fh);
     } else {
       closedir(reinterpret_cast<DIR*>(info->fh));
@@ -1084,12 +2229,12 @@ int archivefs_releasedir(const char *path, struct fuse_file_info *info) {
 int archivefs_access(const char* path, int mask) {
   char fpath[PATH_MAX];
   fullpath(fpath, path);
-  FileSystem* fs;
+  FileSystemRef fs;
   FileNode* node;
   int ret;
   struct fuse_context* context = fuse_get_context();
 
-  if (!getFile(fpath, &fs, &node)) {
+  if (!getFile(fpath, fs, &node)) {
     ret = access(fpath, mask);
     if (ret) {
       ret = errno;
@@ -1108,11 +2253,11 @@ int archivefs_utimens(const char* path, const struct timespec times[2]) {
   char fpath[PATH_MAX];
   fullpath(fpath, path);
 
-  FileSystem* fs;
+  FileSystemRef fs;
   FileNode* node;
   int ret;
 
-  if (!getFile(fpath, &fs, &node)) {
+  if (!getFile(fpath, fs, &node, true)) {
     ret = utimensat(0, fpath, times, 0);
     if (ret) {
       ret = errno;
@@ -1131,12 +2276,12 @@ int archivefs_chmod(const char* path, mode_t mode) {
   char fpath[PATH_MAX];
   fullpath(fpath, path);
 
-  FileSystem* fs;
+  FileSystemRef fs;
   FileNode* node;
 
   int ret;
 
-  if (!getFile(fpath, &fs, &node)) {
+  if (!getFile(fpath, fs, &node, true)) {
     if ((ret = chmod(fpath, mode)) != 0) {
       ret = errno;
       print_err("CHMOD", path, ret);
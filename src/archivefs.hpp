@@ -8,14 +8,20 @@
 #define ARCHIVE_FS_VERSION ("1.0 (march 2012)")
 
 #include <map>
+#include <set>
 #include <string>
 #include <cerrno>
 #include <cstddef>
+#include <cstring>
 
 #define FUSE_USE_VERSION 28
 #include <fuse.h>
 
 #include "filesystem.hpp"
+#include "prefetch.hpp"
+#include "admission.hpp"
+#include "watcher.hpp"
+#include "coldtier.hpp"
 
 #include <boost/algorithm/string/predicate.hpp>
 #define ENDS_WITH(STRING, ENDING) \
@@ -26,7 +32,22 @@ using namespace std;
 void printHelp();
 
 typedef map<const char*, FileSystem*, ltstr> FSMap;
-typedef pair<FileSystem*, FileNode*> FileHandle;
+
+/** \struct FileHandle
+ * Handle otevřeného souboru uvnitř archivu, předávaný FUSE v fuse_file_info.
+ * Kromě souboru samotného uchovává stav čtení s předstihem, který je pro
+ * každé otevření souboru samostatný.
+ */
+struct FileHandle {
+  /// Handle drží referenci na FileSystem, dokud není soubor uzavřen
+  FileHandle(FileSystem* fs, FileNode* node);
+  ~FileHandle();
+
+  FileSystem* first;
+  FileNode* second;
+  ReadAhead* readahead;
+};
+
 extern char* path_to_drivers;
 extern DriversVector* drivers;
 
@@ -38,39 +59,137 @@ extern DriversVector* drivers;
  * ukazatel na objekt FileSystem.
  * Definuje pouze potřebné metody.
  * THREAD SAFE & DESTROYING CONTAINED OBJECTS!
+ *
+ * FileSystémy jsou počítány referencemi - referenci drží každá probíhající
+ * operace FUSE (FileSystemRef) a každý otevřený soubor (FileHandle).
+ * Je-li povoleno uvolňování (připojený adresář), jsou nepoužívané
+ * a nezměněné FileSystémy uvolňovány od nejdéle nepoužitého, pokud je
+ * překročen počet MAX_LOADED nebo paměť MEMORY. Při dalším přístupu jsou
+ * vybudovány znovu.
  */
-class FileSystemS {
+class FileSystemS: public StatsSource {
   /// Asociativní pole s obsaženými soubory.
   FSMap map;
 
   /// Mutex použitý k synchronizaci.
   pthread_mutex_t mutex;
+
+  /// Čítač pro určení pořadí posledního použití
+  unsigned long clock;
+
+  /// Součet footprint() obsažených FileSystémů
+  offset_t memory;
+
+  /// Nepoužívané FileSystémy seřazené podle posledního použití
+  set<pair<unsigned long, FileSystem*> > idle;
+
+  /// Typy známých archivů (i nenačtených), zjištěné jen jednou
+  std::map<string, ArchiveType*> types;
+
+  /// Archivy, jejichž FileSystem je právě budován
+  set<string> building;
+  pthread_cond_t built;
+
+  unsigned long evicted;
+  bool eviction;
+
+  /// FileSystémy archivů nahrazených na disku, uvolněny po vrácení
+  /// poslední reference (otevřené soubory čtou dál původní verzi)
+  set<FileSystem*> retired;
+
+  /// Archivy, jejichž nová verze je budována, a archivy změněné znovu během
+  /// budování (viz refresh())
+  set<string> refreshing;
+  set<string> dirty;
+
+  unsigned long updated;
+  unsigned long reloaded;
+
+  /// Počet vybudovaných vnořených archivů
+  unsigned long nested;
+
+  /// Otisk archivu - velikost a otisk metadat (ArchiveDriver::fingerprint())
+  typedef pair<off_t, unsigned long long> Fingerprint;
+
+  /// Otisky vybudovaných archivů (otisk, archiv)
+  std::map<Fingerprint, string> fingerprints;
+
+  /// Archivy totožné s již vybudovaným archivem (archiv, vlastník FileSystému)
+  std::map<string, string> shared;
+
+  /// Zruší sdílení archivu v obou směrech, volá se se zamčeným mutexem
+  void dropShares(const string& archive_name);
+
+  /// Vybere a vyjme FileSystémy k uvolnění, volá se se zamčeným mutexem
+  void evict(vector<FileSystem*>& victims);
+
+  /// Vyjme FileSystem nahrazeného archivu, volá se se zamčeným mutexem
+  void retire(FileSystem* fs);
+
+  /// Vybere nepoužívané vyřazené FileSystémy, volá se se zamčeným mutexem
+  void sweep(vector<FileSystem*>& victims);
+
+  /// Vybuduje novou verzi archivu a nahradí jí načtenou
+  void reload(const char* archive_name);
+
+  /// Uvolní vybrané FileSystémy, volá se bez zámku
+  void dispose(vector<FileSystem*>& victims);
+
 public:
-  FileSystemS() {
+  /// Max. počet načtených archivů, 0 = neomezeno
+  static unsigned MAX_LOADED;
+
+  /// Max. paměť stromů načtených archivů, 0 = neomezeno
+  static offset_t MEMORY;
+
+  /// Totožné archivy sdílí jeden FileSystem (--share-identical)
+  static bool SHARE_IDENTICAL;
+
+  FileSystemS()
+    : clock(0), memory(0), evicted(0), eviction(false), updated(0), reloaded(0), nested(0) {
     pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&built, NULL);
   }
 
+  /// Před uvolněním FileSystémů jsou uloženy změny všech archivů
   ~FileSystemS() {
-    FSMap::iterator it;
-    for (it = map.begin(); it != map.end(); ++it) {
-      delete it->second;
-    }
+    Stats::global()->remove(this);
+    save();
+
+    /* Vnořené archivy (delší klíč) jsou uvolněny před vnějšími */
+    std::map<size_t, vector<FileSystem*> > by_length;
+    for (FSMap::iterator it = map.begin(); it != map.end(); ++it)
+      by_length[strlen(it->second->archive_name)].push_back(it->second);
+    for (set<FileSystem*>::iterator it = retired.begin(); it != retired.end(); ++it)
+      by_length[strlen((*it)->archive_name)].push_back(*it);
+
+    std::map<size_t, vector<FileSystem*> >::reverse_iterator it;
+    for (it = by_length.rbegin(); it != by_length.rend(); ++it)
+      for (vector<FileSystem*>::iterator fs = it->second.begin(); fs != it->second.end(); ++fs)
+        delete *fs;
+    pthread_cond_destroy(&built);
     pthread_mutex_destroy(&mutex);
   }
 
-  inline void insert(FileSystem* fs) {
-    pthread_mutex_lock(&mutex);
-    map[fs->archive_name] = fs;
-    pthread_mutex_unlock(&mutex);
+  /// Povolí uvolňování nepoužívaných FileSystémů
+  inline void enableEviction() {
+    eviction = true;
   }
 
-  inline void erase(const char* key) {
-    pthread_mutex_lock(&mutex);
-    FSMap::iterator it = map.find(key);
-    map.erase(it);
-    pthread_mutex_unlock(&mutex);
-  }
+  void insert(FileSystem* fs);
+  void erase(const char* key);
+
+  /**
+   * Uloží změny všech archivů. Archivy jsou ukládány paralelně vlákny
+   * Executoru, postupně jsou ukládány pouze FileSystémy nad týmž souborem.
+   * @return počet archivů, jejichž změny se nepodařilo uložit
+   */
+  unsigned save();
+
+  /// Zkomprimuje nepoužívané bloky bufferů změněných archivů (ColdTier)
+  void freezeIdle(time_t before, unsigned ratio);
 
+  /// Vyhledá FileSystem (bez získání reference)
   FileSystem* find (const char* key) {
     pthread_mutex_lock(&mutex);
     FSMap::iterator it = map.find(key);
@@ -82,6 +201,98 @@ public:
       return it->second;
     }
   }
+
+  /// Vyhledá FileSystem a získá na něj referenci
+  FileSystem* acquire(const char* key);
+
+  /// Získá další referenci na FileSystem, na nějž volající referenci drží
+  void acquire(FileSystem* fs);
+
+  /**
+   * Vrací FileSystem archivu s referencí, pokud není načten, vybuduje jej.
+   * Souběžné požadavky na týž archiv čekají na jediné budování.
+   * @return NULL pokud soubor není podporovaný archiv
+   */
+  FileSystem* load(const char* archive_name);
+
+  /**
+   * Vrací FileSystem archivu uloženého v souboru node archivu outer
+   * s referencí, pokud není načten, vybuduje jej. Volající drží referenci
+   * na outer.
+   * @param key jméno vnořeného archivu (cesta k archivu outer a k souboru)
+   * @return NULL pokud archiv nelze číst
+   */
+  FileSystem* loadNested(FileSystem* outer, FileNode* node, const char* key,
+                         ArchiveType* type);
+
+  /**
+   * Zruší sdílení FileSystému archivu s totožnými archivy, volá se před
+   * změnou archivu. Archiv, který sdílel cizí FileSystem, bude při dalším
+   * přístupu vybudován samostatně.
+   */
+  void unshare(const char* archive_name);
+
+  /// Zaznamená typ archivu, FileSystem bude vybudován až při přístupu
+  void registerArchive(const char* archive_name, ArchiveType* type);
+
+  /**
+   * Vrací typ archivu, případně jej zjistí a zaznamená.
+   * @return NULL pokud soubor není podporovaný archiv
+   */
+  ArchiveType* typeOf(const char* archive_name);
+
+  /// Vrátí referenci, případně uvolní nepoužívané FileSystémy
+  void release(FileSystem* fs);
+
+  /**
+   * Vyjme FileSystem, na nějž drží referenci pouze volající (mazání archivu).
+   * @return false pokud FileSystem používá někdo další
+   */
+  bool detach(FileSystem* fs);
+
+  /**
+   * Zpracuje změnu archivu na disku (ArchiveWatcher). Nepoužívaný archiv,
+   * ke kterému byla data pouze připojena, je doplněn ovladačem, jinak je
+   * na pozadí vybudována nová verze, která nahradí původní. Archiv
+   * s neuloženými změnami nahrazen není.
+   */
+  void refresh(const char* archive_name);
+
+  void report(ostream& out);
+};
+
+/** \class FileSystemRef
+ * Reference na FileSystem získaná funkcí getFile() po dobu operace FUSE,
+ * vrácena je v destruktoru.
+ */
+class FileSystemRef {
+public:
+  FileSystemRef() : fs(NULL) {}
+  ~FileSystemRef();
+
+  inline operator FileSystem*() const {
+    return fs;
+  }
+
+  inline FileSystem* operator->() const {
+    return fs;
+  }
+
+  /// Nastaví referenci, dříve držená reference je vrácena
+  void reset(FileSystem* _fs);
+
+  /// Předá FileSystem volajícímu, reference již nebude vrácena
+  inline FileSystem* take() {
+    FileSystem* taken = fs;
+    fs = NULL;
+    return taken;
+  }
+
+private:
+  FileSystem* fs;
+
+  FileSystemRef(const FileSystemRef&);
+  FileSystemRef& operator=(const FileSystemRef&);
 };
 
 
@@ -97,26 +308,79 @@ public:
     args.allocated = 0;
     filesystems    = new FileSystemS;
     keep_trash     = false;
+    huge_pages     = false;
     create_archive = false;
     read_only      = false;
     load_driver    = false;
     respect_rights = false;
     keep_original  = false;
+    overlay        = false;
+    eager_index    = false;
+    async_index    = false;
+    watch          = false;
+    nested         = false;
+    share_identical = false;
+    compact        = false;
     buffer_limit   = 100;
+    cache_limit    = 0;
+    cache_file_size = 8;
+    readahead      = 1024;
+    workers        = 4;
+    prefetch_limit = 256;
+    dir_prefetch   = 0;
+    scan_buffer    = 64;
+    stream_size    = 2048;
+    max_inflates   = 4;
+    inflate_memory = 512;
+    max_archives   = 256;
+    archive_memory = 256;
+    record_manifest = NULL;
+    stats_file     = NULL;
+    stats_interval = 5;
+    replay_manifest = NULL;
     drivers_path   = NULL;
+    spill_dir      = NULL;
+    cold_after     = 0;
+    cold_ratio     = 50;
     mounted = mountpoint = NULL;
+    watcher        = NULL;
+    cold_tier      = NULL;
   }
 
   ~FusePrivate() {
     fuse_opt_free_args(&args);
 
+    /* Změny archivů zpracovávají úlohy pracující s filesystems */
+    delete watcher;
+
+    /* Budování archivů a přehrání manifestu na pozadí pracují s filesystems */
+    for (vector<Task*>::iterator it = index_tasks.begin(); it != index_tasks.end(); ++it) {
+      (*it)->cancel();
+      (*it)->wait();
+      (*it)->release();
+    }
+
+    /* Prefetcher odkazuje na uzly FileSystémů */
+    Prefetcher::destroyGlobal();
+
+    /* Komprese bufferů pracuje s filesystems */
+    delete cold_tier;
+
     delete filesystems;
 
+    Executor::destroyGlobal();
+    Admission::destroyGlobal();
+    Stats::destroyGlobal();
+
     UNLOAD_DRIVERS();
 
     free(mounted);
     free(mountpoint);
     free(drivers_path);
+    free(spill_dir);
+    free(record_manifest);
+    free(stats_file);
+    free(replay_manifest);
   }
 
   struct fuse_args args;
@@ -150,13 +414,52 @@ public:
   char* mounted;
 
   bool keep_trash;
+  bool huge_pages;
   bool create_archive;
   bool read_only;
   bool load_driver;
   bool respect_rights;
   bool keep_original;
+  bool overlay;
+  bool compact;
+  bool eager_index;
+  bool async_index;
+  bool watch;
+  bool nested;
+  bool share_identical;
   int buffer_limit;
+  int cache_limit;
+  int cache_file_size;
+  int readahead;
+  int workers;
+  int prefetch_limit;
+  int dir_prefetch;
+  int scan_buffer;
+  int stream_size;
+  int max_inflates;
+  int inflate_memory;
+  int max_archives;
+  int archive_memory;
+  char* record_manifest;
+  char* stats_file;
+  int stats_interval;
+  char* replay_manifest;
   char* drivers_path;
+  char* spill_dir;
+  int cold_after;
+  int cold_ratio;
+
+  /// Archivy k vybudování na pozadí (--eager-index)
+  vector<string> archives;
+
+  /// Úlohy budování archivů a přehrání manifestu (--async-index)
+  vector<Task*> index_tasks;
+
+  /// Sledování změn archivů v připojeném adresáři (--watch)
+  DirWatcher* watcher;
+
+  /// Komprese nepoužívaných dat bufferů (--cold-after)
+  ColdTier* cold_tier;
 };
 
 
@@ -177,7 +480,34 @@ static struct fuse_opt fuse_opts[] = {
   AFS_OPT("--drivers-path=%s",       drivers_path,   0),
   AFS_OPT("--load-drivers",          load_driver,    true),
   AFS_OPT("--buffer-limit=%i",       buffer_limit,   0),
+  AFS_OPT("--huge-pages",            huge_pages,     true),
+  AFS_OPT("--spill-dir=%s",          spill_dir,      0),
+  AFS_OPT("--cold-after=%i",         cold_after,     0),
+  AFS_OPT("--cold-ratio=%i",         cold_ratio,     0),
   AFS_OPT("--keep-original",         keep_original,  true),
+  AFS_OPT("--overlay",               overlay,        true),
+  AFS_OPT("--compact",               compact,        true),
+  AFS_OPT("--cache-limit=%i",        cache_limit,    0),
+  AFS_OPT("--cache-file-size=%i",    cache_file_size, 0),
+  AFS_OPT("--readahead=%i",          readahead,      0),
+  AFS_OPT("--workers=%i",            workers,        0),
+  AFS_OPT("--stats-file=%s",         stats_file,     0),
+  AFS_OPT("--stats-interval=%i",     stats_interval, 0),
+  AFS_OPT("--record-manifest=%s",    record_manifest, 0),
+  AFS_OPT("--replay-manifest=%s",    replay_manifest, 0),
+  AFS_OPT("--prefetch-limit=%i",     prefetch_limit, 0),
+  AFS_OPT("--dir-prefetch=%i",       dir_prefetch,   0),
+  AFS_OPT("--scan-buffer=%i",        scan_buffer,    0),
+  AFS_OPT("--stream-size=%i",        stream_size,    0),
+  AFS_OPT("--max-inflates=%i",       max_inflates,   0),
+  AFS_OPT("--inflate-memory=%i",     inflate_memory, 0),
+  AFS_OPT("--max-archives=%i",       max_archives,   0),
+  AFS_OPT("--eager-index",           eager_index,    true),
+  AFS_OPT("--async-index",           async_index,    true),
+  AFS_OPT("--watch",                 watch,          true),
+  AFS_OPT("--nested",                nested,         true),
+  AFS_OPT("--share-identical",       share_identical, true),
+  AFS_OPT("--archive-memory=%i",     archive_memory, 0),
 
 
   FUSE_OPT_KEY("-l",                 KEY_SUPPORTED),
@@ -208,6 +538,10 @@ const char* HELP_TEXT = "\nArchiveFS\n"
 "    -l  --list-supported\tlist supported file archives\n"
 "    -r  --read-only\t\tcreate read-only filesystem\n"
 "        --keep-original\t\tkeep original archive file\n"
+"        --overlay\t\tstore changes next to the archive (<archive>.afsdelta)\n"
+"\t\t\t\tinstead of rewriting it\n"
+"        --compact\t\twrite changes stored next to the archive into it\n"
+"\t\t\t\tand exit, no mountpoint is needed\n"
 "    -R  --respect-rights\trespect file access rights stored in archive\n"
 "    -c  --create\t\twill create new archive file\n"
 "        --load-drivers %s %s...\tload this drivers (space separated list) [specify last]\n"
@@ -218,6 +552,57 @@ const char* HELP_TEXT = "\nArchiveFS\n"
 "        --buffer-limit=%i\tmax size (in MB) of memory buffer for keeping\n"
 "\t\t\t\tdata of a single file\n"
 "\t\t\t\tdefault (100), unlimited(-1), dont keep in memory(0)\n"
+"        --huge-pages		allow transparent huge pages for large memory\n"
+"\t\t\t\tbuffers\n"
+"        --spill-dir=%s\tdirectory for data of files over --buffer-limit\n"
+"\t\t\t\tdefault (/tmp)\n"
+"        --cold-after=%i\tcompress memory buffers of changed files unused\n"
+"\t\t\t\tfor this many seconds, default (0) = disabled\n"
+"        --cold-ratio=%i\tkeep compressed only data shrunk to this many\n"
+"\t\t\t\tpercent of original size, default (50)\n"
+"        --cache-limit=%i\tmax size (in MB) of memory used for content of\n"
+"\t\t\t\tsmall files read while indexing archives\n"
+"\t\t\t\tdefault (0) = cache disabled\n"
+"        --cache-file-size=%i\tmax size (in kB) of a file kept in the cache\n"
+"\t\t\t\tdefault (8)\n"
+"        --readahead=%i\t\tmax size (in kB) of data read ahead for files\n"
+"\t\t\t\tread sequentially, default (1024), disabled (0)\n"
+"        --workers=%i\t\tnumber of threads for background work, default (4)\n"
+"        --stats-file=%s\tperiodically write statistics into this file\n"
+"        --stats-interval=%i\tinterval (in seconds) of writing statistics\n"
+"\t\t\t\tdefault (5)\n"
+"        --record-manifest=%s\trecord files opened during this session\n"
+"\t\t\t\tinto prefetch manifest\n"
+"        --replay-manifest=%s\tprefetch files listed in manifest into memory\n"
+"        --prefetch-limit=%i\tmax size (in MB) of prefetched data not yet\n"
+"\t\t\t\topened, default (256)\n"
+"        --dir-prefetch=%i\tprefetch remaining files of a listed directory\n"
+"\t\t\t\tafter this many of them were opened\n"
+"\t\t\t\tdefault disabled (0)\n"
+"        --scan-buffer=%i\tmax size (in MB) of files decompressed ahead\n"
+"\t\t\t\twhen compressed tar is read out of order\n"
+"\t\t\t\tdefault (64), disabled (0)\n"
+"        --stream-size=%i	files bigger than this (in MB) in zip and tar.gz\n"
+"\t\t\t\tare read as a stream, not decompressed whole\n"
+"\t\t\t\tdefault (2048), never (0)\n"
+"        --max-inflates=%i\tmax number of files decompressed at once\n"
+"\t\t\t\tdefault (4)\n"
+"        --inflate-memory=%i\tmax size (in MB) of memory reserved for files\n"
+"\t\t\t\tbeing decompressed, default (512), unlimited (0)\n"
+"        --max-archives=%i\tmax number of archives kept loaded when a folder\n"
+"\t\t\t\tis mounted, default (256), unlimited (0)\n"
+"        --archive-memory=%i\tmax size (in MB) of memory used by loaded archives\n"
+"\t\t\t\twhen a folder is mounted, default (256), unlimited (0)\n"
+"        --eager-index\t\tindex archives of a mounted folder in background\n"
+"\t\t\t\tright after mounting, not on first access\n"
+"        --async-index\t\tmount a single archive at once and index it\n"
+"\t\t\t\tin background, progress is in --stats-file\n"
+"        --watch\t\t\treload archives of a mounted folder changed\n"
+"\t\t\t\ton disk, appended tar archives are only updated\n"
+"        --nested		show archives stored inside archives as read-only\n"
+"\t\t\t\tdirectories (uncompressed tar, iso)\n"
+"        --share-identical	identical archives of a mounted folder share\n"
+"\t\t\t\tone index and buffers until one of them is changed\n"
 ;
 
 const char* RUN_AS_ROOT_WARN = "WARNING\n"
@@ -264,13 +649,43 @@ void fullpath(char*, const char*);
 void parsePathName(char*, string&, string&);
 
 
-bool getFile(char*, FileSystem**, FileNode**);
+/**
+ * Vyplní atributy souboru v připojeném adresáři bez budování FileSystému
+ * archivu, pokud není načten.
+ * @return false pokud je třeba soubor zpracovat funkcí getFile()
+ */
+bool archiveRootAttr(char* fpath, struct stat* info, int* ret);
+
+/**
+ * Naplní referenci na FileSystem a ukazatel na FileNode souboru s cestou
+ * fpath, FileSystem archivu je případně vybudován.
+ * Před změnou archivu (modify) je zrušeno jeho sdílení (--share-identical).
+ */
+bool getFile(char*, FileSystemRef&, FileNode**, bool modify = false);
+
+/**
+ * Spustí budování FileSystémů zaznamenaných archivů na pozadí (--eager-index).
+ * Volá se až z archivefs_init() - po démonizaci procesu.
+ */
+void startIndexing(FusePrivate*);
 
 /**
  * Funkce zajišťující inicializaci celého filesystému.
  */
 bool initialize(FusePrivate*);
 
+/**
+ * Vrací absolutní cestu k souboru path (soubor nemusí existovat),
+ * původní řetězec uvolní. Démon totiž mění pracovní adresář.
+ */
+char* absolutePath(char* path);
+
+/**
+ * Načte manifest a spustí načítání v něm uvedených souborů s předstihem.
+ * Volá se až z archivefs_init() - po démonizaci procesu.
+ */
+void startReplay(FusePrivate*);
+
 /******************************************************************************
  * FUSE OPARATIONS
  *****************************************************************************/
@@ -329,6 +744,15 @@ int archivefs_open(const char* path, struct fuse_file_info* info);
 int archivefs_read(const char *path, char *buffer, size_t bufsize,
                    off_t offset, struct fuse_file_info *info);
 
+#if FUSE_VERSION >= 29
+/** Read data from an open file into a bufvec (FUSE 2.9)
+ *  Data of buffered files are passed as file descriptors or copied once,
+ *  libfuse frees the bufvec and the memory of its buffers.
+ */
+int archivefs_read_buf(const char* path, struct fuse_bufvec** bufp, size_t size,
+                       off_t offset, struct fuse_file_info* info);
+#endif
+
 /** Read the target of a symbolic link
  *
  * The buffer should be filled with a null terminated string.  The
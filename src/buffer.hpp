@@ -13,6 +13,7 @@
 
 #include "filebuffer.hpp"
 #include "membuffer.hpp"
+#include "tieredbuffer.hpp"
 
 class Buffer {
 public:
@@ -21,24 +22,38 @@ public:
   static const unsigned BLOCK_SIZE = 4*1024;
 
   /// Definuje mez pro velikost paměťového bufferu
-  /** Po jejím překročení bude poměťový buffer zapsán do souborového bufferu
-   *  a uvolněn. */
+  /** Data za touto mezí jsou ukládána do souborového bufferu, data před ní
+   *  zůstávají v paměti (TieredBuffer). */
   static offset_t MEM_LIMIT;
 
   Buffer(offset_t size = 0) {
-    if ((size > MEM_LIMIT && MEM_LIMIT > 0) || MEM_LIMIT == 0) {
+    if (MEM_LIMIT == 0) {
       _buffer = new FileBuffer(size);
       _type = FILE;
+    } else if (size > MEM_LIMIT && MEM_LIMIT > 0) {
+      _buffer = new TieredBuffer(size, MEM_LIMIT);
+      _type = TIERED;
     } else {
       _buffer = new MemBuffer(size);
       _type = MEM;
     }
   }
 
+  /**
+   * Souborový buffer nad existujícím souborem path o velikosti size.
+   * @throw int errno pokud soubor nelze otevřít
+   */
+  Buffer(const char* path, offset_t size) {
+    _buffer = new FileBuffer(path, size);
+    _type = FILE;
+  }
+
   Buffer(const Buffer& old) {
     _type = old._type;
     if (_type == MEM)
       _buffer = new MemBuffer(*(static_cast<MemBuffer*>(old._buffer)));
+    else if (_type == TIERED)
+      _buffer = new TieredBuffer(*(static_cast<TieredBuffer*>(old._buffer)));
     else
       _buffer = new FileBuffer(*(static_cast<FileBuffer*>(old._buffer)));
   }
@@ -52,11 +67,12 @@ public:
 
   /**
    * Funkce pro uvolnění a případnou dealokaci bufferu.
-   * Pokud buffer sídlí v paměti je uvolněn a funkce vrací true.
-   * Pokud sídlí na disku, není uvolněn a funkce vrací false.
+   * Pokud buffer sídlí v paměti (i zčásti - TieredBuffer) je uvolněn
+   * a funkce vrací true. Pokud sídlí celý na disku, není uvolněn a funkce
+   * vrací false.
    */
   bool release() {
-    if (_type == MEM) {
+    if (_type == MEM || _type == TIERED) {
       delete this;
       return true;
     }
@@ -74,6 +90,16 @@ public:
     return _buffer->read(buffer, length, offset);
   }
 
+  /**
+   * Připojí k out úseky dat bufferu v rozsahu <offset, offset+length) -
+   * paměť bufferu nebo deskriptor souborového bufferu, data nekopíruje.
+   * Úseky jsou platné, dokud není buffer změněn nebo uvolněn.
+   * @returns délka úseků
+   */
+  size_t slices(offset_t offset, size_t length, vector<BufferSlice>& out) const {
+    return _buffer->slices(offset, length, out);
+  }
+
   /**
    * Funkce zapíše do bufferu data odkazovaná ukazatelem data o délce
    * length, na místo v bufferu s offsetem offset.
@@ -83,20 +109,12 @@ public:
    * @returns počet zapsaných bytů
    */
   size_t write(const char* data, size_t length, offset_t offset) {
-    offset_t total = offset + length;
-    if (total > MEM_LIMIT && MEM_LIMIT > 0 && _type == MEM) {
-      MemBuffer* mem_buf = static_cast<MemBuffer*>(_buffer);
-      FileBuffer* file_buf = new FileBuffer(mem_buf->length());
-      mem_buf->flushToFile(file_buf->getFd());
-      _buffer = file_buf;
-      _type = FILE;
-      delete mem_buf;
-    }
+    spillOver(offset + length);
     return _buffer->write(data, length, offset);
   }
 
   void truncate(offset_t size) {
-    //TODO: mem to file
+    spillOver(size);
     _buffer->truncate(size);
   }
 
@@ -104,9 +122,49 @@ public:
     return _buffer->length();
   }
 
+  /**
+   * Díry bufferu (nezapsaná místa čtená jako nuly) nezabírají paměť ani
+   * místo na disku. Data leží v úsecích <seekData(o), seekHole(seekData(o))).
+   */
+  offset_t seekData(offset_t offset) const {
+    return _buffer->seekData(offset);
+  }
+
+  offset_t seekHole(offset_t offset) const {
+    return _buffer->seekHole(offset);
+  }
+
+  /**
+   * Zkomprimuje jeden nepoužívaný blok paměťové části bufferu.
+   * @returns velikost zpracovaného bloku, 0 pokud žádný nezbývá
+   */
+  size_t freeze(time_t before, unsigned ratio) {
+    if (_type == MEM)
+      return static_cast<MemBuffer*>(_buffer)->freeze(before, ratio);
+    if (_type == TIERED)
+      return static_cast<TieredBuffer*>(_buffer)->freeze(before, ratio);
+    return 0;
+  }
+
+  /// Cesta k souboru, nad kterým byl buffer vytvořen, jinak NULL
+  inline const char* path() const {
+    return (_type == FILE) ? static_cast<FileBuffer*>(_buffer)->path() : NULL;
+  }
+
 private:
   BufferIface* _buffer;
-  enum buffer_type {MEM, FILE} _type;
+  enum buffer_type {MEM, FILE, TIERED} _type;
+
+  /**
+   * Paměťový buffer, který má přesáhnout MEM_LIMIT, se stane počátkem
+   * TieredBufferu - data nejsou kopírována, do souboru jde až zbytek.
+   */
+  void spillOver(offset_t total) {
+    if (total > MEM_LIMIT && MEM_LIMIT > 0 && _type == MEM) {
+      _buffer = new TieredBuffer(static_cast<MemBuffer*>(_buffer), MEM_LIMIT);
+      _type = TIERED;
+    }
+  }
 };
 
 
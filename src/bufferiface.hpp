@@ -8,6 +8,7 @@
 #ifndef BUFFER_IFACE_HPP
 #define BUFFER_IFACE_HPP
 
+#include <vector>
 #include <sys/types.h>
 
 #ifdef _LFS_LARGEFILE
@@ -17,12 +18,29 @@ typedef off_t offset_t;
 #endif
 
 
+/** \struct BufferSlice
+ * Úsek dat bufferu bez kopírování - paměť (data) nebo soubor (data == NULL,
+ * deskriptor fd od pozice pos).
+ */
+struct BufferSlice {
+  const char* data;
+  int fd;
+  offset_t pos;
+  size_t size;
+};
+
 struct BufferIface {
   virtual ~BufferIface() {}
+  /// Připojí k out úseky s daty v rozsahu <offset, offset+bytes), vrací jejich délku
+  virtual size_t slices(offset_t offset, size_t bytes, std::vector<BufferSlice>& out) const = 0;
   virtual size_t read(char*, offset_t, offset_t) const = 0;
   virtual size_t write(const char*, offset_t, offset_t) = 0;
   virtual void truncate(offset_t) = 0;
   virtual offset_t length() = 0;
+  /// Pozice prvních dat od offset (jako SEEK_DATA), délka bufferu pokud už jsou jen díry
+  virtual offset_t seekData(offset_t offset) const = 0;
+  /// Pozice první díry od offset (jako SEEK_HOLE), délka bufferu pokud díra není
+  virtual offset_t seekHole(offset_t offset) const = 0;
 };
 
 #endif
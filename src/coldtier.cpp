@@ -0,0 +1,93 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     File implementing compression of idle buffer data
+ * Modified: 04/2012
+ */
+
+#include <cerrno>
+#include <iostream>
+#include <sys/time.h>
+
+#include "coldtier.hpp"
+#include "membuffer.hpp"
+
+unsigned ColdTier::IDLE = 0;
+unsigned ColdTier::RATIO = 50;
+
+ColdTier::ColdTier()
+  : running(false),
+    stopping(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+}
+
+ColdTier::~ColdTier() {
+  stop();
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+bool ColdTier::start() {
+  if (IDLE == 0 || running) return false;
+
+  running = (pthread_create(&thread, NULL, run, this) == 0);
+  if (!running) cerr << "ColdTier: cannot create thread" << endl;
+  return running;
+}
+
+void ColdTier::stop() {
+  if (!running) return;
+
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+
+  pthread_join(thread, NULL);
+  running = false;
+}
+
+/* ColdTier::report
+ *  poměr komprese je v procentech (komprimovaná / původní velikost dat
+ *  právě uložených komprimovaně), čas procesoru v milisekundách
+ */
+void ColdTier::report(ostream& out) {
+  const MemBuffer::ColdCounters& cold = MemBuffer::cold;
+  unsigned long long raw = cold.raw_bytes;
+  unsigned long long packed = cold.packed_bytes;
+
+  out << "cold_raw_bytes " << raw << '\n'
+      << "cold_packed_bytes " << packed << '\n'
+      << "cold_ratio " << ((raw > 0) ? packed * 100 / raw : 0) << '\n'
+      << "cold_freezes " << cold.freezes << '\n'
+      << "cold_thaws " << cold.thaws << '\n'
+      << "cold_rejected " << cold.rejected << '\n'
+      << "cold_freeze_ms " << cold.freeze_us / 1000 << '\n'
+      << "cold_thaw_ms " << cold.thaw_us / 1000 << '\n';
+}
+
+void* ColdTier::run(void* data) {
+  ColdTier* tier = reinterpret_cast<ColdTier*>(data);
+  unsigned period = (IDLE > 1) ? IDLE / 2 : 1;
+  struct timeval now;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&tier->mutex);
+  while (!tier->stopping) {
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + period;
+    deadline.tv_nsec = now.tv_usec * 1000;
+    while (!tier->stopping &&
+           pthread_cond_timedwait(&tier->cond, &tier->mutex, &deadline) != ETIMEDOUT)
+      ;
+    if (tier->stopping) break;
+
+    pthread_mutex_unlock(&tier->mutex);
+    tier->sweep(time(NULL) - IDLE);
+    pthread_mutex_lock(&tier->mutex);
+  }
+  pthread_mutex_unlock(&tier->mutex);
+
+  return NULL;
+}
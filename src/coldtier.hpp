@@ -0,0 +1,64 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     Header file for coldtier.cpp
+ * Modified: 04/2012
+ */
+
+#ifndef COLD_TIER_HPP
+#define COLD_TIER_HPP
+
+#include <ctime>
+#include <pthread.h>
+
+#include "stats.hpp"
+
+using namespace std;
+
+/// Komprese nepoužívaných dat bufferů
+/** \class ColdTier
+ * Vlákno každou polovinu doby IDLE volá sweep(), který komprimuje bloky
+ * paměťových bufferů nepoužité alespoň IDLE sekund (MemBuffer::freeze).
+ * Blok, který se nezmenší alespoň na RATIO procent, zůstává nezkomprimován.
+ * Zkomprimovaný blok je dekomprimován při dalším čtení nebo zápisu.
+ */
+class ColdTier: public StatsSource {
+public:
+  /// Doba nepoužívání v sekundách, po které je blok komprimován, 0 vypíná
+  static unsigned IDLE;
+
+  /// Max. velikost zkomprimovaného bloku v procentech původní velikosti
+  static unsigned RATIO;
+
+  ColdTier();
+
+  /// Potomek musí vlákno zastavit (stop()) již ve svém destruktoru
+  virtual ~ColdTier();
+
+  /// Spustí vlákno (až po démonizaci)
+  bool start();
+
+  /// Zastaví vlákno, po návratu již není sweep() volán
+  void stop();
+
+  void report(ostream& out);
+
+protected:
+  /// Volá vlákno, komprimuje bloky nepoužité od času before
+  virtual void sweep(time_t before) = 0;
+
+private:
+  pthread_t thread;
+  bool running;
+  bool stopping;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  static void* run(void* tier);
+
+  ColdTier(const ColdTier&);
+  ColdTier& operator=(const ColdTier&);
+};
+
+#endif
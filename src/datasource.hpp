@@ -0,0 +1,36 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     Interface of data source for archives stored in other archives
+ * Modified: 04/2012
+ */
+
+#ifndef DATASOURCE_HPP
+#define DATASOURCE_HPP
+
+#include <sys/types.h>
+
+#include "filenode.hpp"
+
+/** \class DataSource
+ * Zdroj dat archivu, který není souborem na disku (archiv uložený v jiném
+ * archivu). Ovladač, který umí archiv číst ze zdroje dat, jej získá
+ * od továrny metodou AbstractFactory::getDriver(const char*, DataSource*).
+ *
+ * Čtení je bezpečné z více vláken, zdroj nemá vlastní pozici.
+ */
+class DataSource {
+public:
+  virtual ~DataSource() {}
+
+  /// Velikost dat v bytech
+  virtual offset_t size() = 0;
+
+  /**
+   * Přečte nejvýše bytes bytů od pozice offset do buffer.
+   * @return počet přečtených bytů, 0 na konci dat, -1 při chybě
+   */
+  virtual ssize_t read(char* buffer, size_t bytes, offset_t offset) = 0;
+};
+
+#endif
@@ -11,6 +11,8 @@
 #include <ctime>
 #include <dirent.h>
 
+#include <pthread.h>
+
 #ifdef HAVE_LIBMAGIC
 #include <magic.h>
 #endif
@@ -137,39 +139,76 @@ ArchiveType* TYPE_BY_EXT(const char* ext) {
   return NULL;
 }
 
-ArchiveType* GET_TYPE(const char* path) {
-  if (path == NULL) return NULL;
+#ifdef HAVE_LIBMAGIC
+static pthread_key_t magic_key;
+static pthread_once_t magic_once = PTHREAD_ONCE_INIT;
 
-  ArchiveType* ret = NULL;
+static void closeMagic(void* cookie) {
+  magic_close(reinterpret_cast<magic_t>(cookie));
+}
 
-#ifdef HAVE_LIBMAGIC
-  magic_t cookie = magic_open(MAGIC_RAW|MAGIC_MIME_TYPE);
-  if (cookie == NULL) goto extension_resolution;
+static void createMagicKey() {
+  pthread_key_create(&magic_key, closeMagic);
+}
+
+/* threadMagic()
+ *  vrací cookie libmagic aktuálního vlákna - cookie nelze sdílet mezi vlákny
+ *  a načtení databáze je drahé, proto je každému vláknu vytvořeno jen jednou
+ */
+static magic_t threadMagic() {
+  pthread_once(&magic_once, createMagicKey);
+
+  magic_t cookie = reinterpret_cast<magic_t>(pthread_getspecific(magic_key));
+  if (cookie != NULL) return cookie;
+
+  cookie = magic_open(MAGIC_RAW|MAGIC_MIME_TYPE);
+  if (cookie == NULL) return NULL;
 
   magic_setflags(cookie, MAGIC_PRESERVE_ATIME);
 
   if (magic_load(cookie, FILE_MAGIC) != 0) {
     magic_close(cookie);
-    goto extension_resolution;
+    return NULL;
   }
 
+  pthread_setspecific(magic_key, cookie);
+  return cookie;
+}
+#endif
+
+ArchiveType* GET_TYPE(const char* path) {
+  if (path == NULL) return NULL;
+
+#ifdef HAVE_LIBMAGIC
+  ArchiveType* ret = NULL;
+  magic_t cookie = threadMagic();
+  if (cookie == NULL) goto extension_resolution;
+
   const char* mime;
-  if ((mime = magic_file(cookie, path)) == NULL) {
-    magic_close(cookie);
+  if ((mime = magic_file(cookie, path)) == NULL)
     goto extension_resolution;
-  }
 
   ret = TYPE_BY_MIME(mime);
-  magic_close(cookie);
 
   if (ret) return ret;
 
   extension_resolution:
 #endif
 
+  return TYPE_BY_NAME(path);
+}
+
+/* TYPE_BY_NAME()
+ *  určí typ archivu pouze podle přípony jména (i dvojité - tar.gz), soubor
+ *  tedy nemusí existovat na disku (soubor uvnitř archivu)
+ */
+ArchiveType* TYPE_BY_NAME(const char* path) {
+  if (path == NULL) return NULL;
+
+  ArchiveType* ret = NULL;
   char ext_low[10];
   const char* ext = findFileExt(path, NULL);
-  if (ext == NULL) return NULL;
+  if (ext == NULL || strlen(ext) >= sizeof(ext_low)) return NULL;
   strcpy(ext_low, ext);
   strToLower(ext_low);
 
@@ -177,7 +216,7 @@ ArchiveType* GET_TYPE(const char* path) {
   if (ret) return ret;
 
   ext = findFileExt(path, ext-2);  // musíme se dostat až před tečku
-  if (ext == NULL) return NULL;
+  if (ext == NULL || strlen(ext) >= sizeof(ext_low)) return NULL;
   strcpy(ext_low, ext);
   strToLower(ext_low);
 
@@ -29,6 +29,7 @@ bool LOAD_DRIVER(const char* pathname);
 void UNLOAD_DRIVERS();
 ArchiveType* GET_TYPE(const char* path);
 ArchiveType* TYPE_BY_EXT(const char* ext);
+ArchiveType* TYPE_BY_NAME(const char* path);
 ArchiveType* TYPE_BY_MIME(const char* mime);
 void PRINT_DRIVERS_SUPPORT();
 void generateNewArchiveName(string& name);
@@ -0,0 +1,445 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     File implementing work-stealing pool of background threads
+ * Modified: 04/2012
+ */
+
+#include <iostream>
+
+#include "executor.hpp"
+
+/* Task
+ *****************************************************************************/
+Task::Task(Priority priority)
+  : state(QUEUED),
+    prio(priority),
+    refs(1),
+    cancel_requested(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+}
+
+Task::~Task() {
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+void Task::acquire() {
+  pthread_mutex_lock(&mutex);
+  ++refs;
+  pthread_mutex_unlock(&mutex);
+}
+
+void Task::release() {
+  pthread_mutex_lock(&mutex);
+  bool last = (--refs == 0);
+  pthread_mutex_unlock(&mutex);
+
+  if (last) delete this;
+}
+
+bool Task::cancel() {
+  pthread_mutex_lock(&mutex);
+  cancel_requested = true;
+  bool cancelled = (state == QUEUED || state == CANCELLED);
+  if (state == QUEUED) state = CANCELLED;
+  pthread_mutex_unlock(&mutex);
+  return cancelled;
+}
+
+bool Task::isCancelled() {
+  pthread_mutex_lock(&mutex);
+  bool cancelled = cancel_requested;
+  pthread_mutex_unlock(&mutex);
+  return cancelled;
+}
+
+void Task::wait() {
+  pthread_mutex_lock(&mutex);
+  while (state == QUEUED || state == RUNNING)
+    pthread_cond_wait(&cond, &mutex);
+  pthread_mutex_unlock(&mutex);
+}
+
+bool Task::finished() {
+  pthread_mutex_lock(&mutex);
+  bool done = (state == DONE || state == CANCELLED);
+  pthread_mutex_unlock(&mutex);
+  return done;
+}
+
+bool Task::start() {
+  pthread_mutex_lock(&mutex);
+  bool runnable = (state == QUEUED);
+  if (runnable) state = RUNNING;
+  pthread_mutex_unlock(&mutex);
+  return runnable;
+}
+
+void Task::finish() {
+  pthread_mutex_lock(&mutex);
+  if (state == RUNNING) state = DONE;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+/* Executor
+ *****************************************************************************/
+unsigned Executor::WORKERS = 4;
+Executor* Executor::global_executor = NULL;
+pthread_mutex_t Executor::global_mux = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t Executor::current_worker;
+pthread_once_t Executor::key_once = PTHREAD_ONCE_INIT;
+
+Executor* Executor::global() {
+  pthread_mutex_lock(&global_mux);
+  if (global_executor == NULL) {
+    global_executor = new Executor(WORKERS);
+    Stats::global()->add(global_executor);
+  }
+  pthread_mutex_unlock(&global_mux);
+  return global_executor;
+}
+
+void Executor::destroyGlobal() {
+  pthread_mutex_lock(&global_mux);
+  if (global_executor != NULL)
+    Stats::global()->remove(global_executor);
+  delete global_executor;
+  global_executor = NULL;
+  pthread_mutex_unlock(&global_mux);
+}
+
+void Executor::createKey() {
+  pthread_key_create(&current_worker, NULL);
+}
+
+void Executor::execute(Task* task) {
+  if (task->start()) task->run();
+  task->finish();
+  task->release();
+}
+
+Executor::Executor(unsigned _workers)
+  : worker_count(_workers),
+    queued(0),
+    running(0),
+    completed(0),
+    stolen(0),
+    submitted(0),
+    retrying(0),
+    stopping(false) {
+  if (worker_count == 0) worker_count = 1;
+  /* Vlákna čtou seznam při krádeži - nesmí být realokován */
+  workers.reserve(worker_count);
+  pthread_once(&key_once, createKey);
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+}
+
+Executor::~Executor() {
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+
+  for (vector<Worker*>::iterator it = workers.begin(); it != workers.end(); ++it)
+    pthread_join((*it)->thread, NULL);
+
+  /* Pokud se nepodařilo spustit žádné vlákno, zůstaly úlohy ve frontách */
+  for (unsigned p = 0; p < Task::PRIORITIES; ++p) {
+    while (!injected[p].empty()) {
+      injected[p].front()->release();
+      injected[p].pop_front();
+    }
+  }
+
+  for (vector<Worker*>::iterator it = workers.begin(); it != workers.end(); ++it) {
+    pthread_mutex_destroy(&(*it)->mutex);
+    delete *it;
+  }
+
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+bool Executor::startThreads() {
+  Worker* worker;
+  while (workers.size() < worker_count) {
+    worker = new Worker;
+    worker->executor = this;
+    pthread_mutex_init(&worker->mutex, NULL);
+
+    workers.push_back(worker);
+    if (pthread_create(&worker->thread, NULL, work, worker) != 0) {
+      cerr << "Executor: cannot create worker thread" << endl;
+      workers.pop_back();
+      pthread_mutex_destroy(&worker->mutex);
+      delete worker;
+      break;
+    }
+  }
+  return !workers.empty();
+}
+
+bool Executor::submit(Task* task) {
+  Worker* self = reinterpret_cast<Worker*>(pthread_getspecific(current_worker));
+  unsigned p = task->priority();
+
+  pthread_mutex_lock(&mutex);
+  if (stopping || (workers.empty() && !startThreads())) {
+    pthread_mutex_unlock(&mutex);
+    return false;
+  }
+
+  /* Úlohy zařazené vláknem executoru zůstávají v jeho frontě */
+  if (self != NULL && self->executor == this) {
+    pthread_mutex_lock(&self->mutex);
+    self->tasks[p].push_back(task);
+    pthread_mutex_unlock(&self->mutex);
+  } else {
+    injected[p].push_back(task);
+  }
+
+  ++queued;
+  ++submitted;
+  /* Vlákno čekající na zabranou úlohu musí být probuzeno vždy */
+  if (retrying > 0)
+    pthread_cond_broadcast(&cond);
+  else
+    pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&mutex);
+  return true;
+}
+
+Task* Executor::take(Worker* self) {
+  Task* task = NULL;
+  Worker* victim;
+  unsigned start = 0;
+
+  pthread_mutex_lock(&mutex);
+  unsigned n = workers.size();
+  pthread_mutex_unlock(&mutex);
+
+  for (unsigned i = 0; i < n; ++i)
+    if (workers[i] == self) start = i;
+
+  for (unsigned p = 0; p < Task::PRIORITIES && task == NULL; ++p) {
+    /* Vlastní fronta - naposledy zařazená úloha má data nejspíš v cache */
+    pthread_mutex_lock(&self->mutex);
+    if (!self->tasks[p].empty()) {
+      task = self->tasks[p].back();
+      self->tasks[p].pop_back();
+    }
+    pthread_mutex_unlock(&self->mutex);
+    if (task) break;
+
+    /* Společná fronta je chráněna hlavním zámkem */
+    pthread_mutex_lock(&mutex);
+    if (!injected[p].empty()) {
+      task = injected[p].front();
+      injected[p].pop_front();
+    }
+    pthread_mutex_unlock(&mutex);
+    if (task) break;
+
+    /* Krádež nejstarší úlohy z front ostatních vláken */
+    for (unsigned i = 1; i < n && task == NULL; ++i) {
+      victim = workers[(start + i) % n];
+      pthread_mutex_lock(&victim->mutex);
+      if (!victim->tasks[p].empty()) {
+        task = victim->tasks[p].front();
+        victim->tasks[p].pop_front();
+      }
+      pthread_mutex_unlock(&victim->mutex);
+      if (task) {
+        pthread_mutex_lock(&mutex);
+        ++stolen;
+        pthread_mutex_unlock(&mutex);
+      }
+    }
+  }
+  return task;
+}
+
+void* Executor::work(void* data) {
+  Worker* self = reinterpret_cast<Worker*>(data);
+  Executor* executor = self->executor;
+  Task* task;
+  unsigned long seen;
+
+  pthread_setspecific(current_worker, self);
+
+  pthread_mutex_lock(&executor->mutex);
+  while (true) {
+    while (executor->queued == 0 && !executor->stopping)
+      pthread_cond_wait(&executor->cond, &executor->mutex);
+
+    /* Při ukončování se fronty nejprve vyprázdní */
+    if (executor->queued == 0) break;
+
+    /* Zabraná úloha ve frontách určitě je, jen ji mohlo vzít jiné vlákno */
+    --executor->queued;
+    ++executor->running;
+    seen = executor->submitted;
+    pthread_mutex_unlock(&executor->mutex);
+
+    /* Bez nově zařazené úlohy prohledání front úlohu vždy najde - jiná
+     * vlákna vezmou nejvýše tolik úloh, kolik jich zabrala; nenalezení
+     * znamená, že byla zařazena úloha do již prohledané fronty, a vlákno
+     * tedy čeká na další zařazení (nikoli aktivně) */
+    while ((task = executor->take(self)) == NULL) {
+      pthread_mutex_lock(&executor->mutex);
+      ++executor->retrying;
+      while (executor->submitted == seen)
+        pthread_cond_wait(&executor->cond, &executor->mutex);
+      --executor->retrying;
+      seen = executor->submitted;
+      pthread_mutex_unlock(&executor->mutex);
+    }
+
+    execute(task);
+
+    pthread_mutex_lock(&executor->mutex);
+    --executor->running;
+    ++executor->completed;
+  }
+  pthread_mutex_unlock(&executor->mutex);
+
+  pthread_setspecific(current_worker, NULL);
+  return NULL;
+}
+
+void Executor::report(ostream& out) {
+  unsigned long depth[Task::PRIORITIES];
+  unsigned long total = 0;
+
+  for (unsigned p = 0; p < Task::PRIORITIES; ++p) depth[p] = 0;
+
+  pthread_mutex_lock(&mutex);
+  for (vector<Worker*>::iterator it = workers.begin(); it != workers.end(); ++it) {
+    pthread_mutex_lock(&(*it)->mutex);
+    for (unsigned p = 0; p < Task::PRIORITIES; ++p)
+      depth[p] += (*it)->tasks[p].size();
+    pthread_mutex_unlock(&(*it)->mutex);
+  }
+  for (unsigned p = 0; p < Task::PRIORITIES; ++p) {
+    depth[p] += injected[p].size();
+    total += depth[p];
+  }
+
+  out << "executor.workers " << workers.size() << '\n'
+      << "executor.queued " << total << '\n'
+      << "executor.queued.high " << depth[Task::HIGH] << '\n'
+      << "executor.queued.normal " << depth[Task::NORMAL] << '\n'
+      << "executor.queued.low " << depth[Task::LOW] << '\n'
+      << "executor.running " << running << '\n'
+      << "executor.completed " << completed << '\n'
+      << "executor.stolen " << stolen << '\n';
+  pthread_mutex_unlock(&mutex);
+}
+
+/* SerialQueue
+ *****************************************************************************/
+SerialQueue::SerialQueue()
+  : count(0),
+    scheduled(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+}
+
+SerialQueue::~SerialQueue() {
+  wait();
+
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+bool SerialQueue::submit(Task* task) {
+  pthread_mutex_lock(&mutex);
+  tasks[task->priority()].push_back(task);
+  ++count;
+
+  if (!scheduled && !schedule()) {
+    tasks[task->priority()].pop_back();
+    --count;
+    pthread_mutex_unlock(&mutex);
+    return false;
+  }
+  pthread_mutex_unlock(&mutex);
+  return true;
+}
+
+bool SerialQueue::schedule() {
+  Task::Priority priority = Task::LOW;
+  for (int p = Task::PRIORITIES - 1; p >= 0; --p)
+    if (!tasks[p].empty()) priority = Task::Priority(p);
+
+  Task* drain_task = new Drain(this, priority);
+  if (!Executor::global()->submit(drain_task)) {
+    delete drain_task;
+    return false;
+  }
+  scheduled = true;
+  return true;
+}
+
+void SerialQueue::wait() {
+  pthread_mutex_lock(&mutex);
+  while (count > 0 || scheduled)
+    pthread_cond_wait(&cond, &mutex);
+  pthread_mutex_unlock(&mutex);
+}
+
+unsigned long SerialQueue::depth() {
+  pthread_mutex_lock(&mutex);
+  unsigned long depth = count;
+  pthread_mutex_unlock(&mutex);
+  return depth;
+}
+
+void SerialQueue::drain() {
+  Task* task;
+
+  pthread_mutex_lock(&mutex);
+  for (unsigned done = 0; done < BATCH; ++done) {
+    task = NULL;
+    for (unsigned p = 0; p < Task::PRIORITIES && task == NULL; ++p) {
+      if (!tasks[p].empty()) {
+        task = tasks[p].front();
+        tasks[p].pop_front();
+      }
+    }
+    if (task == NULL) break;
+
+    pthread_mutex_unlock(&mutex);
+    Executor::execute(task);
+    pthread_mutex_lock(&mutex);
+    --count;
+  }
+
+  /* Po dávce úloh je vlákno uvolněno pro ostatní práci */
+  scheduled = false;
+  if (count > 0 && !schedule()) {
+    /* Executor již nepřijímá úlohy - zbytek vykonáme zde */
+    while (count > 0) {
+      for (unsigned p = 0; p < Task::PRIORITIES; ++p) {
+        while (!tasks[p].empty()) {
+          task = tasks[p].front();
+          tasks[p].pop_front();
+          pthread_mutex_unlock(&mutex);
+          Executor::execute(task);
+          pthread_mutex_lock(&mutex);
+          --count;
+        }
+      }
+    }
+  }
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+void SerialQueue::Drain::run() {
+  queue->drain();
+}
@@ -0,0 +1,227 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     Header file for executor.cpp
+ * Modified: 04/2012
+ */
+
+#ifndef EXECUTOR_HPP
+#define EXECUTOR_HPP
+
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+#include "stats.hpp"
+
+using namespace std;
+
+/** \class Task
+ * Úloha vykonávaná na pozadí vlákny Executoru.
+ *
+ * Objekt úlohy je počítán referencemi - po vytvoření drží referenci
+ * ten, kdo úlohu vytvořil, a zařazením do fronty ji předává Executoru,
+ * který ji po vykonání uvolní. Kdo chce na úlohu čekat (wait) nebo ji
+ * rušit (cancel), musí si před zařazením vzít vlastní referenci (acquire)
+ * a po skončení ji vrátit (release).
+ */
+class Task {
+public:
+  /// Priorita úlohy, nižší hodnota je vykonána dříve
+  enum Priority {HIGH, NORMAL, LOW};
+  static const unsigned PRIORITIES = 3;
+
+  Task(Priority priority = NORMAL);
+  virtual ~Task();
+
+  virtual void run() = 0;
+
+  inline Priority priority() const {
+    return prio;
+  }
+
+  void acquire();
+
+  /// Vrátí referenci, po vrácení poslední je úloha uvolněna
+  void release();
+
+  /**
+   * Zruší úlohu. Úloha, která dosud nezačala, již nebude vykonána.
+   * Běžící úloha se může o zrušení dozvědět voláním isCancelled().
+   * @returns true pokud úloha nebude vykonána
+   */
+  bool cancel();
+
+  bool isCancelled();
+
+  /// Čeká na dokončení nebo zrušení úlohy
+  void wait();
+
+  /// Vrací true, pokud byla úloha dokončena nebo zrušena
+  bool finished();
+
+private:
+  enum State {QUEUED, RUNNING, DONE, CANCELLED} state;
+  Priority prio;
+  unsigned refs;
+  bool cancel_requested;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  /// Přechod do stavu RUNNING, false pokud byla úloha zrušena
+  bool start();
+  void finish();
+
+  friend class Executor;
+
+  Task(const Task&);
+  Task& operator=(const Task&);
+};
+
+/// Pool vláken vykonávající úlohy na pozadí
+/** \class Executor
+ * Každé vlákno má vlastní frontu (pro každou prioritu zvlášť), do které
+ * ukládá úlohy zařazené z tohoto vlákna. Úlohy zařazené odjinud (vlákna
+ * FUSE) jsou ukládány do společné fronty. Nečinné vlákno bere úlohy
+ * nejprve ze své fronty, pak ze společné a nakonec je krade z front
+ * ostatních vláken - vždy počínaje nejvyšší prioritou.
+ *
+ * Vlákna jsou vytvořena až při zařazení první úlohy - FUSE totiž po
+ * inicializaci proces démonizuje a vlákna vytvořená před voláním
+ * fuse_main() by v démonu neexistovala.
+ */
+class Executor: public StatsSource {
+public:
+  /// Počet vláken globálního executoru
+  static unsigned WORKERS;
+
+  /// Globální executor, vytvořený při prvním použití
+  static Executor* global();
+
+  /// Uvolní globální executor, úlohy ve frontách jsou před tím dokončeny
+  static void destroyGlobal();
+
+  /// Vykoná úlohu v aktuálním vlákně (pokud nebyla zrušena) a uvolní ji
+  static void execute(Task* task);
+
+  Executor(unsigned workers);
+
+  /**
+   * Destruktor nechá vykonat všechny úlohy, jenž jsou ve frontách a počká
+   * na ukončení všech vláken.
+   */
+  ~Executor();
+
+  /**
+   * Zařadí úlohu do fronty. Executor přebírá referenci úlohy.
+   * @returns false pokud se nepodařilo spustit ani jedno vlákno - úloha
+   *          v tom případě NENÍ uvolněna
+   */
+  bool submit(Task* task);
+
+  void report(ostream& out);
+
+private:
+  /** \struct Executor::Worker
+   * Vlákno executoru a jeho fronty.
+   */
+  struct Worker {
+    Executor* executor;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    deque<Task*> tasks[Task::PRIORITIES];
+  };
+
+  vector<Worker*> workers;
+  unsigned worker_count;
+
+  /// Společná fronta pro úlohy zařazené mimo vlákna executoru
+  deque<Task*> injected[Task::PRIORITIES];
+
+  /// Počet úloh ve frontách, které si dosud žádné vlákno nezabralo
+  unsigned long queued;
+  unsigned long running;
+  unsigned long completed;
+  unsigned long stolen;
+
+  /// Počet všech zařazených úloh, vlákno, které zabranou úlohu nenašlo,
+  /// čeká na jeho změnu
+  unsigned long submitted;
+
+  /// Počet vláken čekajících na zabranou úlohu
+  unsigned retrying;
+  bool stopping;
+
+  /// Chrání společnou frontu, čítače a seznam vláken
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  static Executor* global_executor;
+  static pthread_mutex_t global_mux;
+
+  /// Vlákno executoru, ve kterém běží volající (NULL mimo executor)
+  static pthread_key_t current_worker;
+  static pthread_once_t key_once;
+  static void createKey();
+
+  bool startThreads();
+
+  /// Vyjme úlohu nejvyšší priority, případně ji ukradne jinému vláknu
+  Task* take(Worker* self);
+
+  static void* work(void* worker);
+};
+
+/// Fronta úloh vykonávaných postupně
+/** \class SerialQueue
+ * Úlohy zařazené do fronty jsou vykonávány vlákny Executoru, ale nikdy
+ * dvě současně - slouží pro práci s ovladači, které nejsou vláknově
+ * bezpečné (libzip, libtar). Úlohy vyšší priority předbíhají.
+ */
+class SerialQueue {
+public:
+  SerialQueue();
+
+  /// Destruktor počká na vykonání všech zařazených úloh
+  ~SerialQueue();
+
+  /// Zařadí úlohu, fronta přebírá referenci úlohy
+  bool submit(Task* task);
+
+  /// Počká, dokud nejsou vykonány všechny zařazené úlohy
+  void wait();
+
+  /// Počet úloh ve frontě
+  unsigned long depth();
+
+private:
+  /** \class SerialQueue::Drain
+   * Úloha vykonávající postupně úlohy fronty.
+   */
+  class Drain: public Task {
+  public:
+    Drain(SerialQueue* _queue, Priority priority) : Task(priority), queue(_queue) {}
+    void run();
+  private:
+    SerialQueue* queue;
+  };
+
+  /// Počet úloh vykonaných jednou úlohou Drain, poté je vlákno uvolněno
+  static const unsigned BATCH = 16;
+
+  deque<Task*> tasks[Task::PRIORITIES];
+  unsigned long count;
+
+  /// Úloha Drain je zařazena nebo běží
+  bool scheduled;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  /// Zařadí úlohu Drain, volá se se zamčeným mutexem
+  bool schedule();
+  void drain();
+};
+
+#endif
@@ -0,0 +1,332 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     Buffer kept in a temporary file mapped into memory.
+ * Modified: 04/2012
+ */
+
+#include <climits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "filebuffer.hpp"
+
+const char* FileBuffer::spill_dir = NULL;
+
+/* Soubor roste geometricky, nejvýše však o MAX_GROW bytů najednou */
+static const offset_t MAX_GROW = 64*1024*1024;
+
+/* Buffer délky size je dírou, místo se alokuje až při zápisu */
+FileBuffer::FileBuffer(offset_t size) {
+  file = temporary();
+  if (size > 0 && ::ftruncate(file->fd, size) != 0) {
+    int error = errno;
+    unref(file);
+    throw error;
+  }
+  file->size = size;
+  map(file);
+  _length = size;
+}
+
+FileBuffer::FileBuffer(const char* path, offset_t size) {
+  int fd = ::open(path, O_RDWR);
+  if (fd == -1) {
+    cerr << "FileBufferStream error: " << path << ": " << strerror(errno) << endl;
+    throw errno;
+  }
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    int error = errno;
+    ::close(fd);
+    throw error;
+  }
+
+  file = new File;
+  file->fd = fd;
+  file->filename = new char[strlen(path) + 1];
+  strcpy(file->filename, path);
+  file->persistent = true;
+  file->size = st.st_size;
+  file->allocated = st.st_size;
+  file->map = NULL;
+  file->mapped = 0;
+  file->direct = false;
+  file->refs = 1;
+
+  if (size > file->size) {
+    if (::ftruncate(fd, size) != 0) {
+      int error = errno;
+      unref(file);
+      throw error;
+    }
+    file->size = size;
+  }
+  map(file);
+  _length = size;
+}
+
+FileBuffer::FileBuffer(const FileBuffer& old) {
+  file = old.file;
+  __sync_add_and_fetch(&file->refs, 1);
+  _length = old._length;
+}
+
+FileBuffer::~FileBuffer() {
+  /* Soubor overlay nesmí obsahovat rezervu za koncem dat */
+  if (file->persistent && file->refs == 1 && file->size > _length)
+    ::ftruncate(file->fd, _length);
+  unref(file);
+}
+
+/* FileBuffer::temporary()
+ *  - soubor bez jména (O_TMPFILE) nezůstane na disku ani po pádu programu,
+ *    starší jádra a souborové systémy bez podpory používají mkstemp+unlink
+ */
+FileBuffer::File* FileBuffer::temporary() {
+  const char* dir = (spill_dir != NULL) ? spill_dir : "/tmp";
+
+  File* tmp = new File;
+  tmp->filename = new char[strlen(dir) + sizeof("/afs_buffer.XXXXXX")];
+  strcpy(tmp->filename, dir);
+  strcat(tmp->filename, "/afs_buffer.XXXXXX");
+  tmp->fd = -1;
+
+#ifdef O_TMPFILE
+  tmp->fd = ::open(dir, O_TMPFILE | O_RDWR, 0600);
+#endif
+
+  if (tmp->fd == -1) {
+    tmp->fd = ::mkstemp(tmp->filename);
+    if (tmp->fd == -1) {
+      int error = errno;
+      cerr << "FileBufferStream error: " << dir << ": " << strerror(error) << endl;
+      delete[] tmp->filename;
+      delete tmp;
+      throw error;
+    }
+    ::unlink(tmp->filename);
+  }
+
+  tmp->persistent = false;
+  tmp->size = 0;
+  tmp->allocated = 0;
+  tmp->map = NULL;
+  tmp->mapped = 0;
+  tmp->direct = false;
+  tmp->refs = 1;
+  return tmp;
+}
+
+void FileBuffer::unref(File* old) {
+  if (__sync_sub_and_fetch(&old->refs, 1) == 0) {
+    if (old->map != NULL) ::munmap(old->map, old->mapped);
+    ::close(old->fd);
+    delete[] old->filename;
+    delete old;
+  }
+}
+
+/* FileBuffer::reserve()
+ *  - místo je předem alokováno (fallocate), zápis do mapování tak nemůže
+ *    selhat na nedostatku místa (SIGBUS), chyba se projeví zde
+ *  - souvislý alokovaný začátek souboru roste geometricky, zápis do díry
+ *    za ním alokuje pouze zapisovaný rozsah - díry zůstávají neobsazené
+ */
+void FileBuffer::reserve(File* target, offset_t offset, offset_t end) {
+  if (target->direct) {
+    /* pwrite zvětší soubor sám, chybu hlásí přímo */
+    if (end > target->size) target->size = end;
+    return;
+  }
+
+  if (end > target->allocated) {
+    bool sequential = (offset <= target->allocated);
+    offset_t from = sequential ? target->allocated : offset;
+    offset_t to = end;
+    if (sequential) {
+      offset_t step = target->allocated;
+      if (step > MAX_GROW) step = MAX_GROW;
+      if (to < target->allocated + step) to = target->allocated + step;
+      to = ((to + GROW_STEP - 1) / GROW_STEP) * GROW_STEP;
+    }
+
+    int error = ::posix_fallocate(target->fd, from, to - from);
+    if (error == ENOSPC && to > end) {
+      to = end;
+      error = ::posix_fallocate(target->fd, from, to - from);
+    }
+    if (error == ENOSPC || error == EFBIG) throw error;
+
+    if (error != 0) {
+      /* Bez alokace místa nelze bezpečně zapisovat do mapování */
+      if (target->map != NULL) ::munmap(target->map, target->mapped);
+      target->map = NULL;
+      target->mapped = 0;
+      target->direct = true;
+      if (end > target->size) target->size = end;
+      return;
+    }
+
+    if (sequential) target->allocated = to;
+    if (to > target->size) target->size = to;
+  }
+
+  map(target);
+}
+
+void FileBuffer::map(File* target) {
+  if (target->direct || target->mapped >= target->size) return;
+
+  void* map = MAP_FAILED;
+  if (offset_t(size_t(target->size)) == target->size) {
+    if (target->map == NULL) {
+      map = ::mmap(NULL, target->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   target->fd, 0);
+    } else {
+#ifdef MREMAP_MAYMOVE
+      map = ::mremap(target->map, target->mapped, target->size, MREMAP_MAYMOVE);
+#else
+      ::munmap(target->map, target->mapped);
+      target->map = NULL;
+      map = ::mmap(NULL, target->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   target->fd, 0);
+#endif
+    }
+  }
+
+  if (map == MAP_FAILED) {
+    if (target->map != NULL) ::munmap(target->map, target->mapped);
+    target->map = NULL;
+    target->mapped = 0;
+    target->direct = true;
+    return;
+  }
+
+  target->map = static_cast<char*>(map);
+  target->mapped = target->size;
+}
+
+/* FileBuffer::detach()
+ *  - soubor sdílený jiným bufferem je před změnou zkopírován do vlastního
+ *    dočasného souboru (i soubor overlay - ten zůstává ostatním kopiím)
+ *  - kopírují se pouze data, díry zůstávají dírami i v kopii
+ */
+void FileBuffer::detach() {
+  if (file->refs == 1) return;
+
+  File* copy = temporary();
+  try {
+    if (_length > 0 && ::ftruncate(copy->fd, _length) != 0) throw errno;
+    copy->size = _length;
+    map(copy);
+
+    char block[GROW_STEP / 16];
+    for (offset_t pos = seekData(0); pos < _length; pos = seekData(pos)) {
+      offset_t end = seekHole(pos);
+      reserve(copy, pos, end);
+
+      if (copy->map != NULL) {
+        read(copy->map + pos, end - pos, pos);
+        pos = end;
+        continue;
+      }
+      while (pos < end) {
+        offset_t bytes = end - pos;
+        if (bytes > offset_t(sizeof(block))) bytes = sizeof(block);
+        bytes = read(block, bytes, pos);
+        if (bytes <= 0) throw EIO;
+        if (::pwrite(copy->fd, block, bytes, pos) != bytes) throw errno;
+        pos += bytes;
+      }
+    }
+  }
+  catch (int) {
+    unref(copy);
+    throw;
+  }
+
+  unref(file);
+  file = copy;
+}
+
+size_t FileBuffer::read(char* buffer, offset_t bytes, offset_t offset) const {
+  if (offset >= _length) return 0;
+  if (offset + bytes > _length) bytes = _length - offset;
+
+  if (file->map == NULL)
+    return ::pread(file->fd, buffer, bytes, offset);
+
+  memcpy(buffer, file->map + offset, bytes);
+  return bytes;
+}
+
+size_t FileBuffer::slices(offset_t offset, size_t bytes, vector<BufferSlice>& out) const {
+  if (offset >= _length) return 0;
+  if (offset_t(offset + bytes) > _length) bytes = _length - offset;
+
+  BufferSlice slice;
+  slice.data = NULL;
+  slice.fd = file->fd;
+  slice.pos = offset;
+  slice.size = bytes;
+  out.push_back(slice);
+  return bytes;
+}
+
+offset_t FileBuffer::seekData(offset_t offset) const {
+  if (offset >= _length) return _length;
+#ifdef SEEK_DATA
+  off_t pos = ::lseek(file->fd, offset, SEEK_DATA);
+  if (pos == -1) return (errno == ENXIO) ? _length : offset;
+  return (pos < _length) ? pos : _length;
+#else
+  return offset;
+#endif
+}
+
+offset_t FileBuffer::seekHole(offset_t offset) const {
+  if (offset >= _length) return _length;
+#ifdef SEEK_HOLE
+  off_t pos = ::lseek(file->fd, offset, SEEK_HOLE);
+  if (pos == -1) return _length;
+  return (pos < _length) ? pos : _length;
+#else
+  return _length;
+#endif
+}
+
+size_t FileBuffer::write(const char* data, offset_t data_len, offset_t offset) {
+  detach();
+  reserve(file, offset, offset + data_len);
+
+  if (file->map != NULL) {
+    memcpy(file->map + offset, data, data_len);
+  } else {
+    ssize_t written = ::pwrite(file->fd, data, data_len, offset);
+    if (written <= 0) return written;
+    data_len = written;
+  }
+
+  if (offset_t(offset+data_len) > _length) _length = offset + data_len;
+  return data_len;
+}
+
+/* FileBuffer::truncate
+ *  - zmenšení souboru uvolní místo, zvětšení vytvoří díru; mapování
+ *    zůstává, přístup za konec souboru hlídá size
+ */
+void FileBuffer::truncate(offset_t size) {
+  detach();
+  if (::ftruncate(file->fd, size) != 0) throw errno;
+  file->size = size;
+  if (file->allocated > size) file->allocated = size;
+  map(file);
+  _length = size;
+}
+
+int FileBuffer::getFd() {
+  detach();
+  return file->fd;
+}
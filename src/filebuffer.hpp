@@ -11,41 +11,42 @@
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
+#include <iostream>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include "bufferiface.hpp"
 
-// IMPORTANT: if you change the template, dont forget to change the template length
-#define FILENAME_TPL "/tmp/afs_buffer.XXXXXX"
-#define FILENAME_LEN 23
-
 using namespace std;
 
+/// Buffer v souboru na disku
+/** \class FileBuffer
+ * Data jsou uložena v nepojmenovaném dočasném souboru v adresáři
+ * FileBuffer::spill_dir (nebo v existujícím souboru overlay) a přístupná
+ * přes mapování souboru do paměti, které roste s velikostí souboru. Pokud
+ * soubor nelze namapovat, je čten a zapisován voláními pread/pwrite.
+ * Soubor je řídký - nezapsaná místa (zvětšení bufferu, zápis za konec)
+ * jsou dírami souboru.
+ *
+ * Soubor je sdílen kopiemi bufferu (počítání referencí), kopie tedy
+ * nekopíruje data. Buffer, který mění soubor sdílený jinou kopií, nejprve
+ * přejde na vlastní dočasný soubor (copy-on-write).
+ */
 class FileBuffer: public BufferIface {
-private:
-  int fd;
-  char* filename;
-  offset_t _length;
-  /// Definuje počet bytů po kolika bude duplikován FileBuffer
-  static const unsigned READ_BLOCK_SIZE = 4*1024;
-
 public:
-  FileBuffer(offset_t size) {
-    filename = new char[FILENAME_LEN];
-    strcpy(filename, FILENAME_TPL);
-    fd = ::mkstemp(filename);
-    if (fd == -1) {
-      cerr << "FileBufferStream error: " << strerror(errno) << endl;
-      throw errno;
-    }
-    ::unlink(filename);
-    _length = size;
-  }
+  /// Adresář pro dočasné soubory (--spill-dir), NULL = /tmp
+  static const char* spill_dir;
 
-  FileBuffer(const FileBuffer& old) {
-    fd = dup(old.fd);
-//     lseek(fd, 0, SEEK_SET);
-  }
+  FileBuffer(offset_t size);
+
+  /**
+   * Buffer nad existujícím souborem path (např. data v úložišti změn
+   * overlay). Soubor není po uvolnění bufferu smazán.
+   */
+  FileBuffer(const char* path, offset_t size);
+
+  /// Sdílí soubor původního bufferu
+  FileBuffer(const FileBuffer& old);
 
   inline offset_t length() {
     return _length;
@@ -54,27 +55,76 @@ public:
   /**
    * Destruktor dealokuje paměť užívanou bufferem.
    */
-  ~FileBuffer() {
-    delete[] filename;
-    ::close(fd);
-  };
+  ~FileBuffer();
 
-  size_t read(char* buffer, offset_t bytes, offset_t offset) const {
-    return ::pread(fd, buffer, bytes, offset);
-  }
+  size_t read(char* buffer, offset_t bytes, offset_t offset) const;
 
-  size_t write(const char* data, offset_t data_len, offset_t offset) {
-    if (offset_t(offset+data_len) > _length) _length = offset + data_len;
-    return ::pwrite(fd, data, data_len, offset);
-  }
+  /// Jediný úsek - deskriptor dočasného souboru
+  size_t slices(offset_t offset, size_t bytes, std::vector<BufferSlice>& out) const;
 
-  void truncate(offset_t size) {
-    ::ftruncate(fd, size);
-  }
+  /// Díry souboru (lseek SEEK_DATA/SEEK_HOLE)
+  offset_t seekData(offset_t offset) const;
+  offset_t seekHole(offset_t offset) const;
+
+  /// @throw int errno pokud nelze vytvořit vlastní kopii sdíleného souboru
+  size_t write(const char* data, offset_t data_len, offset_t offset);
 
-  inline int getFd() {
-    return fd;
+  /// Zvětšení souboru vytvoří díru, místo není alokováno
+  /** @throw int errno */
+  void truncate(offset_t size);
+
+  /// Deskriptor souboru pro zápis
+  int getFd();
+
+  /// Cesta k souboru, NULL pro dočasný soubor
+  inline const char* path() const {
+    return file->persistent ? file->filename : NULL;
   }
+
+private:
+  /** \struct FileBuffer::File
+   * Otevřený soubor sdílený kopiemi bufferu.
+   */
+  struct File {
+    int fd;
+    char* filename;
+    /// Soubor není dočasný - zůstává na disku i po uvolnění bufferu
+    bool persistent;
+    /// Velikost souboru na disku (>= délka bufferu)
+    offset_t size;
+    /// Místo souboru je alokováno (fallocate) od začátku až do této pozice
+    offset_t allocated;
+    /// Mapování souboru, NULL pokud soubor namapovat nelze
+    char* map;
+    offset_t mapped;
+    /// Soubor nelze mapovat, přístup voláními pread/pwrite
+    bool direct;
+    volatile unsigned refs;
+  };
+
+  File* file;
+  offset_t _length;
+
+  /// Soubor je zvětšován alespoň o tolik bytů
+  static const unsigned GROW_STEP = 1024*1024;
+
+  /// Vytvoří nový dočasný soubor
+  /** @throw int errno */
+  static File* temporary();
+
+  static void unref(File* old);
+
+  /// Alokuje místo souboru pro zápis rozsahu <offset, end) a zvětší mapování
+  /** @throw int errno */
+  static void reserve(File* target, offset_t offset, offset_t end);
+
+  /// Namapuje soubor v celé jeho velikosti, při neúspěchu přejde na pread/pwrite
+  static void map(File* target);
+
+  /// Přejde na vlastní kopii souboru, pokud je sdílen
+  void detach();
+
+  FileBuffer& operator=(const FileBuffer&);
 };
 
 #endif
@@ -29,7 +29,9 @@ FileNode::FileNode(const char* _pathname, FileData* _data, enum NodeType _type)
     name_ptr(NULL),
     original_pathname(NULL),
     buffer(NULL),
+    cached_data(NULL),
     ref_cnt(0),
+    prefetched(false),
     changed(false),
     parent(NULL),
     data(_data) {
@@ -47,6 +47,12 @@ typedef map<const char*, FileNode*, ltstr> FileMap;
 class FileData {
 public:
   virtual ~FileData() {};
+
+  /**
+   * Pořadí dat souboru v archivu. Soubory načítané s předstihem jsou čteny
+   * v tomto pořadí, aby čtení archivu zůstalo sekvenční.
+   */
+  virtual offset_t order() const { return 0; }
 };
 
 /** \class FileNode
@@ -152,9 +158,22 @@ class FileNode {
      */
     Buffer*       buffer;
 
+    /**
+     * Ukazatel na obsah souboru uložený v cache malých souborů FileSystému.
+     * Pokud není NULL, lze soubor číst bez volání ovladače. Data vlastní
+     * FileSystem, uzel je neuvolňuje.
+     */
+    const char*   cached_data;
+
     /// Čítač referencí - počet otevření souboru.
     unsigned      ref_cnt;
 
+    /**
+     * Příznak, že buffer vytvořil FileSystem při načítání s předstihem
+     * (Prefetcher), nikoliv ovladač. Takový buffer uvolňuje FileSystem.
+     */
+    bool          prefetched;
+
     /// Příznak, zdali došlo ke změně dat souboru.
     bool          changed;
 
@@ -16,9 +16,13 @@
 #include <fcntl.h>
 
 #include "filesystem.hpp"
+#include "prefetch.hpp"
+#include "admission.hpp"
 
 char* FileSystem::path_to_drivers = NULL;
 bool FileSystem::keep_trash = false;
+bool FileSystem::overlay = false;
+bool FileSystem::compact = false;
 offset_t Buffer::MEM_LIMIT;
 
 /* FileSystem::konstruktor
@@ -26,9 +30,27 @@ offset_t Buffer::MEM_LIMIT;
  * - vytvoří kořenový uzel
  * - nechá ovladačem vybudovat asociativní pole se soubory
  */
-FileSystem::FileSystem(const char* _archive_name, bool create_archive, ArchiveType* archive_type)
-  : changed(false),
-    driver(NULL) {
+FileSystem::FileSystem(const char* _archive_name, bool create_archive,
+                       ArchiveType* archive_type, bool _background)
+  : refs(0),
+    last_used(0),
+    changed(false),
+    created(create_archive),
+    memory(0),
+    save_done(false),
+    save_result(true),
+    abandoned(false),
+    background(_background && !create_archive),
+    index_state(INDEX_PENDING),
+    index_started(false),
+    early_lookup(true),
+    index_complete(true),
+    index_start(0),
+    index_end(0),
+    outer(NULL),
+    data_source(NULL),
+    driver(NULL),
+    delta(NULL) {
 
   if (_archive_name == NULL || archive_type == NULL)
     throw ArchiveDriver::ArchiveError();
@@ -48,39 +70,49 @@ FileSystem::FileSystem(const char* _archive_name, bool create_archive, ArchiveTy
     throw ArchiveDriver::ArchiveError();
   }
 
-  pthread_mutexattr_t mux_attr;
-  pthread_mutexattr_init(&mux_attr);
-  pthread_mutexattr_settype(&mux_attr, PTHREAD_MUTEX_RECURSIVE);
-  pthread_mutex_init(&fmap_mux, &mux_attr);
+  initLocks();
 
   /* Vytvoření kořenového uzlu */
   root_node = new FileNode(NULL, NULL, FileNode::ROOT_NODE);
 
-  write_support = archive_type->write_support;
+  write_support = archive_type->write_support || overlay;
   try {
     driver = archive_type->factory->getDriver(_archive_name, create_archive);
-    if (driver == NULL) {
-      pthread_mutex_destroy(&fmap_mux);
+    if (driver == NULL)
       throw ArchiveDriver::ArchiveError();
-    }
-    if (!create_archive)
+    if (!create_archive && !background)
       if (!driver->buildFileSystem(this)) {
         cerr << "Archive filesystem - is NOT built completely" << endl;
+        index_complete = false;
       }
   }
   catch (...) {
     free((void*)archive_name);
     ::close(archive_file);
     cerr << "Could not create filesystem for " << _archive_name << endl;
-    pthread_mutex_destroy(&fmap_mux);
+    destroyLocks();
     delete root_node;
     delete driver;
     throw;
   }
 
+  if (!create_archive && (overlay || DeltaStore::exists(_archive_name)))
+    delta = new DeltaStore(_archive_name);
+
+  /* Aplikace úložiště změn mění strom - uzly lze vracet až po ní */
+  if (background)
+    early_lookup = !DeltaStore::exists(_archive_name);
+
   this->initStatvfs();
+  if (fstat(archive_file, &source) != 0)
+    memset(&source, 0, sizeof(struct stat));
   ::close(archive_file); //initStatvfs potřebuje otevřený deskriptor
 
+  if (!background) {
+    built();
+    index_state = INDEX_DONE;
+  }
+
 //   #ifndef NDEBUG
 //   cout << _archive_name << " contains this nodes: " << endl;
 //   for (FileMap::const_iterator it = file_map.begin();
@@ -93,25 +125,97 @@ FileSystem::FileSystem(const char* _archive_name, bool create_archive, ArchiveTy
 
 }
 
+/* FileSystem::konstruktor vnořeného archivu
+ * - archiv je čten ze souboru node archivu _outer, zápis není podporován
+ * - referenci na _outer drží po dobu existence FileSystému volající
+ */
+FileSystem::FileSystem(const char* _archive_name, ArchiveType* archive_type,
+                       FileSystem* _outer, FileNode* node)
+  : refs(0),
+    last_used(0),
+    write_support(false),
+    changed(false),
+    created(false),
+    memory(0),
+    save_done(false),
+    save_result(true),
+    abandoned(false),
+    background(false),
+    index_state(INDEX_DONE),
+    index_started(false),
+    early_lookup(true),
+    index_complete(true),
+    index_start(0),
+    index_end(0),
+    archive_file(-1),
+    outer(_outer),
+    data_source(NULL),
+    driver(NULL),
+    delta(NULL) {
+
+  if (_archive_name == NULL || archive_type == NULL || _outer == NULL || node == NULL)
+    throw ArchiveDriver::ArchiveError();
+
+  archive_name = strdup(_archive_name);
+  memset(&source, 0, sizeof(struct stat));
+  initLocks();
+
+  root_node = new FileNode(NULL, NULL, FileNode::ROOT_NODE);
+  data_source = new NodeSource(_outer, node);
+
+  try {
+    driver = archive_type->factory->getDriver(_archive_name, data_source);
+    if (driver == NULL)
+      throw ArchiveDriver::ArchiveError();
+    if (!driver->buildFileSystem(this)) {
+      cerr << "Archive filesystem - is NOT built completely" << endl;
+      index_complete = false;
+    }
+  }
+  catch (...) {
+    free((void*)archive_name);
+    destroyLocks();
+    delete root_node;
+    delete driver;
+    delete data_source;
+    throw;
+  }
+
+  /* Volné místo a limity jsou dány vnějším archivem */
+  archive_statvfs = _outer->archive_statvfs;
+  measure();
+}
+
 /* FileSystem::destruktor
  */
 FileSystem::~FileSystem() {
-  /* zapíšeme změny do archivu */
-  if (changed) {
-    if (!keep_trash) removeTrash();
-    cout << "Changes in archive " << archive_name;
-    if (driver->saveArchive(&file_map, &removed_nodes)) {
-      cout << " have been successfuly written" << endl;
-    } else {
-      cout << " have NOT been successfuly written" << endl;
+  /* Prefetcher odkazuje na uzly, před uvolněním je musí zapomenout */
+  Prefetcher* prefetcher = Prefetcher::current();
+  if (prefetcher != NULL) prefetcher->forget(this);
+
+  /* Budování nelze přerušit, ovladač musí doběhnout */
+  if (background) {
+    pthread_mutex_lock(&index_mux);
+    bool started = index_started;
+    pthread_mutex_unlock(&index_mux);
+    if (started) {
+      pthread_join(index_thread, NULL);
+      if (Stats::PATH) Stats::global()->remove(this);
     }
   }
+
+  /* Úlohy na pozadí pracují s ovladačem i uzly */
+  serial.wait();
+
+  save();
   free((void*)archive_name);
 
   /* Driver je třeba smazat před vymazáním obsahu filesystému.
    * libzip totiž potřebuje přistoupit k datům filesystému při uzavírání archivu
    */
   delete driver;
+  delete data_source;
+  delete delta;
 
   for (FileMap::reverse_iterator it = file_map.rbegin(); it != file_map.rend(); ++it) {
     delete it->second;
@@ -122,10 +226,227 @@ FileSystem::~FileSystem() {
   }
 
   delete root_node;
+  destroyLocks();
+}
+
+void FileSystem::initLocks() {
+  pthread_mutexattr_t mux_attr;
+  pthread_mutexattr_init(&mux_attr);
+  pthread_mutexattr_settype(&mux_attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&fmap_mux, &mux_attr);
+  pthread_mutex_init(&driver_mux, &mux_attr);
+  pthread_mutex_init(&index_mux, &mux_attr);
+  pthread_cond_init(&index_cond, NULL);
+  pthread_mutexattr_destroy(&mux_attr);
+}
+
+void FileSystem::destroyLocks() {
   pthread_mutex_destroy(&fmap_mux);
+  pthread_mutex_destroy(&driver_mux);
+  pthread_mutex_destroy(&index_mux);
+  pthread_cond_destroy(&index_cond);
+}
+
+/* FileSystem::built
+ * - změny uložené v úložišti vedle archivu, v režimu overlay jsou data
+ *   souborů čtena přímo z úložiště
+ */
+void FileSystem::built() {
+  if (delta && DeltaStore::exists(archive_name) && !delta->load(this, overlay))
+    cerr << "Overlay: changes in " << delta->path() << " are NOT loaded completely" << endl;
+
+  measure();
+}
+
+void FileSystem::measure() {
+  archive_statvfs.f_files = file_map.size() - 1; // - root node
+
+  memory = small_cache.size();
+  for (FileMap::iterator it = file_map.begin(); it != file_map.end(); ++it)
+    memory += sizeof(FileNode) + 2 * strlen(it->first) + 2;
+}
+
+bool FileSystem::startIndexing() {
+  if (!background) return true;
+
+  pthread_mutex_lock(&index_mux);
+  time(&index_start);
+  index_started = true;
+  pthread_mutex_unlock(&index_mux);
+
+  if (Stats::PATH) Stats::global()->add(this);
+
+  if (pthread_create(&index_thread, NULL, runIndexing, this) != 0) {
+    if (Stats::PATH) Stats::global()->remove(this);
+    pthread_mutex_lock(&index_mux);
+    index_started = false;
+    pthread_mutex_unlock(&index_mux);
+    return false;
+  }
+  return true;
+}
+
+/* FileSystem::runIndexing
+ * - ovladač buduje filesystém se zamčeným driver_mux, otevírání souborů
+ *   tedy počká (ovladače nejsou vláknově bezpečné)
+ * - výjimka ovladače nemůže zrušit již připojený filesystém, je použito
+ *   to, co bylo vybudováno
+ */
+void* FileSystem::runIndexing(void* fs_ptr) {
+  FileSystem* fs = reinterpret_cast<FileSystem*>(fs_ptr);
+
+  pthread_mutex_lock(&fs->index_mux);
+  fs->indexer = pthread_self();
+  fs->index_state = INDEX_RUNNING;
+  pthread_mutex_unlock(&fs->index_mux);
+
+  bool complete;
+  pthread_mutex_lock(&fs->driver_mux);
+  try {
+    complete = fs->driver->buildFileSystem(fs);
+  }
+  catch (...) {
+    complete = false;
+  }
+  if (!complete)
+    cerr << "Archive filesystem - is NOT built completely" << endl;
+  fs->built();
+  pthread_mutex_unlock(&fs->driver_mux);
+
+  pthread_mutex_lock(&fs->index_mux);
+  fs->index_complete = complete;
+  fs->index_state = INDEX_DONE;
+  time(&fs->index_end);
+  pthread_cond_broadcast(&fs->index_cond);
+  pthread_mutex_unlock(&fs->index_mux);
+
+  cout << "Archive " << fs->archive_name << " indexed in "
+       << (fs->index_end - fs->index_start) << " s" << endl;
+
+  /* Stav ve statistikách je aktualizován hned */
+  if (Stats::PATH) Stats::global()->write();
+  return NULL;
+}
+
+bool FileSystem::mustWait() const {
+  /* Nespuštěné budování nelze čekat (např. ukončení před démonizací) */
+  if (!index_started || index_state == INDEX_DONE) return false;
+  return !(index_state == INDEX_RUNNING && pthread_equal(indexer, pthread_self()));
+}
+
+void FileSystem::waitIndexed() {
+  if (!background) return;
+
+  pthread_mutex_lock(&index_mux);
+  while (mustWait())
+    pthread_cond_wait(&index_cond, &index_mux);
+  pthread_mutex_unlock(&index_mux);
+}
+
+/* FileSystem::lookup
+ * - append() připojuje uzly se zamčeným index_mux a po každém uzlu
+ *   probudí čekající, nalezený uzel je tedy již připojen k rodiči
+ */
+FileNode* FileSystem::lookup(const char* pathname) {
+  if (!background || pathname == NULL) return find(pathname);
+
+  FileNode* node = NULL;
+  pthread_mutex_lock(&index_mux);
+  while (mustWait()) {
+    if (early_lookup && (node = find(pathname)) != NULL) break;
+    pthread_cond_wait(&index_cond, &index_mux);
+  }
+  pthread_mutex_unlock(&index_mux);
+
+  return node != NULL ? node : find(pathname);
+}
+
+void FileSystem::report(ostream& out) {
+  pthread_mutex_lock(&index_mux);
+  pthread_mutex_lock(&fmap_mux);
+  size_t entries = file_map.size();
+  pthread_mutex_unlock(&fmap_mux);
+
+  bool done = index_state == INDEX_DONE;
+  out << "index_running " << !done << '\n';
+  out << "index_entries " << entries << '\n';
+  out << "index_seconds " << ((done ? index_end : time(NULL)) - index_start) << '\n';
+  out << "index_complete " << (done && index_complete) << '\n';
+  pthread_mutex_unlock(&index_mux);
+}
+
+/* FileSystem::save
+ * - v režimu overlay zapíše změny do úložiště, archiv zůstává beze změny
+ * - jinak změny (včetně načtených z úložiště) zapíše ovladač do archivu
+ * - výsledek je vypsán jedním zápisem, archivy mohou být ukládány paralelně
+ */
+bool FileSystem::save() {
+  if (save_done) return save_result;
+  waitIndexed();
+
+  /* Archiv byl na disku nahrazen, změny by jej přepsaly */
+  if (abandoned) {
+    save_done = true;
+    save_result = !needsSave();
+    if (!save_result)
+      cerr << "Changes in archive " << archive_name
+           << " are lost - the archive has been replaced on disk" << endl;
+    return save_result;
+  }
+  if (!needsSave()) return true;
+  if (!keep_trash) removeTrash();
+
+  save_done = true;
+  if (overlay) {
+    save_result = delta->save(this);
+    cout << "Changes in archive " << archive_name
+         << (save_result ? " have been successfuly written to "
+                         : " have NOT been successfuly written to ")
+         << delta->path() << endl;
+    return save_result;
+  }
+
+  Admission::Ticket ticket(this, Admission::SAVE, 0);
+  save_result = driver->saveArchive(&file_map, &removed_nodes);
+  cout << "Changes in archive " << archive_name
+       << (save_result ? " have been successfuly written"
+                       : " have NOT been successfuly written") << endl;
+
+  /* Změny z úložiště jsou nyní součástí archivu */
+  if (save_result && delta && delta->loaded() && !delta->remove())
+    cerr << "Overlay: cannot remove " << delta->path() << endl;
+  return save_result;
+}
+
+/* FileSystem::update
+ * - volá se nad nepoužívaným FileSystémem (viz FileSystemS::refresh)
+ * - změny z úložiště vedle archivu by mohly být s připojenými soubory
+ *   v rozporu, archiv s nimi je tedy vybudován znovu
+ */
+bool FileSystem::update() {
+  if (needsSave() || (delta && delta->loaded())) return false;
 
+  struct stat info;
+  if (::stat(archive_name, &info) != 0) return false;
+
+  pthread_mutex_lock(&driver_mux);
+  bool updated = driver->updateFileSystem(this);
+  pthread_mutex_unlock(&driver_mux);
+  if (!updated) return false;
+
+  source = info;
+  measure();
+  return true;
 }
 
+void FileSystem::abandon() {
+  abandoned = true;
+}
+
+bool FileSystem::needsSave() const {
+  if (overlay) return changed;
+  return changed || (compact && delta && delta->loaded());
+}
 
 /* FileSystem::find
  * - hledá v asociativním poli file_map uzel s cestou pathname
@@ -151,8 +472,30 @@ FileNode* FileSystem::getRoot() const {
   return this->root_node;
 }
 
-/* FileSystem::append */
+/* FileSystem::append
+ * - během budování na pozadí je uzel připojen se zamčeným index_mux,
+ *   lookup() jej tak uvidí až spolu s vazbou na rodiče
+ */
 void FileSystem::append(FileNode* new_node) {
+  if (!background) {
+    link(new_node);
+    return;
+  }
+
+  pthread_mutex_lock(&index_mux);
+  try {
+    link(new_node);
+  }
+  catch (...) {
+    pthread_mutex_unlock(&index_mux);
+    throw;
+  }
+  if (index_state == INDEX_RUNNING)
+    pthread_cond_broadcast(&index_cond);
+  pthread_mutex_unlock(&index_mux);
+}
+
+void FileSystem::link(FileNode* new_node) {
   pair<FileMap::iterator, bool> fmap_ret;
 
   pthread_mutex_lock(&fmap_mux);
@@ -182,7 +525,7 @@ void FileSystem::append(FileNode* new_node) {
     parent_node = find(parent_name);
     if (parent_node == NULL) {
       parent_node = new FileNode(parent_name, NULL, FileNode::DIR_NODE);
-      append(parent_node);
+      link(parent_node);
     }
   }
 
@@ -225,6 +568,7 @@ void FileSystem::appendToNode(FileNode* new_node, FileNode* parent_node) {
 
 int FileSystem::mknod(const char* path, mode_t mode) {
   if (!write_support) return ENOTSUP;
+  waitIndexed();
 
   FileNode* node;
   try {
@@ -252,6 +596,7 @@ int FileSystem::mknod(const char* path, mode_t mode) {
 
 int FileSystem::create(const char* path, mode_t mode, FileNode** new_node) {
   if (!write_support) return ENOTSUP;
+  waitIndexed();
 
   try {
     *new_node = new FileNode(path, NULL, FileNode::FILE_NODE);
@@ -282,6 +627,7 @@ int FileSystem::create(const char* path, mode_t mode, FileNode** new_node) {
 
 int FileSystem::mkdir(const char* path, mode_t mode) {
   if (!write_support) return ENOTSUP;
+  waitIndexed();
 
   FileNode* node;
   try {
@@ -307,6 +653,7 @@ int FileSystem::mkdir(const char* path, mode_t mode) {
 
 int FileSystem::rename(FileNode* node, const char* new_pathname) {
   if (!write_support) return ENOTSUP;
+  waitIndexed();
 
   /* Odebrání souboru pod stávajícím jménem */
   if (!take(node)) return ENOENT;
@@ -384,10 +731,38 @@ void FileSystem::repath(FileNode* node, const char* path) {
 }
 
 int FileSystem::open(FileNode* node, int flags) {
+  Admission::Ticket* ticket = NULL;
+
+  /* Během budování na pozadí je ovladač obsazen */
+  waitIndexed();
+
+  /* Na povolení k dekompresi nelze čekat se zamčeným ovladačem; soubory
+   * čtené přímo z archivu nebo dekomprimované až při čtení povolení
+   * nepotřebují */
+  pthread_mutex_lock(&driver_mux);
+  bool decompress = node->ref_cnt == 0 && !node->prefetched &&
+                    node->buffer == NULL && node->cached_data == NULL &&
+                    driver->inflates(node);
+  pthread_mutex_unlock(&driver_mux);
+
+  if (decompress)
+    ticket = new Admission::Ticket(this, Admission::INTERACTIVE, node->getSize());
+
+  pthread_mutex_lock(&driver_mux);
   ++node->ref_cnt;
 
-  if (node->ref_cnt == 1 && node->buffer == NULL)
-    driver->open(node);
+  if (node->ref_cnt == 1) {
+    /* Soubor načtený s předstihem - buffer nyní patří otevřenému souboru */
+    if (node->prefetched)
+      Prefetcher::global()->consumed(node->getSize());
+    /* Soubory z cache není třeba otevírat ovladačem */
+    else if (node->buffer == NULL && node->cached_data == NULL)
+      driver->open(node);
+  }
+  pthread_mutex_unlock(&driver_mux);
+  delete ticket;
+
+  Prefetcher::global()->opened(this, node);
 
   if (flags & O_WRONLY || flags & O_RDWR) {
     if (!write_support) return ENOTSUP;
@@ -408,7 +783,8 @@ int FileSystem::open(FileNode* node, int flags) {
   return 0;
 }
 
-int FileSystem::read(FileNode* node, char* buffer, size_t bytes, off_t offset) {
+int FileSystem::read(FileNode* node, char* buffer, size_t bytes, off_t offset,
+                     ReadAhead* readahead) {
   if (bytes == 0) return 0;
 
   if (node->buffer) {
@@ -418,9 +794,105 @@ int FileSystem::read(FileNode* node, char* buffer, size_t bytes, off_t offset) {
 
     return bytes;
   }
+  else if (node->cached_data) {
+    offset_t size = node->getSize();
+    if (offset >= size) return 0;
+    if (offset_t(offset + bytes) > size) bytes = size - offset;
+    memcpy(buffer, node->cached_data + offset, bytes);
+    return bytes;
+  }
+  else if (readahead) return readahead->read(buffer, bytes, offset);
   else return (driver->read(node, buffer, bytes, offset));
 }
 
+/* FileSystem::readSlices
+ * - paměť bufferu může být po uvolnění zámku změněna nebo uvolněna (zápis,
+ *   zkrácení), proto je kopírována ještě pod zámkem; souvislé úseky paměti
+ *   tvoří jeden blok
+ * - totéž platí pro dočasný soubor bufferu (zkrácení nebo rozdělení sdílené
+ *   kopie jej uzavře a deskriptor může být znovu použit), jeho úseky jsou
+ *   proto také čteny do bloku; FUSE je předán jen deskriptor archivu, který
+ *   je otevřen po celou dobu existence ovladače
+ */
+bool FileSystem::readSlices(FileNode* node, size_t bytes, off_t offset,
+                            vector<BufferSlice>& out) {
+  vector<BufferSlice> view;
+  BufferSlice slice;
+  bool buffered = false;
+
+  pthread_rwlock_rdlock(&(node->lock));
+  if (node->buffer) {
+    buffered = true;
+    /* Zkomprimovaný blok nejde pro nedostatek paměti dekomprimovat, chybu
+     * ohlásí čtení */
+    if (node->buffer->slices(offset, bytes, view) == 0 && bytes > 0
+        && offset < node->buffer->length()) {
+      pthread_rwlock_unlock(&(node->lock));
+      return false;
+    }
+  } else if (node->cached_data) {
+    offset_t size = node->getSize();
+    if (offset < size) {
+      slice.data = node->cached_data + offset;
+      slice.fd = -1;
+      slice.pos = 0;
+      slice.size = (offset_t(offset + bytes) > size) ? size - offset : bytes;
+      view.push_back(slice);
+    }
+  } else if (driver->direct(node, slice.fd, slice.pos, false)) {
+    /* Soubor uložený bez komprese - úsek deskriptoru archivu */
+    offset_t size = node->getSize();
+    if (offset < size) {
+      slice.data = NULL;
+      slice.pos += offset;
+      slice.size = (offset_t(offset + bytes) > size) ? size - offset : bytes;
+      view.push_back(slice);
+    }
+  } else {
+    pthread_rwlock_unlock(&(node->lock));
+    return false;
+  }
+
+  vector<BufferSlice>::iterator it = view.begin();
+  while (it != view.end()) {
+    if (it->data == NULL && !buffered) {
+      out.push_back(*it++);
+      continue;
+    }
+
+    vector<BufferSlice>::iterator run = it;
+    size_t size = 0;
+    for (; run != view.end() && (run->data != NULL || buffered); ++run) size += run->size;
+
+    char* block = static_cast<char*>(malloc(size));
+    bool copied = (block != NULL);
+    if (copied) {
+      slice.data = block;
+      slice.fd = -1;
+      slice.pos = 0;
+      slice.size = size;
+      out.push_back(slice);
+    }
+    for (; copied && it != run; ++it) {
+      if (it->data != NULL)
+        memcpy(block, it->data, it->size);
+      else
+        copied = (pread(it->fd, block, it->size, it->pos) == ssize_t(it->size));
+      block += it->size;
+    }
+
+    if (!copied) {
+      pthread_rwlock_unlock(&(node->lock));
+      for (vector<BufferSlice>::iterator done = out.begin(); done != out.end(); ++done)
+        if (done->data != NULL) free(const_cast<char*>(done->data));
+      out.clear();
+      return false;
+    }
+  }
+  pthread_rwlock_unlock(&(node->lock));
+  return true;
+}
+
 int FileSystem::write(FileNode* node, const char* buffer,
                           size_t length, off_t offset) {
   if (node->buffer == NULL) return EBADF;
@@ -434,7 +906,14 @@ int FileSystem::write(FileNode* node, const char* buffer,
     pthread_rwlock_unlock(&(node->lock));
     return -ENOMEM;
   }
-  node->setSize(written+offset);
+  catch (int error) {
+    /* Souborový buffer - nedostatek místa pro data */
+    pthread_rwlock_unlock(&(node->lock));
+    return -error;
+  }
+  /* Zápis doprostřed souboru jej nezkracuje */
+  if (offset_t(written + offset) > node->getSize())
+    node->setSize(written + offset);
   node->changed = true;
   pthread_rwlock_unlock(&(node->lock));
 
@@ -443,24 +922,32 @@ int FileSystem::write(FileNode* node, const char* buffer,
 }
 
 FileList* FileSystem::readDir(FileNode* node) {
+  /* Obsah adresáře je úplný až po vybudování celého archivu */
+  waitIndexed();
+  Prefetcher::global()->listed(this, node);
   return &(node->children);
 }
 
-int FileSystem::truncate(FileNode* node, ssize_t size) {
+int FileSystem::truncate(FileNode* node, offset_t size) {
   if (!write_support) return ENOTSUP;
+  waitIndexed();
 
   pthread_rwlock_wrlock(&(node->lock));
-  if (node->buffer) node->buffer->truncate(size);
-  else {
-    try {
+  try {
+    if (node->buffer) node->buffer->truncate(size);
+    else {
       node->buffer = new Buffer(size);
       if (size > 0)
         fillInBuffer(node, size);
     }
-    catch (std::bad_alloc()) {
-      pthread_rwlock_unlock(&(node->lock));
-      return ENOMEM;
-    }
+  }
+  catch (std::bad_alloc&) {
+    pthread_rwlock_unlock(&(node->lock));
+    return ENOMEM;
+  }
+  catch (int error) {
+    pthread_rwlock_unlock(&(node->lock));
+    return error;
   }
   node->setSize(size);
   node->changed = true;
@@ -472,6 +959,7 @@ int FileSystem::truncate(FileNode* node, ssize_t size) {
 
 int FileSystem::remove(FileNode* node) {
   if (!write_support) return ENOTSUP;
+  waitIndexed();
 
   // Odstraň všechny synovské uzly
   if (node->type == FileNode::DIR_NODE) {
@@ -521,7 +1009,7 @@ int FileSystem::parentAccess(const char* path, int mask, uid_t uid, gid_t gid) {
 
   *ptr = '\0';
 
-  FileNode* node = find(parent);
+  FileNode* node = lookup(parent);
   free(parent);
 
   if (node == NULL) return ENOENT;
@@ -578,34 +1066,162 @@ int FileSystem::utimens(FileNode* node, const struct timespec times[2]) {
   return 0;
 }
 
-void FileSystem::fillInBuffer(FileNode* node, ssize_t size) {
-  unsigned bytes_to_read;
-  if (size == 0) bytes_to_read = node->getSize();
-  else bytes_to_read = size;
+void FileSystem::fillInBuffer(FileNode* node, offset_t size) {
+  /* Zvětšený soubor (truncate) je za původními daty dírou bufferu */
+  offset_t bytes_to_read = node->getSize();
+  if (size != 0 && size < bytes_to_read) bytes_to_read = size;
 
-  //TODO: make sparse file
+  /* Obsah je v cache - ovladač není třeba volat */
+  if (node->cached_data) {
+    node->buffer->write(node->cached_data, bytes_to_read, 0);
+    node->file_info.st_mtime = time(NULL);
+    return;
+  }
 
-  unsigned bytes_read = 0;
-  unsigned read_offset = 0;
-  driver->open(node);
+  /* Ovladač (zip, tgz) si při otevření vytváří vlastní buffer, který při
+   * uzavření uvolní - plněný buffer je proto po dobu čtení odložen */
+  Admission::Ticket ticket(this, Admission::INTERACTIVE, bytes_to_read);
+  Buffer* target = node->buffer;
+  pthread_mutex_lock(&driver_mux);
+  node->buffer = NULL;
+  if (driver->open(node)) {
+    readFromDriver(node, target, bytes_to_read);
+    driver->close(node);
+  }
+  node->buffer = target;
+  pthread_mutex_unlock(&driver_mux);
+
+  node->file_info.st_mtime = time(NULL);
+}
+
+/* zeroBlock()
+ *  obsahuje blok pouze nuly?
+ */
+static bool zeroBlock(const char* data, size_t size) {
+  if (size == 0 || data[0] != 0) return false;
+  return memcmp(data, data + 1, size - 1) == 0;
+}
+
+offset_t FileSystem::readFromDriver(FileNode* node, Buffer* target, offset_t bytes) {
+  offset_t read_offset = 0;
+  int bytes_read;
   char tmp_buf[Buffer::BLOCK_SIZE];
-  while (read_offset < bytes_to_read) {
+
+  while (read_offset < bytes) {
     bytes_read = driver->read(node, tmp_buf, Buffer::BLOCK_SIZE, read_offset);
-    node->buffer->write(tmp_buf, bytes_read, read_offset);
+    if (bytes_read <= 0) break;
+    /* Nulový blok zůstává dírou bufferu (buffer již má délku souboru) */
+    if (!zeroBlock(tmp_buf, bytes_read) || read_offset + bytes_read > target->length())
+      target->write(tmp_buf, bytes_read, read_offset);
     read_offset += bytes_read;
   }
-  driver->close(node);
+  return read_offset;
+}
 
-  node->file_info.st_mtime = time(NULL);
+offset_t FileSystem::prefetch(FileNode* node) {
+  offset_t size = 0;
+
+  if (node->type != FileNode::FILE_NODE || node->data == NULL) return 0;
+  if (node->ref_cnt > 0 || node->buffer != NULL || node->cached_data != NULL) return 0;
+
+  /* Soubor čtený proudem by byl celý uložen do bufferu */
+  if (ArchiveDriver::streamed(node->getSize())) return 0;
+
+  Admission::Ticket ticket(this, Admission::PREFETCH, node->getSize());
+
+  int fd;
+  off_t pos;
+  pthread_mutex_lock(&driver_mux);
+  /* Soubor je již otevřen, bufferován nebo v cache; uložený soubor je čten
+   * přímo z archivu stejně rychle */
+  if (node->ref_cnt > 0 || node->buffer != NULL || node->cached_data != NULL ||
+      driver->direct(node, fd, pos, true)) {
+    pthread_mutex_unlock(&driver_mux);
+    return 0;
+  }
+
+  if (driver->open(node)) {
+    /* Ovladač, který data nebufferuje, je čte přímo z archivu */
+    if (node->buffer == NULL) {
+      Buffer* target = NULL;
+      try {
+        target = new Buffer(node->getSize());
+        readFromDriver(node, target, node->getSize());
+      }
+      catch (bad_alloc&) {
+        delete target;
+        target = NULL;
+      }
+      driver->close(node);
+      node->buffer = target;
+    }
+
+    if (node->buffer != NULL) {
+      node->prefetched = true;
+      size = node->getSize();
+    }
+  }
+  pthread_mutex_unlock(&driver_mux);
+  return size;
+}
+
+bool FileSystem::fingerprint(unsigned long long& hash) {
+  /* Archiv budovaný na pozadí a archiv se změnami z úložiště se nesdílí */
+  if (background || (delta && delta->loaded())) return false;
+
+  pthread_mutex_lock(&driver_mux);
+  bool known = driver->fingerprint(hash);
+  pthread_mutex_unlock(&driver_mux);
+  return known;
+}
+
+offset_t FileSystem::dropPrefetched(FileNode* node) {
+  offset_t size = 0;
+
+  pthread_mutex_lock(&driver_mux);
+  if (node->prefetched && node->ref_cnt == 0 && !node->changed) {
+    size = node->getSize();
+    node->prefetched = false;
+    if (node->buffer && node->buffer->release())
+      node->buffer = NULL;
+  }
+  pthread_mutex_unlock(&driver_mux);
+  return size;
 }
 
 void FileSystem::close(FileNode* node) {
+  pthread_mutex_lock(&driver_mux);
   --node->ref_cnt;
 
-  if (node->changed) return;
+  if (node->changed) {
+    pthread_mutex_unlock(&driver_mux);
+    return;
+  }
 
-  if (node->ref_cnt == 0)
-    driver->close(node);
+  if (node->ref_cnt == 0) {
+    if (node->prefetched) {
+      node->prefetched = false;
+      if (node->buffer && node->buffer->release())
+        node->buffer = NULL;
+    }
+    else if (node->cached_data == NULL)
+      driver->close(node);
+    else if (node->buffer && node->buffer->release())
+      node->buffer = NULL;
+  }
+  pthread_mutex_unlock(&driver_mux);
+}
+
+bool FileSystem::isCacheable(offset_t size) const {
+  return small_cache.accepts(size);
+}
+
+bool FileSystem::cacheContent(FileNode* node, const char* data, size_t len) {
+  const char* cached = small_cache.store(data, len);
+  if (cached == NULL) return false;
+
+  node->cached_data = cached;
+  return true;
 }
 
 struct stat* FileSystem::getAttr(FileNode* node) {
@@ -655,7 +1271,6 @@ void FileSystem::initStatvfs() {
   // Velikost vfs v blocích
   archive_statvfs.f_blocks = buf.f_bavail;
 
-  archive_statvfs.f_files = file_map.size() - 1; // - root node
   archive_statvfs.f_namemax = 255;
 
   return;
@@ -677,6 +1292,39 @@ bool FileSystem::releaseUnchanged() {
   return released;
 }
 
+/* FileSystem::freezeIdle
+ * - nepoužívané bloky bufferů změněných souborů jsou komprimovány po jednom
+ * - zamčený uzel (probíhá čtení nebo zápis) je přeskočen; file_map je po
+ *   každém bloku odemčena, hledání tak nečeká na kompresi celého archivu
+ */
+void FileSystem::freezeIdle(time_t before, unsigned ratio) {
+  if (!changed) return;
+
+  pthread_mutex_lock(&fmap_mux);
+  FileMap::iterator it = file_map.begin();
+  while (it != file_map.end()) {
+    FileNode* node = it->second;
+    if (!node->changed || node->buffer == NULL
+        || pthread_rwlock_trywrlock(&(node->lock)) != 0) {
+      ++it;
+      continue;
+    }
+    size_t frozen = node->buffer->freeze(before, ratio);
+    pthread_rwlock_unlock(&(node->lock));
+    if (frozen == 0) {
+      ++it;
+      continue;
+    }
+
+    /* Uzel může být během odemčení smazán - pokračuje se podle cesty */
+    string key = it->first;
+    pthread_mutex_unlock(&fmap_mux);
+    pthread_mutex_lock(&fmap_mux);
+    it = file_map.lower_bound(key.c_str());
+  }
+  pthread_mutex_unlock(&fmap_mux);
+}
+
 void FileSystem::removeTrash() {
   FileList root_files = root_node->children;
   FileNode* node;
@@ -714,3 +1362,39 @@ void printStat(struct stat* info) {
     " a symlink" << endl;
 }
 
+
+NodeSource::NodeSource(FileSystem* _fs, FileNode* _node)
+  : fs(_fs),
+    node(_node),
+    opened(false),
+    failed(false) {
+  pthread_mutex_init(&mutex, NULL);
+}
+
+NodeSource::~NodeSource() {
+  if (opened) fs->close(node);
+  pthread_mutex_destroy(&mutex);
+}
+
+offset_t NodeSource::size() {
+  return node->getSize();
+}
+
+/* NodeSource::read
+ * - soubor je otevřen až při prvním čtení, komprimovaný soubor je tak
+ *   dekomprimován, jen pokud je vnořený archiv opravdu čten
+ */
+ssize_t NodeSource::read(char* buffer, size_t bytes, offset_t offset) {
+  pthread_mutex_lock(&mutex);
+  if (!opened && !failed) {
+    opened = fs->open(node, O_RDONLY) == 0;
+    failed = !opened;
+  }
+  pthread_mutex_unlock(&mutex);
+  if (failed) return -1;
+
+  offset_t size = node->getSize();
+  if (offset >= size) return 0;
+  if (offset_t(offset + bytes) > size) bytes = size - offset;
+  return fs->read(node, buffer, bytes, offset);
+}
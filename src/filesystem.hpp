@@ -12,6 +12,7 @@
 #include <map>
 #include <vector>
 #include <string>
+#include <ctime>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/statvfs.h>
@@ -21,23 +22,136 @@
 #include "archivedriver.hpp"
 #include "drivers.hpp"
 #include "filenode.hpp"
+#include "smallcache.hpp"
+#include "readahead.hpp"
+#include "executor.hpp"
+#include "overlay.hpp"
+#include "stats.hpp"
+#include "datasource.hpp"
 
 using namespace std;
 
+class FileSystem;
+
+/** \class NodeSource
+ * Zdroj dat čtený ze souboru uvnitř jiného archivu (vnořený archiv).
+ * Soubor je otevřen při prvním čtení - uložené soubory čte ovladač vnějšího
+ * archivu přímo z jejich pozice, komprimované soubory jsou čteny z bufferu.
+ */
+class NodeSource: public DataSource {
+public:
+  NodeSource(FileSystem* _fs, FileNode* _node);
+  ~NodeSource();
+
+  offset_t size();
+  ssize_t read(char* buffer, size_t bytes, offset_t offset);
+
+private:
+  FileSystem* fs;
+  FileNode* node;
+  bool opened;
+  bool failed;
+  pthread_mutex_t mutex;
+};
+
 /// Třída reprezentující souborový systém uvnitř archivu.
 /** Popis třídy
  *  Operace nad filesystémem vrací kladné errno.
+ *
+ *  Filesystém lze budovat na pozadí (viz startIndexing()), operace FUSE pak
+ *  hledají uzly metodou lookup(), která počká na připojení hledaného uzlu.
+ *  Statistiky (StatsSource) popisují průběh budování na pozadí.
  */
-class FileSystem {
+class FileSystem: public StatsSource {
 public:
   /// Konstruktor
+  /** @param background pokud je true, ovladač filesystém nebuduje hned,
+   *         ale až ve vlákně spuštěném startIndexing()
+   */
   FileSystem(const char* _archive_name,
              bool create_archive,
-             ArchiveType* driver_hndl);
+             ArchiveType* driver_hndl,
+             bool background = false);
+
+  /// Konstruktor vnořeného archivu čteného ze souboru node archivu outer
+  FileSystem(const char* _archive_name,
+             ArchiveType* driver_hndl,
+             FileSystem* outer,
+             FileNode* node);
+
+  /// Archiv, ve kterém je vnořený archiv uložen, jinak NULL
+  inline FileSystem* container() const {
+    return outer;
+  }
 
   /// Destruktor
+  /** Změny jsou před uvolněním uloženy voláním save(). */
   ~FileSystem();
 
+  /// Uloží změny do archivu, v režimu overlay do úložiště změn
+  /** Při zápisu do archivu jsou začleněny i změny načtené z úložiště, které
+   *  je po úspěšném zápisu smazáno.
+   *  @return false pokud se změny nepodařilo uložit
+   */
+  bool save();
+
+  /// Vrací true, pokud má save() co ukládat
+  bool needsSave() const;
+
+  /// Doplní soubory připojené na konec archivu od jeho vybudování
+  /** @return false pokud to ovladač neumí nebo archiv obsahuje změny,
+   *          archiv je pak třeba vybudovat znovu
+   */
+  bool update();
+
+  /// Archiv byl na disku nahrazen - změny již nebudou uloženy
+  void abandon();
+
+  /// Atributy archivu na disku v okamžiku vybudování (nebo update())
+  inline const struct stat& sourceInfo() const {
+    return source;
+  }
+
+  /// Otisk metadat vybudovaného archivu, viz ArchiveDriver::fingerprint()
+  bool fingerprint(unsigned long long& hash);
+
+  /// Spustí vlákno budující filesystém (konstruktor s background)
+  /** Volá se až po démonizaci procesu. */
+  bool startIndexing();
+
+  /// Počká na dokončení budování filesystému na pozadí
+  /** Vlákno budování (úložiště změn aplikuje záznamy operacemi
+   *  filesystému) nečeká.
+   */
+  void waitIndexed();
+
+  /// Zapíše průběh budování na pozadí
+  void report(ostream& out);
+
+  /// Počká na dokončení úloh na pozadí pracujících s ovladačem
+  inline void waitForTasks() {
+    serial.wait();
+  }
+
+  /// Vrací true, pokud lze FileSystem uvolnit a později znovu vybudovat
+  /** Nelze uvolnit nový archiv, archiv s neuloženými změnami ani archiv,
+   *  s nímž pracují úlohy na pozadí.
+   */
+  inline bool evictable() {
+    return !created && !needsSave() && serial.depth() == 0;
+  }
+
+  /// Odhad paměti zabrané stromem uzlů a cache malých souborů
+  inline offset_t footprint() const {
+    return memory;
+  }
+
+  /// Počet referencí (operace FUSE, otevřené soubory), chráněno FileSystemS
+  unsigned refs;
+
+  /// Čas posledního použití pro LRU, chráněno FileSystemS
+  unsigned long last_used;
+
   /// Připojí uzel odkazovaný FileNode* do file_map.
   /** Aktualizuje taky pole potomků nadřazených uzlů a vytváří vazbu
    *  mezi uzlem new_node a adresářem, jenž jej obsahuje.
@@ -53,6 +167,10 @@ public:
    *  @return FileNode* ukazatel na nalezený uzel nebo NULL
    */
   FileNode* find(const char* filename);
+
+  /// Vyhledá uzel jako find(), během budování na pozadí počká, než je uzel
+  /// připojen nebo budování skončí
+  FileNode* lookup(const char* filename);
   FileNode* getRoot() const;
 
   ///
@@ -66,27 +184,86 @@ public:
   int mkdir(const char* path, mode_t mode);
   int rename(FileNode* node, const char* new_path);
   void repath(FileNode* node, const char* path);
-  int read(FileNode* node, char* buffer, size_t bytes, off_t offset);
+  int read(FileNode* node, char* buffer, size_t bytes, off_t offset,
+           ReadAhead* readahead = NULL);
+
+  /**
+   * Připraví data bufferovaného souboru k odeslání bez mezikopie. Data
+   * bufferu (v paměti i v dočasném souboru) jsou pod zámkem zkopírována
+   * jednou do bloků alokovaných malloc (vlastní je volající), deskriptorem
+   * je předán jen soubor čtený přímo z archivu.
+   * @return false pokud soubor nemá buffer ani data v cache - čte se read()
+   */
+  bool readSlices(FileNode* node, size_t bytes, off_t offset, vector<BufferSlice>& out);
   int write(FileNode* node, const char* buffer, size_t length, off_t offset);
-  int truncate(FileNode* node, ssize_t size);
+  int truncate(FileNode* node, offset_t size);
   int remove(FileNode* node);
   int access(FileNode* node, int mask, uid_t uid, gid_t gid);
   int parentAccess(const char* path, int mask, uid_t uid, gid_t gid);
   int utimens(FileNode* node, const struct timespec times[2]);
-  void fillInBuffer(FileNode* node, ssize_t size = 0);
+  void fillInBuffer(FileNode* node, offset_t size = 0);
   void close(FileNode* node);
   struct stat* getAttr(FileNode* node);
   FileList* readDir(FileNode*);
 
+  /// Vrací true, pokud se vyplatí obsah souboru o velikosti size uložit do cache
+  /** Volá ovladač během budování filesystému, aby věděl, zdali má obsah
+   *  souboru přečíst nebo jej může přeskočit.
+   */
+  bool isCacheable(offset_t size) const;
+
+  /// Uloží obsah souboru do cache malých souborů
+  /** Po úspěšném uložení je soubor čten přímo z cache bez volání ovladače.
+   *  @return false pokud by byl překročen rozpočet cache
+   */
+  bool cacheContent(FileNode* node, const char* data, size_t len);
+
+  /// Načte obsah neotevřeného souboru do bufferu (Prefetcher)
+  /** Přístup k ovladači je serializován, soubory téhož archivu jsou tedy
+   *  dekomprimovány postupně, různé archivy paralelně.
+   *  @return velikost načtených dat, 0 pokud soubor načten nebyl
+   */
+  offset_t prefetch(FileNode* node);
+
+  /// Zkomprimuje bloky bufferů změněných souborů nepoužité od času before
+  /** Bloky, které se nezmenší alespoň na ratio procent, zůstávají
+   *  nezkomprimovány (viz ColdTier).
+   */
+  void freezeIdle(time_t before, unsigned ratio);
+
+  /// Uvolní buffer souboru načteného s předstihem, pokud nebyl otevřen
+  /** @return velikost uvolněných dat */
+  offset_t dropPrefetched(FileNode* node);
+
+  /// Zařadí úlohu pracující s ovladačem do fronty archivu
+  /** Úlohy jednoho archivu jsou vykonávány postupně, neblokují tedy vlákna
+   *  executoru čekáním na ovladač.
+   */
+  inline bool submit(Task* task) {
+    return serial.submit(task);
+  }
+
   const char* archive_name;
 
   static char* path_to_drivers;
   static bool keep_trash;
 
+  /// Změny jsou ukládány do úložiště vedle archivu, archiv není přepisován
+  static bool overlay;
+
+  /// Změny z úložiště jsou při uložení začleněny do archivu i bez dalších změn
+  static bool compact;
+
   inline static void setBufferLimit(int limit) {
     Buffer::MEM_LIMIT = limit * 1024 * 1024;
   }
 
+  /// Nastaví rozpočet cache malých souborů (v MB) a mez velikosti souboru (v kB)
+  inline static void setSmallCacheLimit(int limit, int file_limit) {
+    SmallFileCache::LIMIT = offset_t(limit) * 1024 * 1024;
+    SmallFileCache::FILE_LIMIT = offset_t(file_limit) * 1024;
+  }
+
 private:
   FileMap file_map;
 
@@ -97,8 +274,76 @@ private:
   FileNode* root_node;
   bool changed;
 
+  /// Archiv byl vytvořen, dosud neexistuje
+  bool created;
+
+  /// Viz footprint(), určeno po vybudování filesystému
+  offset_t memory;
+
+  /// Změny již byly uloženy (nebo se to nepodařilo) - ukládá se jen jednou
+  bool save_done;
+  bool save_result;
+
+  /// Viz abandon()
+  bool abandoned;
+
+  /// Viz sourceInfo()
+  struct stat source;
+
+  /// Obsah malých souborů načtený během budování filesystému
+  SmallFileCache small_cache;
+
+  /// Filesystém je budován na pozadí, nemění se po konstrukci
+  bool background;
+
+  /// Stav budování na pozadí, chráněno index_mux
+  enum {INDEX_PENDING, INDEX_RUNNING, INDEX_DONE} index_state;
+
+  /// Vlákno budování bylo spuštěno, chráněno index_mux
+  bool index_started;
+
+  /// Uzly lze vracet před dokončením budování (neaplikuje se úložiště změn)
+  bool early_lookup;
+
+  /// Ovladač vybudoval filesystém celý
+  bool index_complete;
+  time_t index_start;
+  time_t index_end;
+
+  /// Vlákno budování - index_thread pro pthread_join, indexer zapíše vlákno
+  /// samo spolu s INDEX_RUNNING (chráněno index_mux)
+  pthread_t index_thread;
+  pthread_t indexer;
+
+  /// Chrání stav budování a zveřejnění uzlů připojených během něj
+  pthread_mutex_t index_mux;
+  pthread_cond_t index_cond;
+
+  static void* runIndexing(void* fs);
+
+  /// Volající musí čekat na dokončení budování, volá se se zamčeným index_mux
+  bool mustWait() const;
+
+  /// Dokončí vybudovaný filesystém - aplikuje úložiště změn, určí footprint()
+  void built();
+
+  /// Určí footprint() a počet souborů
+  void measure();
+
+  /// Vlastní připojení uzlu, viz append()
+  void link(FileNode* new_node);
+
   int archive_file; //file deskriptor
   void initStatvfs();
+  void initLocks();
+  void destroyLocks();
+
+  /// Viz container()
+  FileSystem* outer;
+
+  /// Zdroj dat vnořeného archivu
+  DataSource* data_source;
+
   bool releaseUnchanged();
   void removeTrash();
   bool isPathSearchable(FileNode* node, uid_t uid, gid_t gid);
@@ -106,6 +351,24 @@ private:
   ArchiveDriver* driver;
   pthread_mutex_t fmap_mux;
 
+  /// Serializuje otevírání a uzavírání souborů ovladačem
+  pthread_mutex_t driver_mux;
+
+  /// Fronta úloh na pozadí pracujících s ovladačem
+  SerialQueue serial;
+
+  /// Přečte ovladačem bytes bytů otevřeného souboru do target
+  offset_t readFromDriver(FileNode* node, Buffer* target, offset_t bytes);
+
+  /// Úložiště změn archivu, NULL pokud neexistuje a není použit overlay
+  DeltaStore* delta;
+
+  /// ReadAhead čte data nebufferovaných souborů přímo ovladačem
+  friend class ReadAhead;
+
+  /// Úložiště změn čte a aplikuje změny přímo nad file_map
+  friend class DeltaStore;
+
 public:
   /** \class FileNotFound
    *  Třída pro vyjímky, které jsou vyvolány pokud konkrétní soubor v archivu
@@ -6,180 +6,418 @@
  */
 
 #include <cerrno>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <zlib.h>
 #include "membuffer.hpp"
 
-MemBuffer::Chunk::Chunk(bool initialize) {
-  data = new char[CHUNK_SIZE];
-  if (data == NULL)
-    throw std::bad_alloc();
+bool MemBuffer::huge_pages = false;
+MemBuffer::ColdCounters MemBuffer::cold = {0, 0, 0, 0, 0, 0, 0};
+pthread_mutex_t MemBuffer::cold_mux = PTHREAD_MUTEX_INITIALIZER;
 
-  if (initialize) memset(data, 0, sizeof(char)*CHUNK_SIZE);
+/* Čas procesoru vlákna v mikrosekundách */
+static unsigned long long cpuTime() {
+  struct timespec now;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) != 0) return 0;
+  return (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
-MemBuffer::Chunk::Chunk(char* _data, size_t _len) {
-  data = new char[CHUNK_SIZE];
-  if (data == NULL)
-    throw std::bad_alloc();
+MemBuffer::MemBuffer(offset_t len)
+  : _length(len),
+    _capacity(0) {
+}
 
-  if (_len > CHUNK_SIZE) _len = CHUNK_SIZE;
+MemBuffer::MemBuffer(const MemBuffer& old)
+  : _length(old._length),
+    _capacity(0) {
+  /* Nezapsané extenty nejsou sdíleny, kopie je alokuje až při zápisu;
+   * zámek - freeze() komprimuje pouze nesdílené bloky */
+  pthread_mutex_lock(&cold_mux);
+  for (vector<Extent>::const_iterator it = old.extents.begin(); it != old.extents.end(); ++it) {
+    if (it->valid == 0) continue;
+    __sync_add_and_fetch(&it->block->refs, 1);
+    extents.push_back(*it);
+    _capacity += it->size;
+  }
+  pthread_mutex_unlock(&cold_mux);
+}
 
-  memcpy(data, _data, _len);
+MemBuffer::~MemBuffer() {
+  clear();
 }
 
-MemBuffer::Chunk::~Chunk() {
-  delete[] data;
-  data = NULL;
+void MemBuffer::clear() {
+  for (vector<Extent>::iterator it = extents.begin(); it != extents.end(); ++it)
+    unref(it->block);
+  extents.clear();
+  _capacity = 0;
 }
 
-size_t MemBuffer::Chunk::read(char* _data, size_t len, offset_t offset) {
-  unsigned bytes_to_read;
-  if (len + offset > CHUNK_SIZE) {
-    bytes_to_read = CHUNK_SIZE-offset;
-    memcpy(_data, data+offset, bytes_to_read);
-  } else {
-    bytes_to_read = len;
-    memcpy(_data, data+offset, bytes_to_read);
+void MemBuffer::unref(Block* block) {
+  if (__sync_sub_and_fetch(&block->refs, 1) == 0) {
+    if (block->packed != NULL) {
+      __sync_sub_and_fetch(&cold.raw_bytes, block->raw_size);
+      __sync_sub_and_fetch(&cold.packed_bytes, block->packed_size);
+      free(block->packed);
+    }
+    free(block->data);
+    delete block;
   }
-  return bytes_to_read;
 }
 
-size_t MemBuffer::Chunk::write(const char* _data, size_t len, offset_t offset) {
-  unsigned bytes_to_write;
-  if (len + offset > CHUNK_SIZE)
-    bytes_to_write = CHUNK_SIZE-offset;
-  else
-    bytes_to_write = len;
-  memcpy(data+offset, _data, bytes_to_write);
-  return bytes_to_write;
-}
+/* MemBuffer::thaw
+ * - zkomprimovaný blok je dekomprimován při prvním přístupu, souběžní
+ *   čtenáři téhož bloku čekají na cold_mux
+ */
+char* MemBuffer::thaw(const Extent& extent) {
+  Block* block = extent.block;
+  block->used = time(NULL);
+  if (block->data != NULL) return block->data;
+
+  pthread_mutex_lock(&cold_mux);
+  if (block->data == NULL) {
+    unsigned long long start = cpuTime();
+    char* data = NULL;
+    try {
+      data = allocate(extent.size);
+    }
+    catch (bad_alloc&) {
+      pthread_mutex_unlock(&cold_mux);
+      return NULL;
+    }
 
+    uLongf length = block->raw_size;
+    if (uncompress(reinterpret_cast<Bytef*>(data), &length,
+                   reinterpret_cast<Bytef*>(block->packed), block->packed_size) != Z_OK) {
+      free(data);
+      pthread_mutex_unlock(&cold_mux);
+      return NULL;
+    }
 
+    /* Data musí být zapsána dříve, než je blok zveřejněn čtenářům */
+    __sync_synchronize();
+    block->data = data;
+    free(block->packed);
+    block->packed = NULL;
 
-MemBuffer::MemBuffer(unsigned len) {
-  _length = len;
-  chunks.clear();
-  for (unsigned i = 0; i < chunksCount(len); ++i) {
-    chunks.push_back(new Chunk(true));
+    __sync_sub_and_fetch(&cold.raw_bytes, block->raw_size);
+    __sync_sub_and_fetch(&cold.packed_bytes, block->packed_size);
+    __sync_add_and_fetch(&cold.thaws, 1);
+    __sync_add_and_fetch(&cold.thaw_us, cpuTime() - start);
   }
+  pthread_mutex_unlock(&cold_mux);
+  return block->data;
 }
 
-MemBuffer::MemBuffer(const MemBuffer& old) {
-  _length = old._length;
-  MemBuffer::Chunk* ch;
-  for (unsigned i = 0; i < chunksCount(_length); ++i) {
-    try {
-      ch = new Chunk;
+/* MemBuffer::freeze
+ * - komprimuje se bez zámku, blok nesdílený jiným bufferem (refs == 1)
+ *   mezitím nikdo nečte ani nemění; kopie bufferu vzniklá během komprese
+ *   je zjištěna před zveřejněním a výsledek je zahozen
+ */
+size_t MemBuffer::freeze(time_t before, unsigned ratio) {
+  for (vector<Extent>::iterator it = extents.begin(); it != extents.end(); ++it) {
+    Block* block = it->block;
+    if (block->data == NULL || block->rejected || block->used > before) continue;
+    if (it->valid == 0 || block->refs != 1) continue;
+
+    unsigned long long start = cpuTime();
+    uLongf packed_size = compressBound(it->valid);
+    char* packed = static_cast<char*>(malloc(packed_size));
+    if (packed == NULL) return 0;
+
+    int ret = compress2(reinterpret_cast<Bytef*>(packed), &packed_size,
+                        reinterpret_cast<Bytef*>(block->data), it->valid, Z_BEST_SPEED);
+    __sync_add_and_fetch(&cold.freeze_us, cpuTime() - start);
+
+    if (ret != Z_OK || offset_t(packed_size) * 100 > offset_t(it->valid) * ratio) {
+      free(packed);
+      block->rejected = true;
+      __sync_add_and_fetch(&cold.rejected, 1);
+      return it->valid;
     }
-    catch (bad_alloc&) {
-      for (unsigned j = 0; j < i; ++j) {
-        delete chunks[j];
-      }
-      throw;
+    char* shrunk = static_cast<char*>(realloc(packed, packed_size));
+    if (shrunk != NULL) packed = shrunk;
+
+    pthread_mutex_lock(&cold_mux);
+    if (block->refs != 1) {
+      pthread_mutex_unlock(&cold_mux);
+      free(packed);
+      continue;
     }
-    chunks.push_back(ch);
-    memcpy(chunks[i]->data, old.chunks[i]->data, CHUNK_SIZE);
+    block->packed = packed;
+    block->packed_size = packed_size;
+    block->raw_size = it->valid;
+    free(block->data);
+    block->data = NULL;
+    pthread_mutex_unlock(&cold_mux);
+
+    __sync_add_and_fetch(&cold.raw_bytes, block->raw_size);
+    __sync_add_and_fetch(&cold.packed_bytes, block->packed_size);
+    __sync_add_and_fetch(&cold.freezes, 1);
+    return it->valid;
   }
+  return 0;
 }
 
-// MemBuffer::MemBuffer(char* data, ssize_t len) {
-//   length = len;
-//   off_t offset = 0;
-//
-//   for (unsigned i = 0; i < chunksCount(length); ++i) {
-//     Chunk* a = new Chunk(data+offset, length);
-//     offset += CHUNK_SIZE;
-//     chunks.push_back(a);
-//   }
-// }
+/* MemBuffer::writable
+ * - blok sdílený jiným bufferem se nemění, extent dostane vlastní kopii
+ *   (kopíruje se pouze tento extent)
+ */
+char* MemBuffer::writable(size_t i) {
+  Block* block = extents[i].block;
+  char* data = thaw(extents[i]);
+  if (data == NULL) throw bad_alloc();
+  block->rejected = false;
+  if (block->refs == 1) return data;
 
-MemBuffer::~MemBuffer() {
-  if (_length == 0) return;
-  for (vector<Chunk*>::iterator it = chunks.begin(); it != chunks.end(); ++it) {
-    delete (*it);
+  Block* copy = new Block;
+  try {
+    copy->data = allocate(extents[i].size);
+  }
+  catch (bad_alloc&) {
+    delete copy;
+    throw;
+  }
+  copy->refs = 1;
+  copy->packed = NULL;
+  copy->used = time(NULL);
+  copy->rejected = false;
+  memcpy(copy->data, data, extents[i].valid);
+
+  extents[i].block = copy;
+  unref(block);
+  return copy->data;
+}
+
+/* MemBuffer::allocate
+ * - velký extent je zarovnán na huge page, aby jej jádro mohlo namapovat
+ *   huge pages (madvise je pouze doporučení)
+ */
+char* MemBuffer::allocate(size_t size) {
+  void* data = NULL;
+
+#ifdef MADV_HUGEPAGE
+  if (huge_pages && size >= HUGE_PAGE) {
+    if (posix_memalign(&data, HUGE_PAGE, size) != 0) throw bad_alloc();
+    madvise(data, size, MADV_HUGEPAGE);
+    return static_cast<char*>(data);
+  }
+#endif
+
+  data = malloc(size);
+  if (data == NULL) throw bad_alloc();
+  return static_cast<char*>(data);
+}
+
+/* MemBuffer::insert
+ * - extent začíná na násobku CHUNK_SIZE a končí nejpozději na začátku
+ *   následujícího extentu
+ * - první extent má velikost délky bufferu (malé soubory zabírají jediný
+ *   extent), extent navazující na poslední extent zdvojnásobuje kapacitu,
+ *   nejvýše však o MAX_EXTENT
+ */
+void MemBuffer::insert(size_t i, offset_t offset, offset_t end) {
+  offset_t start = (offset / CHUNK_SIZE) * CHUNK_SIZE;
+  offset_t size = ((end + CHUNK_SIZE - 1) / CHUNK_SIZE) * CHUNK_SIZE - start;
+
+  if (i == extents.size()) {
+    if (extents.empty() && start == 0 && _length > size)
+      size = ((_length + CHUNK_SIZE - 1) / CHUNK_SIZE) * CHUNK_SIZE;
+    else if (!extents.empty() && extents.back().start + offset_t(extents.back().size) == start
+             && _capacity > size)
+      size = _capacity;
+  }
+  if (size > offset_t(MAX_EXTENT)) size = MAX_EXTENT;
+  if (i < extents.size() && start + size > extents[i].start)
+    size = extents[i].start - start;
+
+  Extent extent;
+  extent.block = new Block;
+  try {
+    extent.block->data = allocate(size);
   }
+  catch (bad_alloc&) {
+    delete extent.block;
+    throw;
+  }
+  extent.block->refs = 1;
+  extent.block->packed = NULL;
+  extent.block->used = time(NULL);
+  extent.block->rejected = false;
+  extent.start = start;
+  extent.size = size;
+  extent.valid = 0;
+  extents.insert(extents.begin() + i, extent);
+  _capacity += size;
 }
 
-char* MemBuffer::getChunkData(unsigned i) {
-  return chunks.at(i)->data;
+/* Index prvního extentu končícího za pozicí offset */
+size_t MemBuffer::extentAt(offset_t offset) const {
+  size_t low = 0;
+  size_t high = extents.size();
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    if (extents[middle].start + offset_t(extents[middle].size) <= offset) low = middle + 1;
+    else high = middle;
+  }
+  return low;
 }
 
-char* MemBuffer::operator[](int i) {
-  if (i < 0) i = _length - i;
-  return chunks[i]->data;
+/* MemBuffer::run
+ * - vrací délku úseku od pozice offset (nejvýše do end), který je celý
+ *   zapsán v extentu extent, nebo je celý dírou (extent == NULL)
+ * - i je index extentu z extentAt(), posouvá se spolu s offset
+ */
+offset_t MemBuffer::run(size_t& i, offset_t offset, offset_t end, const Extent*& extent) const {
+  while (i < extents.size() && extents[i].start + offset_t(extents[i].size) <= offset) ++i;
+
+  extent = NULL;
+  if (i == extents.size()) return end - offset;
+
+  const Extent& current = extents[i];
+  if (current.start > offset)
+    return ((end < current.start) ? end : current.start) - offset;
+
+  offset_t valid_end = current.start + current.valid;
+  if (offset < valid_end) {
+    extent = &current;
+    return ((end < valid_end) ? end : valid_end) - offset;
+  }
+
+  offset_t extent_end = current.start + current.size;
+  return ((end < extent_end) ? end : extent_end) - offset;
 }
 
 size_t MemBuffer::read(char* buffer, offset_t bytes, offset_t offset) const {
-  size_t read = 0;
   if (offset > _length) return -EINVAL;
   if (bytes+offset > _length) bytes = _length-offset;
-  size_t bytes_to_read = bytes;
-  unsigned chunk_start = chunkNumber(offset);
-  unsigned chunk_end = chunkNumber(offset) + chunksCount(bytes);
 
-  for (unsigned i = chunk_start; i < chunk_end; ++i) {
-    read = chunks[i]->read(buffer, bytes_to_read, chunkOffset(offset));
-    offset += read;
-    buffer += read;
-    bytes_to_read -= read;
+  offset_t end = offset + bytes;
+  size_t i = extentAt(offset);
+  const Extent* extent;
+  while (offset < end) {
+    offset_t len = run(i, offset, end, extent);
+    if (extent != NULL) {
+      const char* data = thaw(*extent);
+      if (data == NULL) return -ENOMEM;
+      memcpy(buffer, data + (offset - extent->start), len);
+    }
+    else memset(buffer, 0, len);  // díra
+    buffer += len;
+    offset += len;
   }
   return bytes;
 }
 
-size_t MemBuffer::write(const char* data, offset_t data_len, offset_t offset) {
-  unsigned chunks_needed = chunksCount(data_len + offset);
-  unsigned chunks_count = chunks.size();
+size_t MemBuffer::slices(offset_t offset, size_t bytes, vector<BufferSlice>& out) const {
+  static const char zeros[CHUNK_SIZE] = {0};
+
+  if (offset >= _length) return 0;
+  if (offset_t(bytes+offset) > _length) bytes = _length-offset;
 
-  if (chunks_count < chunks_needed) {
-    unsigned new_chunks = chunks_needed - chunks_count;
-    for (unsigned i = 0; i < new_chunks; ++i) {
-      chunks.push_back(new Chunk);
+  offset_t end = offset + bytes;
+  size_t i = extentAt(offset);
+  BufferSlice slice;
+  slice.fd = -1;
+  slice.pos = 0;
+
+  size_t first = out.size();
+  while (offset < end) {
+    const Extent* extent;
+    offset_t len = run(i, offset, end, extent);
+    if (extent != NULL) {
+      const char* data = thaw(*extent);
+      if (data == NULL) {
+        out.resize(first);
+        return 0;
+      }
+      slice.data = data + (offset - extent->start);
+      slice.size = len;
+      out.push_back(slice);
+    } else {
+      /* Díra - úseky sdíleného nulového bloku */
+      for (offset_t done = 0; done < len; done += slice.size) {
+        slice.data = zeros;
+        slice.size = (len - done > offset_t(CHUNK_SIZE)) ? CHUNK_SIZE : len - done;
+        out.push_back(slice);
+      }
     }
+    offset += len;
+  }
+  return bytes;
+}
+
+offset_t MemBuffer::seekData(offset_t offset) const {
+  size_t i = extentAt(offset);
+  const Extent* extent;
+  while (offset < _length) {
+    offset_t len = run(i, offset, _length, extent);
+    if (extent != NULL) return offset;
+    offset += len;
   }
-  _length = offset;
+  return _length;
+}
 
-  unsigned chunks_to_write = chunksCount(data_len);
-  unsigned chunk_start = chunkNumber(offset);
-  unsigned chunk_end = chunkNumber(offset)+chunks_to_write;
-  size_t written = 0;
-  for (unsigned i = chunk_start; i < chunk_end; ++i) {
-    written = chunks[i]->write(data+written, data_len-written, chunkOffset(offset));
-    offset += written;
-    _length += written;
+offset_t MemBuffer::seekHole(offset_t offset) const {
+  size_t i = extentAt(offset);
+  const Extent* extent;
+  while (offset < _length) {
+    offset_t len = run(i, offset, _length, extent);
+    if (extent == NULL) return offset;
+    offset += len;
   }
-  return written;
+  return _length;
 }
 
-void MemBuffer::truncate(offset_t size) {
-  if (size < _length) {
-    memset(getChunkData(chunkNumber(size))+chunkOffset(size), 0, CHUNK_SIZE-size);
-    for (unsigned chunk = chunksCount(size); chunk < chunks.size(); ++chunk)
-      delete chunks.at(chunk);
-    chunks.resize(chunksCount(size));
-  } else {
-    for (unsigned i = chunks.size(); i < chunksCount(size); ++i)
-      chunks.push_back(new Chunk(true));
+/* MemBuffer::write
+ * - extenty jsou alokovány pouze pro zapisovaný rozsah, díry před ním
+ *   zůstávají bez paměti
+ * - nuluje se pouze mezera mezi zapsanými daty extentu a místem zápisu
+ */
+size_t MemBuffer::write(const char* data, offset_t data_len, offset_t offset) {
+  if (data_len == 0) return 0;
+
+  offset_t end = offset + data_len;
+  size_t i = extentAt(offset);
+  while (offset < end) {
+    if (i == extents.size() || extents[i].start > offset)
+      insert(i, offset, end);
+
+    char* memory = writable(i);
+    Extent& extent = extents[i++];
+    offset_t inside = offset - extent.start;
+    offset_t bytes = extent.size - inside;
+    if (bytes > end - offset) bytes = end - offset;
+
+    if (inside > offset_t(extent.valid))
+      memset(memory + extent.valid, 0, inside - extent.valid);
+    memcpy(memory + inside, data, bytes);
+    if (inside + bytes > offset_t(extent.valid)) extent.valid = inside + bytes;
+
+    data += bytes;
+    offset += bytes;
   }
 
-  _length = size;
+  if (end > _length) _length = end;
+  return data_len;
 }
 
-bool MemBuffer::flushToFile(int fd) {
-  offset_t bytes_to_write = _length;
-  for (uint i = 0; i < chunksCount(_length); ++i) {
-    bytes_to_write -= ::write(fd, chunks[i]->data,
-                             (bytes_to_write < CHUNK_SIZE?bytes_to_write:CHUNK_SIZE));
+/* Zvětšení bufferu nealokuje paměť - nová data jsou dírou */
+void MemBuffer::truncate(offset_t size) {
+  _length = size;
+
+  while (!extents.empty() && extents.back().start >= size) {
+    _capacity -= extents.back().size;
+    unref(extents.back().block);
+    extents.pop_back();
   }
-  if (bytes_to_write == 0)
-    return true;
-  else
-    return false;
-}
 
-// void MemBuffer::print() {
-//   for (vector<Chunk*>::iterator it = chunks.begin(); it != chunks.end(); ++it) {
-//     cout.write((*it)->data, CHUNK_SIZE);
-//   }
-// }
+  if (!extents.empty()) {
+    Extent& last = extents.back();
+    if (last.start + offset_t(last.valid) > size) last.valid = size - last.start;
+  }
+}
 
 ostream& operator<< (ostream& stream, MemBuffer& buffer) {
   char* out_buf = new char[buffer._length];
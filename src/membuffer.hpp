@@ -9,9 +9,11 @@
 #define MEM_BUFFER_HPP
 
 #include <vector>
+#include <ctime>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <pthread.h>
 
 #include "bufferiface.hpp"
 
@@ -19,20 +21,59 @@ using namespace std;
 
 /// Dynamicky se zvětšující buffer
 /** \class MemBuffer
- * Implementuje dynamický buffer na haldě, alokující své části o velikosti
- * definované v konstantě CHUNK_SIZE.
+ * Implementuje dynamický buffer na haldě. Data jsou uložena v souvislých
+ * úsecích (extentech) seřazených podle pozice. Extenty jsou alokovány pouze
+ * pro zapsané rozsahy, ostatní místa bufferu jsou dírami - čtou se jako
+ * nuly a nezabírají paměť. Velikost extentů navazujících na konec bufferu
+ * roste geometricky - malý soubor zabírá jediný extent své velikosti, velký
+ * soubor několik extentů o velikosti nejvýše MAX_EXTENT. Paměť extentu není
+ * nulována, data za poslední zapsanou pozicí extentu jsou čtena jako nuly.
+ *
+ * Bloky extentů jsou sdíleny kopiemi bufferu (počítání referencí), kopie
+ * je tedy levná. Blok sdílený více buffery je před změnou zkopírován
+ * (copy-on-write).
+ *
+ * Nepoužívané bloky lze zkomprimovat (freeze(), viz ColdTier), při dalším
+ * přístupu jsou transparentně dekomprimovány.
  */
 class MemBuffer: public BufferIface {
 public:
-  /// Velikost jednoho "dílu" bufferu - najednou alokované jednotky
+  /// Jednotka alokace - velikost extentu je jejím násobkem
   static const unsigned CHUNK_SIZE = 4*1024;
 
+  /// Max. velikost jednoho extentu
+  static const unsigned MAX_EXTENT = 64*1024*1024;
+
+  /// Velikost huge page - extenty alespoň této velikosti mohou huge pages užít
+  static const unsigned HUGE_PAGE = 2*1024*1024;
+
+  /// Velké extenty jsou alokovány pro transparent huge pages (--huge-pages)
+  static bool huge_pages;
+
+  /** \struct MemBuffer::ColdCounters
+   * Statistiky komprese nepoužívaných bloků (všech bufferů).
+   */
+  struct ColdCounters {
+    /// Data právě uložená komprimovaně - původní a komprimovaná velikost
+    volatile unsigned long long raw_bytes;
+    volatile unsigned long long packed_bytes;
+    volatile unsigned long long freezes;
+    volatile unsigned long long thaws;
+    /// Bloky, které se nepodařilo zmenšit pod požadovaný poměr
+    volatile unsigned long long rejected;
+    /// Čas procesoru strávený kompresí a dekompresí v mikrosekundách
+    volatile unsigned long long freeze_us;
+    volatile unsigned long long thaw_us;
+  };
+  static ColdCounters cold;
+
   /**
-   * Alokuje pameť bufferu pro uložení len bytů.
-   * @throws std_bad_alloc pokud není možno alokovat další paměť
+   * Buffer délky len obsahující nuly (díru). Paměť je alokována až při
+   * zápisu, první extent má velikost len.
    */
-  MemBuffer(unsigned len = 0);
+  MemBuffer(offset_t len = 0);
 
+  /// Sdílí bloky původního bufferu, data nekopíruje
   MemBuffer(const MemBuffer& old);
 
   /**
@@ -49,6 +90,12 @@ public:
    */
   size_t read(char* buffer, offset_t bytes, offset_t offset = 0) const;
 
+  /// Úseky extentů, nezapsaná data jsou úseky sdíleného nulového bloku
+  size_t slices(offset_t offset, size_t bytes, vector<BufferSlice>& out) const;
+
+  offset_t seekData(offset_t offset) const;
+  offset_t seekHole(offset_t offset) const;
+
   /**
    * Funkce zapíše do bufferu data odkazovaná ukazatelem data o délce
    * length, na místo v bufferu s offsetem offset.
@@ -56,101 +103,95 @@ public:
    * Pokud je třeba, dojde automaticky ke zvětšení (doalokování)
    * místa v bufferu.
    * @returns počet zapsaných bytů
+   * @throws std::bad_alloc
    */
   size_t write(const char* data, offset_t length, offset_t offset = 0);
 
+  /// Změní délku bufferu, extenty za novou délkou jsou uvolněny
   void truncate(offset_t size);
 
+  /**
+   * Zkomprimuje (zlib) jeden blok nepoužitý od času before, pokud se
+   * zmenší alespoň na ratio procent. Volá se s výhradním přístupem
+   * k bufferu (uzel zamčen pro zápis).
+   * @returns velikost zpracovaného bloku, 0 pokud žádný nezbývá
+   */
+  size_t freeze(time_t before, unsigned ratio);
+
   inline offset_t length() {
     return _length;
   }
 
-  bool flushToFile(int fd);
-
   friend ostream& operator<< (ostream&, MemBuffer&);
 
 private:
-  /** \class MemBuffer::Chunk
-   * Implementuje segment bufferu.
+  /** \struct MemBuffer::Block
+   * Paměť extentu sdílená kopiemi bufferu.
+   */
+  struct Block {
+    /// Paměť bloku, NULL pokud je blok zkomprimován
+    char* volatile data;
+    volatile unsigned refs;
+    /// Komprimovaná data (raw_size bytů začátku bloku)
+    char* packed;
+    size_t packed_size;
+    size_t raw_size;
+    /// Čas posledního přístupu
+    time_t used;
+    /// Blok se nepodařilo zkomprimovat, do změny se nezkouší znovu
+    bool rejected;
+  };
+
+  /** \struct MemBuffer::Extent
+   * Souvislý úsek paměti s daty bufferu od pozice start.
    */
-  class Chunk {
-  public:
-    /// Ukazatel na data segmentu.
-    char* data;
-
-    /**
-     * Konstruktor alokuje místo pro uložení dat.
-     * Lze specifikovat, zdali se má paměť s daty inicializovat = vynulovat.
-     * @throws std::bad_alloc pokud není možno alokovat další paměť
-     */
-    Chunk(bool initialize = false);
-
-    /**
-     * Konstruktor alokuje místo pro uložení dat a kopíruje _len bytů
-     * z dat odkazovaných ukazatelem _data - NEJVÍCE však CHUNK_SIZE bytů.
-     * @throws std::bad_alloc pokud není možno alokovat další paměť
-     */
-    Chunk(char* _data, size_t _len = CHUNK_SIZE);
-
-    /**
-     * Destruktor uvolní paměť užívanou segmentem, nuluje ukazetel data.
-     */
-    ~Chunk();
-
-    /**
-     * Funkce čte len bytů segmentu s offsetem offset do paměti odkazované
-     * ukazatelem _data.
-     *
-     * Pokud by se při čtení len bytů s daným offsetem mělo přistoupit za
-     * hranici segmentu, přečte se pouze zbytek segmentu od začátku offsetu.
-     * @returns počet přečtených bytů
-     */
-    size_t read(char* _data, size_t len, offset_t offset);
-
-    /**
-     * Funkce zapíše len bytů dat z paměti odkazované ukazatelem _data do
-     * datové části segmentu bufferu s offsetem offset.
-     *
-     * Pokud by zápis len bytů s offsetem offset měl zapsat za hranici segmentu
-     * bude zapsáno pouze tolik bytů, aby k tomuto překročení nedošlo.
-     * @returns počet zapsaných batů
-     */
-    size_t write(const char* _data, size_t len, offset_t offset);
+  struct Extent {
+    Block* block;
+    offset_t start;
+    size_t size;
+    /// Zapsaná data extentu (od začátku), zbytek je čten jako nuly
+    size_t valid;
   };
 
+  /// Logická délka bufferu
   offset_t _length;
 
-  /// Vektor se segmenty bufferu.
-  vector<Chunk*> chunks;
+  /// Součet velikostí extentů
+  offset_t _capacity;
 
-  /**
-   * Vrací ukazatel na užitečná data i-tého segmentu bufferu.
-   * @throws std::out_of_range při překročení hranic bufferu
-   */
-  char* getChunkData(unsigned i);
+  /// Extenty seřazené podle pozice, mezi nimi jsou díry
+  vector<Extent> extents;
 
-  /**
-   * Slouží k indexaci segmentů.
-   * Nevyvolává vyjímky při překročení hranic bufferu.
-   * Pokud je index záporný, počítají se segmenty do konce bufferu.
-   */
-  char* operator[](int i);
+  /// Vloží na index i extent pro zápis rozsahu <offset, end)
+  /** @throws std::bad_alloc */
+  void insert(size_t i, offset_t offset, offset_t end);
 
-  /// Vrací počet segmentů potřebných k uložení len bytů.
-  inline static unsigned chunksCount(offset_t len) {
-    return (len + CHUNK_SIZE -1) / CHUNK_SIZE;
-  }
+  /// Vrací index prvního extentu končícího za pozicí offset
+  size_t extentAt(offset_t offset) const;
 
-  /// Vrací index segmentu obsahujícího první byte s offsetem offset.
-  inline static unsigned chunkNumber(offset_t offset) {
-    return offset/CHUNK_SIZE;
-  }
+  /// Délka úseku dat extentu (extent) nebo díry (extent == NULL) od pozice offset
+  offset_t run(size_t& i, offset_t offset, offset_t end, const Extent*& extent) const;
 
-  /// Vrací offset v segmentu pro byte se segmentem offset v bufferu.
-  inline static unsigned chunkOffset(offset_t offset) {
-    return offset%CHUNK_SIZE;
-  }
+  /// Paměť bloku extentu, zkomprimovaný blok dekomprimuje; NULL pokud není paměť
+  static char* thaw(const Extent& extent);
+
+  /// Chrání dekompresi bloků a počet referencí komprimovaných bloků
+  static pthread_mutex_t cold_mux;
+
+  /// Uvolní všechny extenty
+  void clear();
+
+  /// Vrací paměť i-tého extentu pro zápis, sdílený blok nejprve zkopíruje
+  /** @throws std::bad_alloc */
+  char* writable(size_t i);
+
+  /// Uvolní referenci na blok, poslední reference blok dealokuje
+  static void unref(Block* block);
+
+  static char* allocate(size_t size);
+
+  MemBuffer& operator=(const MemBuffer&);
 };
 
 
-#endif
\ No newline at end of file
+#endif
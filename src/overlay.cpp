@@ -0,0 +1,319 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     File implementing store of archive changes (overlay)
+ * Modified: 04/2012
+ */
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "overlay.hpp"
+#include "filesystem.hpp"
+
+const char* DeltaStore::SUFFIX = ".afsdelta";
+
+bool DeltaStore::exists(const char* archive_name) {
+  struct stat info;
+  string journal(archive_name);
+  journal += SUFFIX;
+  journal += "/journal";
+  return ::stat(journal.c_str(), &info) == 0;
+}
+
+DeltaStore::DeltaStore(const char* archive_name)
+  : dir(archive_name),
+    records(0),
+    next_id(1) {
+  dir += SUFFIX;
+}
+
+DeltaStore::~DeltaStore() {
+  for (vector<Buffer*>::iterator it = committed.begin(); it != committed.end(); ++it)
+    delete *it;
+}
+
+string DeltaStore::dataPath(const string& id) const {
+  return dir + "/data/" + id;
+}
+
+/* DeltaStore::load
+ * - původní cesty uzlů jsou zjištěny před aplikací záznamů, záznamy se
+ *   totiž odkazují na soubory archivu jejich jménem v archivu
+ * - soubor s daty, na který odkazuje žurnál, nesmí být změněn před dalším
+ *   uložením; buffer uzlu je proto kopií bufferu drženého úložištěm
+ *   a změněný soubor dostane při uložení nový identifikátor
+ */
+bool DeltaStore::load(FileSystem* fs, bool direct) {
+  ifstream journal((dir + "/journal").c_str());
+  if (!journal) return false;
+
+  map<string, FileNode*> base;
+  for (FileMap::iterator it = fs->file_map.begin(); it != fs->file_map.end(); ++it)
+    base[it->first] = it->second;
+
+  /* Záznamy se aplikují běžnými operacemi filesystému */
+  bool write_support = fs->write_support;
+  fs->write_support = true;
+
+  string line;
+  vector<string> fields;
+  bool complete = true;
+  while (getline(journal, line)) {
+    if (line.empty()) continue;
+    split(line, fields);
+    ++records;
+
+    const string& kind = fields[0];
+    map<string, FileNode*>::iterator orig;
+
+    if (kind == "D" && fields.size() == 2) {
+      orig = base.find(fields[1]);
+      if (orig == base.end()) continue;
+      if (fs->find(orig->second->pathname) == orig->second)
+        fs->remove(orig->second);
+    }
+    else if (kind == "R" && fields.size() == 3) {
+      orig = base.find(fields[1]);
+      if (orig == base.end()) continue;
+      /* Přejmenováním adresáře byl uzel již přesunut */
+      if (fields[2] != orig->second->pathname)
+        fs->rename(orig->second, fields[2].c_str());
+    }
+    else if (kind == "M" && fields.size() == 3) {
+      fs->mkdir(fields[1].c_str(), strtoul(fields[2].c_str(), NULL, 8));
+    }
+    else if (kind == "F" && fields.size() == 6) {
+      string path = dataPath(fields[4]);
+      offset_t size = strtoull(fields[5].c_str(), NULL, 10);
+      Buffer* buffer = NULL;
+      try {
+        if (direct) {
+          committed.push_back(new Buffer(path.c_str(), size));
+          buffer = new Buffer(*committed.back());
+        }
+        else {
+          Buffer data(path.c_str(), size);
+          char block[Buffer::BLOCK_SIZE];
+          buffer = new Buffer(size);
+          for (offset_t offset = 0; offset < size; offset += Buffer::BLOCK_SIZE) {
+            size_t len = data.read(block, Buffer::BLOCK_SIZE, offset);
+            if (len == 0 || len == size_t(-1)) break;
+            buffer->write(block, len, offset);
+          }
+        }
+      }
+      catch (...) {
+        delete buffer;
+        cerr << "Overlay: cannot load " << path << " for " << fields[1] << endl;
+        complete = false;
+        continue;
+      }
+
+      FileNode* node = fs->find(fields[1].c_str());
+      if (node == NULL) {
+        fs->mknod(fields[1].c_str(), S_IFREG);
+        node = fs->find(fields[1].c_str());
+      }
+      if (node == NULL || node->type != FileNode::FILE_NODE) {
+        delete buffer;
+        complete = false;
+        continue;
+      }
+
+      delete node->buffer;
+      node->buffer = buffer;
+      node->cached_data = NULL;
+      node->file_info.st_mode = strtoul(fields[2].c_str(), NULL, 8) | S_IFREG;
+      node->file_info.st_mtime = strtol(fields[3].c_str(), NULL, 10);
+      node->setSize(size);
+      node->changed = true;
+
+      unsigned long id = strtoul(fields[4].c_str(), NULL, 10);
+      if (id >= next_id) next_id = id + 1;
+    }
+    else {
+      cerr << "Overlay: malformed record in " << dir << "/journal" << endl;
+      complete = false;
+    }
+  }
+
+  fs->write_support = write_support;
+  /* Změny jsou již uloženy v úložišti */
+  fs->changed = false;
+  return complete;
+}
+
+bool DeltaStore::writeData(Buffer* buffer, offset_t size, string& id) {
+  ostringstream name;
+  name << next_id++;
+  id = name.str();
+
+  string path = dataPath(id);
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd == -1) return false;
+
+  /* Zapisují se pouze data bufferu, díry zůstanou dírami souboru */
+  char block[Buffer::BLOCK_SIZE];
+  bool ok = true;
+  for (offset_t offset = buffer->seekData(0); offset < size && ok; offset = buffer->seekData(offset)) {
+    offset_t end = buffer->seekHole(offset);
+    if (end > size) end = size;
+    while (offset < end && ok) {
+      offset_t len = end - offset;
+      if (len > offset_t(Buffer::BLOCK_SIZE)) len = Buffer::BLOCK_SIZE;
+      len = buffer->read(block, len, offset);
+      if (len == 0 || size_t(len) == size_t(-1)) break;
+      ok = (::pwrite(fd, block, len, offset) == ssize_t(len));
+      offset += len;
+    }
+    if (offset < end) break;
+  }
+  ok = ok && (::ftruncate(fd, size) == 0);
+  ok = ok && (::fsync(fd) == 0);
+  ::close(fd);
+  return ok;
+}
+
+/* DeltaStore::save
+ * - data souborů, jejichž buffer již leží v úložišti, nejsou kopírována
+ * - žurnál je zapsán vedle a přejmenován, při pádu tedy zůstane platný
+ *   předchozí stav
+ */
+bool DeltaStore::save(FileSystem* fs) {
+  ::mkdir(dir.c_str(), S_IRWXU);
+  ::mkdir((dir + "/data").c_str(), S_IRWXU);
+
+  string tmp_path = dir + "/journal.tmp";
+  ofstream journal(tmp_path.c_str(), ios::out | ios::trunc);
+  if (!journal) return false;
+
+  string data_prefix = dataPath("");
+  vector<string> used;
+  bool ok = true;
+  FileNode* node;
+
+  /* Přesuny předchází mazání - soubor mohl být ze smazaného adresáře
+   * přesunut. Rodičovské adresáře předchází svůj obsah (pořadí file_map) */
+  for (FileMap::iterator it = fs->file_map.begin(); it != fs->file_map.end(); ++it) {
+    node = it->second;
+    if (node->data != NULL && node->original_pathname != NULL)
+      journal << "R\t" << escape(node->original_pathname) << '\t'
+              << escape(node->pathname) << '\n';
+  }
+
+  for (FileList::iterator it = fs->removed_nodes.begin(); it != fs->removed_nodes.end(); ++it) {
+    node = *it;
+    journal << "D\t" << escape(node->original_pathname ? node->original_pathname
+                                                       : node->pathname) << '\n';
+  }
+
+  for (FileMap::iterator it = fs->file_map.begin(); it != fs->file_map.end(); ++it) {
+    node = it->second;
+    if (!node->changed) continue;
+
+    if (node->type == FileNode::DIR_NODE) {
+      if (node->data == NULL)
+        journal << "M\t" << escape(node->pathname) << '\t'
+                << oct << (node->file_info.st_mode & 07777) << dec << '\n';
+      continue;
+    }
+    if (node->buffer == NULL) continue;
+
+    offset_t size = node->getSize();
+    const char* path = node->buffer->path();
+    string id;
+    if (path != NULL && strncmp(path, data_prefix.c_str(), data_prefix.size()) == 0)
+      id = path + data_prefix.size();
+    else if (!writeData(node->buffer, size, id)) {
+      cerr << "Overlay: cannot write data of " << node->pathname << endl;
+      ok = false;
+      continue;
+    }
+    used.push_back(id);
+
+    journal << "F\t" << escape(node->pathname) << '\t'
+            << oct << (node->file_info.st_mode & 07777) << dec << '\t'
+            << node->file_info.st_mtime << '\t' << id << '\t' << size << '\n';
+  }
+
+  journal.close();
+  if (journal.fail() || !ok) {
+    ::unlink(tmp_path.c_str());
+    return false;
+  }
+
+  if (::rename(tmp_path.c_str(), (dir + "/journal").c_str()) != 0) return false;
+
+  removeUnused(used);
+  return true;
+}
+
+void DeltaStore::removeUnused(const vector<string>& used) {
+  string data_dir = dir + "/data";
+  DIR* dp = ::opendir(data_dir.c_str());
+  if (dp == NULL) return;
+
+  struct dirent* entry;
+  while ((entry = ::readdir(dp)) != NULL) {
+    if (entry->d_name[0] == '.') continue;
+    if (::find(used.begin(), used.end(), string(entry->d_name)) == used.end())
+      ::unlink(dataPath(entry->d_name).c_str());
+  }
+  ::closedir(dp);
+}
+
+bool DeltaStore::remove() {
+  removeUnused(vector<string>());
+  ::rmdir((dir + "/data").c_str());
+  ::unlink((dir + "/journal").c_str());
+  records = 0;
+  return ::rmdir(dir.c_str()) == 0;
+}
+
+string DeltaStore::escape(const char* str) {
+  string escaped;
+  for (; *str; ++str) {
+    switch (*str) {
+      case '\t': escaped += "\\t"; break;
+      case '\n': escaped += "\\n"; break;
+      case '\\': escaped += "\\\\"; break;
+      default:   escaped += *str;
+    }
+  }
+  return escaped;
+}
+
+string DeltaStore::unescape(const string& str) {
+  string unescaped;
+  for (string::size_type i = 0; i < str.size(); ++i) {
+    if (str[i] == '\\' && i + 1 < str.size()) {
+      ++i;
+      if (str[i] == 't')      unescaped += '\t';
+      else if (str[i] == 'n') unescaped += '\n';
+      else                    unescaped += str[i];
+    } else
+      unescaped += str[i];
+  }
+  return unescaped;
+}
+
+void DeltaStore::split(const string& line, vector<string>& fields) {
+  fields.clear();
+  string::size_type start = 0, end;
+  do {
+    end = line.find('\t', start);
+    fields.push_back(unescape(line.substr(start, end == string::npos ? string::npos
+                                                                     : end - start)));
+    start = end + 1;
+  } while (end != string::npos);
+}
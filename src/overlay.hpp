@@ -0,0 +1,100 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     Header file for overlay.cpp
+ * Modified: 04/2012
+ */
+
+#ifndef OVERLAY_HPP
+#define OVERLAY_HPP
+
+#include <string>
+#include <vector>
+
+#include "filenode.hpp"
+
+using namespace std;
+
+class FileSystem;
+
+/// Úložiště změn archivu (overlay)
+/** \class DeltaStore
+ * Místo přepisování archivu jsou změny uloženy vedle něj do adresáře
+ * <archiv>.afsdelta. Ten obsahuje soubor journal s metadaty změn
+ * a adresář data s obsahem nových a změněných souborů.
+ *
+ * Každý řádek žurnálu je jeden záznam, položky jsou odděleny tabulátorem:
+ *   R <cesta v archivu> <nová cesta>           přejmenovaný soubor archivu
+ *   D <cesta v archivu>                        smazaný soubor archivu
+ *   M <cesta> <práva>                          nový adresář
+ *   F <cesta> <práva> <mtime> <data> <velikost> nový/změněný soubor
+ * Záznamy jsou aplikovány v pořadí R, D, M, F tak, jak jsou zapsány.
+ *
+ * Žurnál je při uložení zapsán celý znovu (do dočasného souboru, který je
+ * přejmenován), data nezměněných souborů zůstávají na místě.
+ */
+class DeltaStore {
+public:
+  /// Přípona adresáře s úložištěm změn
+  static const char* SUFFIX;
+
+  /// Vrací true, pokud k archivu existuje úložiště změn
+  static bool exists(const char* archive_name);
+
+  DeltaStore(const char* archive_name);
+  ~DeltaStore();
+
+  /**
+   * Aplikuje změny uložené v úložišti na fs.
+   * @param direct pokud je true, sdílí buffery změněných souborů soubory
+   *        s jejich daty (první zápis vytvoří vlastní kopii), jinak jsou
+   *        data zkopírována
+   */
+  bool load(FileSystem* fs, bool direct);
+
+  /// Zapíše do úložiště aktuální stav změn fs
+  bool save(FileSystem* fs);
+
+  /// Smaže úložiště (po začlenění změn do archivu)
+  bool remove();
+
+  /// Vrací true, pokud byly načteny nějaké změny
+  inline bool loaded() const {
+    return records > 0;
+  }
+
+  inline const char* path() const {
+    return dir.c_str();
+  }
+
+private:
+  /// Cesta k adresáři úložiště
+  string dir;
+
+  /// Počet načtených záznamů
+  unsigned records;
+
+  /// Identifikátor pro data dalšího souboru
+  unsigned long next_id;
+
+  /// Buffery nad načtenými soubory s daty - dokud je úložiště drží, je
+  /// soubor sdílen a zápis do bufferu uzlu jej nezmění (copy-on-write)
+  vector<Buffer*> committed;
+
+  string dataPath(const string& id) const;
+
+  /// Uloží obsah bufferu do nového souboru v úložišti, vrací jeho identifikátor
+  bool writeData(Buffer* buffer, offset_t size, string& id);
+
+  /// Smaže soubory s daty, na které žurnál neodkazuje
+  void removeUnused(const vector<string>& used);
+
+  static string escape(const char* str);
+  static string unescape(const string& str);
+  static void split(const string& line, vector<string>& fields);
+
+  DeltaStore(const DeltaStore&);
+  DeltaStore& operator=(const DeltaStore&);
+};
+
+#endif
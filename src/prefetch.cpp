@@ -0,0 +1,517 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     File implementing recording and replaying of prefetch manifests
+ * Modified: 04/2012
+ */
+
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include "prefetch.hpp"
+#include "filesystem.hpp"
+
+offset_t Prefetcher::LIMIT = 256*1024*1024;
+unsigned Prefetcher::DIRECTORY_HITS = 0;
+Prefetcher* Prefetcher::global_prefetcher = NULL;
+pthread_mutex_t Prefetcher::global_mux = PTHREAD_MUTEX_INITIALIZER;
+
+Prefetcher* Prefetcher::global() {
+  pthread_mutex_lock(&global_mux);
+  if (global_prefetcher == NULL)
+    global_prefetcher = new Prefetcher;
+  pthread_mutex_unlock(&global_mux);
+  return global_prefetcher;
+}
+
+Prefetcher* Prefetcher::current() {
+  pthread_mutex_lock(&global_mux);
+  Prefetcher* prefetcher = global_prefetcher;
+  pthread_mutex_unlock(&global_mux);
+  return prefetcher;
+}
+
+void Prefetcher::destroyGlobal() {
+  pthread_mutex_lock(&global_mux);
+  delete global_prefetcher;
+  global_prefetcher = NULL;
+  pthread_mutex_unlock(&global_mux);
+}
+
+bool Prefetcher::loadManifest(const char* path, vector<Entry>& entries) {
+  ifstream in(path);
+  if (!in) {
+    cerr << "Cannot open prefetch manifest " << path << endl;
+    return false;
+  }
+
+  string line;
+  string::size_type tab;
+  while (getline(in, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    tab = line.find('\t');
+    if (tab == string::npos) continue;
+    entries.push_back(Entry(line.substr(0, tab), line.substr(tab + 1)));
+  }
+  return true;
+}
+
+Prefetcher::Prefetcher()
+  : record_path(NULL),
+    running(false),
+    cancelled(false),
+    position(0),
+    misses(0),
+    tasks(0),
+    held(0),
+    dir_clock(0),
+    stopping(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+}
+
+Prefetcher::~Prefetcher() {
+  pthread_mutex_lock(&mutex);
+  cancelled = true;
+  stopping = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+
+  if (running) pthread_join(runner, NULL);
+
+  /* Úlohy ve frontě odkazují na tento objekt */
+  pthread_mutex_lock(&mutex);
+  while (tasks > 0 || !busy.empty())
+    pthread_cond_wait(&cond, &mutex);
+  pthread_mutex_unlock(&mutex);
+
+  /* Buffery načtených souborů uvolní FileSystémy */
+  for (map<const FileNode*, DirScan*>::iterator it = dirs.begin(); it != dirs.end(); ++it)
+    delete it->second;
+
+  if (record_path) {
+    writeManifest();
+    free(record_path);
+  }
+
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+void Prefetcher::record(const char* path) {
+  pthread_mutex_lock(&mutex);
+  free(record_path);
+  record_path = strdup(path);
+  pthread_mutex_unlock(&mutex);
+}
+
+bool Prefetcher::writeManifest() {
+  pthread_mutex_lock(&mutex);
+  ofstream out(record_path, ios::out | ios::trunc);
+  if (!out) {
+    pthread_mutex_unlock(&mutex);
+    cerr << "Cannot write prefetch manifest " << record_path << endl;
+    return false;
+  }
+
+  for (vector<Entry>::const_iterator it = recorded.begin(); it != recorded.end(); ++it)
+    out << it->first << '\t' << it->second << '\n';
+  pthread_mutex_unlock(&mutex);
+
+  return out.good();
+}
+
+bool Prefetcher::replay(const vector<pair<FileSystem*, FileNode*> >& nodes) {
+  Item item;
+
+  pthread_mutex_lock(&mutex);
+  if (running) {
+    pthread_mutex_unlock(&mutex);
+    return false;
+  }
+
+  items.clear();
+  item_index.clear();
+  for (vector<pair<FileSystem*, FileNode*> >::const_iterator it = nodes.begin();
+       it != nodes.end(); ++it) {
+    /* Soubor je v manifestu uveden pouze poprvé */
+    if (item_index.find(it->second) != item_index.end()) continue;
+
+    item.fs = it->first;
+    item.node = it->second;
+    item.size = it->second->getSize();
+    item.state = Item::WAITING;
+    item_index[item.node] = items.size();
+    items.push_back(item);
+  }
+
+  position = 0;
+  misses = 0;
+  cancelled = false;
+  running = !items.empty() && pthread_create(&runner, NULL, run, this) == 0;
+  pthread_mutex_unlock(&mutex);
+
+  return running;
+}
+
+void Prefetcher::opened(FileSystem* fs, FileNode* node) {
+  pthread_mutex_lock(&mutex);
+
+  if (record_path && node->pathname) {
+    string key(fs->archive_name);
+    key += '\t';
+    key += node->pathname;
+    if (recorded_set.insert(pair<string, bool>(key, true)).second)
+      recorded.push_back(Entry(fs->archive_name, node->pathname));
+  }
+
+  if (node->parent != NULL && !dirs.empty()) {
+    map<const FileNode*, DirScan*>::iterator it = dirs.find(node->parent);
+    if (it != dirs.end() && it->second->fs == fs) {
+      DirScan* scan = it->second;
+      scan->age = ++dir_clock;
+      if (scan->opened.insert(node).second) ++scan->hits;
+      if (scan->hits >= DIRECTORY_HITS && !scan->active)
+        startScan(scan);
+    }
+  }
+
+  if (running && !cancelled) {
+    map<const FileNode*, size_t>::const_iterator it = item_index.find(node);
+    if (it != item_index.end()) {
+      misses = 0;
+      if (it->second >= position) position = it->second + 1;
+      /* Buffer načteného souboru nyní patří otevřenému souboru */
+      Item& item = items[it->second];
+      if (item.state != Item::LOADING) item.state = Item::DONE;
+    } else if (++misses >= MAX_MISSES) {
+      /* Aplikace manifest nenásleduje */
+      cerr << "Prefetch: access pattern diverged from manifest, cancelling" << endl;
+      pthread_mutex_unlock(&mutex);
+      cancel();
+      return;
+    }
+  }
+
+  pthread_mutex_unlock(&mutex);
+}
+
+bool Prefetcher::uses(FileSystem* fs) {
+  pthread_mutex_lock(&mutex);
+  bool used = busy.find(fs) != busy.end();
+  pthread_mutex_unlock(&mutex);
+
+  return used;
+}
+
+/* Prefetcher::forget
+ * - běžící úloha adresáře skončí po načítaném souboru a adresář uvolní sama
+ * - buffery jsou uvolňovány mimo zámek (dropPrefetched zamyká ovladač fs,
+ *   který při otevření volá consumed())
+ */
+void Prefetcher::forget(FileSystem* fs) {
+  vector<DirScan*> scans;
+  vector<FileNode*> loaded;
+  offset_t released;
+
+  pthread_mutex_lock(&mutex);
+  map<const FileNode*, DirScan*>::iterator dir = dirs.begin();
+  while (dir != dirs.end()) {
+    DirScan* scan = dir->second;
+    if (scan->fs != fs) {
+      ++dir;
+      continue;
+    }
+    dirs.erase(dir++);
+    if (scan->active)
+      scan->evicted = true;
+    else
+      scans.push_back(scan);
+  }
+
+  for (vector<Item>::iterator it = items.begin(); it != items.end(); ++it) {
+    if (it->fs != fs || it->state == Item::DONE) continue;
+    item_index.erase(it->node);
+    if (it->state == Item::WAITING) it->state = Item::DONE;
+  }
+
+  while (busy.find(fs) != busy.end())
+    pthread_cond_wait(&cond, &mutex);
+
+  for (vector<Item>::iterator it = items.begin(); it != items.end(); ++it) {
+    if (it->fs != fs || it->state != Item::LOADED) continue;
+    it->state = Item::DONE;
+    loaded.push_back(it->node);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  for (vector<DirScan*>::iterator it = scans.begin(); it != scans.end(); ++it)
+    dropScan(*it);
+  for (vector<FileNode*>::iterator it = loaded.begin(); it != loaded.end(); ++it) {
+    released = fs->dropPrefetched(*it);
+    if (released > 0) consumed(released);
+  }
+}
+
+void Prefetcher::unbusy(FileSystem* fs) {
+  busy.erase(busy.find(fs));
+  pthread_cond_broadcast(&cond);
+}
+
+void Prefetcher::consumed(offset_t bytes) {
+  pthread_mutex_lock(&mutex);
+  held = (bytes > held) ? 0 : held - bytes;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+void Prefetcher::listed(FileSystem* fs, FileNode* dir) {
+  DirScan* victim = NULL;
+
+  if (DIRECTORY_HITS == 0 || LIMIT == 0) return;
+
+  pthread_mutex_lock(&mutex);
+  map<const FileNode*, DirScan*>::iterator it = dirs.find(dir);
+  if (it != dirs.end()) {
+    it->second->age = ++dir_clock;
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+
+  DirScan* scan = new DirScan;
+  scan->fs = fs;
+  scan->dir = dir;
+  scan->next = 0;
+  scan->hits = 0;
+  scan->age = ++dir_clock;
+  scan->active = false;
+  scan->evicted = false;
+  dirs[dir] = scan;
+
+  /* Nejdéle nepoužitý adresář je zapomenut */
+  if (dirs.size() > MAX_DIRECTORIES) {
+    map<const FileNode*, DirScan*>::iterator oldest = dirs.begin();
+    for (it = dirs.begin(); it != dirs.end(); ++it)
+      if (it->second->age < oldest->second->age) oldest = it;
+
+    victim = oldest->second;
+    dirs.erase(oldest);
+
+    /* Běžící úloha uvolní adresář sama */
+    if (victim->active) {
+      victim->evicted = true;
+      victim = NULL;
+    } else
+      busy.insert(victim->fs);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  if (victim) {
+    FileSystem* fs = victim->fs;
+    dropScan(victim);
+    pthread_mutex_lock(&mutex);
+    unbusy(fs);
+    pthread_mutex_unlock(&mutex);
+  }
+}
+
+/* Řazení souborů podle pozice v archivu */
+static bool archiveOrder(const FileNode* a, const FileNode* b) {
+  return a->data->order() < b->data->order();
+}
+
+void Prefetcher::startScan(DirScan* scan) {
+  if (stopping) return;
+
+  /* Seznam souborů se vytváří až při prvním spuštění */
+  if (scan->siblings.empty() && scan->next == 0) {
+    for (FileList::iterator it = scan->dir->children.begin();
+         it != scan->dir->children.end(); ++it) {
+      if ((*it)->type == FileNode::FILE_NODE && (*it)->data != NULL)
+        scan->siblings.push_back(*it);
+    }
+    stable_sort(scan->siblings.begin(), scan->siblings.end(), archiveOrder);
+  }
+
+  if (scan->next >= scan->siblings.size()) return;
+
+  Task* task = new DirScanTask(this, scan);
+  scan->active = true;
+  ++tasks;
+  busy.insert(scan->fs);
+  if (!scan->fs->submit(task)) {
+    delete task;
+    scan->active = false;
+    --tasks;
+    unbusy(scan->fs);
+  }
+}
+
+void Prefetcher::dropScan(DirScan* scan) {
+  offset_t released;
+
+  for (vector<FileNode*>::iterator it = scan->siblings.begin();
+       it != scan->siblings.end(); ++it) {
+    released = scan->fs->dropPrefetched(*it);
+    if (released > 0) consumed(released);
+  }
+  delete scan;
+}
+
+/* Prefetcher::cancel
+ * - volá se z open(), na rozpracované úlohy se nečeká - soubor, který právě
+ *   načítají, uvolní samy (PrefetchTask::run)
+ */
+void Prefetcher::cancel() {
+  vector<Item> loaded;
+  offset_t released;
+
+  pthread_mutex_lock(&mutex);
+  cancelled = true;
+  pthread_cond_broadcast(&cond);
+
+  for (vector<Item>::iterator it = items.begin(); it != items.end(); ++it) {
+    if (it->state == Item::LOADING) continue;
+    if (it->state == Item::LOADED) {
+      loaded.push_back(*it);
+      busy.insert(it->fs);
+    }
+    it->state = Item::DONE;
+  }
+  pthread_mutex_unlock(&mutex);
+
+  for (vector<Item>::iterator it = loaded.begin(); it != loaded.end(); ++it) {
+    released = it->fs->dropPrefetched(it->node);
+    if (released > 0) consumed(released);
+    pthread_mutex_lock(&mutex);
+    unbusy(it->fs);
+    pthread_mutex_unlock(&mutex);
+  }
+}
+
+void* Prefetcher::run(void* data) {
+  Prefetcher* p = reinterpret_cast<Prefetcher*>(data);
+  Item* item;
+  Task* task;
+
+  pthread_mutex_lock(&p->mutex);
+  for (size_t i = 0; i < p->items.size() && !p->cancelled; ++i) {
+    item = &p->items[i];
+
+    /* Omezení paměti a počtu úloh ve frontách - executor slouží i jiným účelům */
+    while (!p->cancelled &&
+           (p->tasks >= Executor::WORKERS ||
+            (p->held > 0 && p->held + item->size > LIMIT)))
+      pthread_cond_wait(&p->cond, &p->mutex);
+
+    if (p->cancelled) break;
+
+    /* Archiv byl uvolněn (forget()) */
+    if (item->state != Item::WAITING) continue;
+
+    /* Soubor již aplikace otevřela sama, soubor větší než celý rozpočet
+     * se nenačítá */
+    if (i < p->position || item->size > LIMIT) {
+      item->state = Item::DONE;
+      continue;
+    }
+
+    p->held += item->size;
+    ++p->tasks;
+    item->state = Item::LOADING;
+    p->busy.insert(item->fs);
+    pthread_mutex_unlock(&p->mutex);
+
+    task = new PrefetchTask(p, item);
+    if (!item->fs->submit(task)) {
+      delete task;
+      pthread_mutex_lock(&p->mutex);
+      p->held -= item->size;
+      --p->tasks;
+      item->state = Item::DONE;
+      p->unbusy(item->fs);
+      break;
+    }
+
+    pthread_mutex_lock(&p->mutex);
+  }
+  pthread_mutex_unlock(&p->mutex);
+
+  return NULL;
+}
+
+void Prefetcher::PrefetchTask::run() {
+  FileSystem* fs = item->fs;
+  offset_t size = 0;
+
+  pthread_mutex_lock(&p->mutex);
+  bool cancelled = p->cancelled;
+  pthread_mutex_unlock(&p->mutex);
+
+  if (!cancelled)
+    size = fs->prefetch(item->node);
+
+  pthread_mutex_lock(&p->mutex);
+  /* Nevyužitá část rezervace je uvolněna, zbytek uvolní consumed() */
+  if (size < item->size)
+    p->held = (p->held > item->size - size) ? p->held - (item->size - size) : 0;
+  --p->tasks;
+
+  /* Přehrávání bylo během načítání zrušeno - buffer je uvolněn hned */
+  cancelled = p->cancelled && size > 0;
+  item->state = (size > 0 && !cancelled) ? Item::LOADED : Item::DONE;
+  if (cancelled) {
+    pthread_mutex_unlock(&p->mutex);
+    offset_t released = fs->dropPrefetched(item->node);
+    if (released > 0) p->consumed(released);
+    pthread_mutex_lock(&p->mutex);
+  }
+  p->unbusy(fs);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+void Prefetcher::DirScanTask::run() {
+  FileNode* node;
+  offset_t size;
+  offset_t loaded;
+  bool evicted;
+
+  pthread_mutex_lock(&p->mutex);
+  while (!p->stopping && !scan->evicted && scan->next < scan->siblings.size()) {
+    node = scan->siblings[scan->next];
+    size = node->getSize();
+
+    /* Soubory otevřené aplikací a soubory větší než celý rozpočet se přeskočí */
+    if (scan->opened.count(node) > 0 || size > LIMIT) {
+      ++scan->next;
+      continue;
+    }
+
+    /* Rozpočet je vyčerpán - pokračuje se při dalším otevření souboru */
+    if (p->held > 0 && p->held + size > LIMIT) break;
+
+    ++scan->next;
+    p->held += size;
+    pthread_mutex_unlock(&p->mutex);
+
+    loaded = scan->fs->prefetch(node);
+
+    pthread_mutex_lock(&p->mutex);
+    if (loaded < size)
+      p->held = (p->held > size - loaded) ? p->held - (size - loaded) : 0;
+  }
+  scan->active = false;
+  evicted = scan->evicted;
+  FileSystem* fs = scan->fs;
+  pthread_mutex_unlock(&p->mutex);
+
+  if (evicted) p->dropScan(scan);
+
+  pthread_mutex_lock(&p->mutex);
+  --p->tasks;
+  p->unbusy(fs);
+  pthread_mutex_unlock(&p->mutex);
+}
@@ -0,0 +1,218 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     Header file for prefetch.cpp
+ * Modified: 04/2012
+ */
+
+#ifndef PREFETCH_HPP
+#define PREFETCH_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "bufferiface.hpp"
+#include "executor.hpp"
+
+using namespace std;
+
+class FileSystem;
+class FileNode;
+
+/// Načítání souborů do bufferů dříve, než jsou otevřeny
+/** \class Prefetcher
+ * Zaznamenává, které soubory byly otevřeny a v jakém pořadí (manifest),
+ * a při dalším připojení podle manifestu soubory dekomprimuje na pozadí
+ * do bufferů. Paměť zabraná takto načtenými a dosud neotevřenými soubory
+ * je omezena mezí LIMIT.
+ *
+ * Pokud se otevírané soubory v manifestu opakovaně nevyskytují, přestala
+ * aplikace manifest následovat - načítání je zrušeno a nepoužité buffery
+ * uvolněny.
+ *
+ * Manifest je textový soubor, na každém řádku je cesta k archivu a cesta
+ * k souboru uvnitř archivu oddělené tabulátorem.
+ *
+ * Bez manifestu jsou načítány soubory adresářů, které jsou procházeny
+ * rekurzivně (grep -r, tar c, ...): pokud je po vylistování adresáře
+ * otevřeno DIRECTORY_HITS jeho souborů, jsou zbývající soubory adresáře
+ * načteny na pozadí v pořadí, v jakém jsou uloženy v archivu.
+ */
+class Prefetcher {
+public:
+  /// Mez paměti pro načtené a dosud neotevřené soubory v bytech
+  static offset_t LIMIT;
+
+  /// Počet po sobě jdoucích otevření mimo manifest, po kterém je přehrávání zrušeno
+  static const unsigned MAX_MISSES = 16;
+
+  /// Počet otevřených souborů vylistovaného adresáře, po kterém jsou načteny ostatní, 0 vypíná
+  static unsigned DIRECTORY_HITS;
+
+  /// Počet sledovaných adresářů, nejdéle nepoužitý je zapomenut
+  static const unsigned MAX_DIRECTORIES = 16;
+
+  /// Položka manifestu - archiv a soubor v něm
+  typedef pair<string, string> Entry;
+
+  /// Globální objekt, vytvořený při prvním použití
+  static Prefetcher* global();
+
+  /// Globální objekt, pokud existuje, jinak NULL
+  static Prefetcher* current();
+
+  /// Ukončí přehrávání, zapíše manifest a uvolní globální objekt
+  static void destroyGlobal();
+
+  /// Načte manifest ze souboru path do entries
+  static bool loadManifest(const char* path, vector<Entry>& entries);
+
+  Prefetcher();
+
+  /**
+   * Destruktor zruší přehrávání, počká na dokončení úloh a případně
+   * zapíše zaznamenaný manifest.
+   */
+  ~Prefetcher();
+
+  /// Zahájí záznam otevíraných souborů, manifest bude zapsán do path
+  void record(const char* path);
+
+  /// Zapíše zaznamenaný manifest
+  bool writeManifest();
+
+  /**
+   * Spustí vlákno, které v pořadí daném nodes načítá soubory do bufferů.
+   * Uzly musí patřit k příslušným FileSystémům.
+   */
+  bool replay(const vector<pair<FileSystem*, FileNode*> >& nodes);
+
+  /// Voláno FileSystémem při každém otevření souboru
+  void opened(FileSystem* fs, FileNode* node);
+
+  /// Voláno FileSystémem, pokud byl otevřen dříve načtený soubor
+  void consumed(offset_t bytes);
+
+  /// Voláno FileSystémem při listování adresáře
+  void listed(FileSystem* fs, FileNode* dir);
+
+  /// Vrací true, pokud úloha Prefetcheru právě pracuje s fs
+  bool uses(FileSystem* fs);
+
+  /**
+   * Zapomene položky manifestu a adresáře fs a uvolní jimi načtené buffery.
+   * Počká na úlohy, které s fs právě pracují. Volá se před uvolněním fs.
+   */
+  void forget(FileSystem* fs);
+
+private:
+  /** \struct Prefetcher::Item
+   * Soubor, který má být načten.
+   */
+  struct Item {
+    /// Čeká na načtení, načítá se, načten a neotevřen, vyřízen (fs neplatí)
+    enum State { WAITING, LOADING, LOADED, DONE };
+
+    FileSystem* fs;
+    FileNode* node;
+    offset_t size;
+    State state;
+  };
+
+  /** \class Prefetcher::PrefetchTask
+   * Úloha načítající jeden soubor do bufferu.
+   */
+  class PrefetchTask: public Task {
+  public:
+    PrefetchTask(Prefetcher* _p, Item* _item) : Task(LOW), p(_p), item(_item) {}
+    void run();
+  private:
+    Prefetcher* p;
+    Item* item;
+  };
+
+  /** \struct Prefetcher::DirScan
+   * Stav načítání souborů jednoho vylistovaného adresáře.
+   */
+  struct DirScan {
+    FileSystem* fs;
+    FileNode* dir;
+    /// Soubory adresáře seřazené podle pořadí v archivu
+    vector<FileNode*> siblings;
+    /// Soubory otevřené aplikací
+    set<const FileNode*> opened;
+    /// Index dalšího souboru v siblings
+    size_t next;
+    unsigned hits;
+    unsigned long age;
+    bool active;
+    bool evicted;
+  };
+
+  /** \class Prefetcher::DirScanTask
+   * Úloha postupně načítající soubory adresáře, dokud to dovolí LIMIT.
+   */
+  class DirScanTask: public Task {
+  public:
+    DirScanTask(Prefetcher* _p, DirScan* _scan) : Task(LOW), p(_p), scan(_scan) {}
+    void run();
+  private:
+    Prefetcher* p;
+    DirScan* scan;
+  };
+
+  /* Záznam */
+  char* record_path;
+  vector<Entry> recorded;
+  map<string, bool> recorded_set;
+
+  /* Přehrávání */
+  vector<Item> items;
+  map<const FileNode*, size_t> item_index;
+  pthread_t runner;
+  bool running;
+  bool cancelled;
+
+  /// Index první položky, kterou aplikace dosud neotevřela
+  size_t position;
+  unsigned misses;
+
+  /// Počet úloh ve frontě
+  unsigned tasks;
+
+  /// Paměť zabraná načtenými a dosud neotevřenými soubory
+  offset_t held;
+
+  /// FileSystémy, se kterými pracují úlohy nebo uvolňování mimo zámek
+  multiset<FileSystem*> busy;
+
+  /* Adresáře */
+  map<const FileNode*, DirScan*> dirs;
+  unsigned long dir_clock;
+  bool stopping;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  static Prefetcher* global_prefetcher;
+  static pthread_mutex_t global_mux;
+
+  static void* run(void* prefetcher);
+
+  /// Zruší přehrávání a uvolní nepoužité buffery
+  void cancel();
+
+  /// Zahájí načítání souborů adresáře, volá se se zamčeným mutexem
+  void startScan(DirScan* scan);
+
+  /// Uvolní nepoužité buffery souborů adresáře a samotný objekt scan
+  void dropScan(DirScan* scan);
+
+  /// Ukončí práci s fs mimo zámek, volá se se zamčeným mutexem
+  void unbusy(FileSystem* fs);
+};
+
+#endif
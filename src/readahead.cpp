@@ -0,0 +1,219 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     File implementing read-ahead of sequentially read files
+ * Modified: 04/2012
+ */
+
+#include <cstring>
+#include <new>
+
+#include "readahead.hpp"
+#include "filesystem.hpp"
+
+size_t ReadAhead::MAX_WINDOW = 1024*1024;
+
+ReadAhead::ReadAhead(FileSystem* _fs, FileNode* _node)
+  : fs(_fs),
+    node(_node),
+    expected(-1),
+    hits(0),
+    window(MIN_WINDOW),
+    generation(0),
+    pending(0) {
+
+  for (unsigned i = 0; i < 2; ++i) {
+    segments[i].state = Segment::EMPTY;
+    segments[i].data = NULL;
+    segments[i].capacity = 0;
+    segments[i].start = 0;
+    segments[i].length = 0;
+    segments[i].generation = 0;
+  }
+
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+}
+
+ReadAhead::~ReadAhead() {
+  pthread_mutex_lock(&mutex);
+  while (pending > 0)
+    pthread_cond_wait(&cond, &mutex);
+  pthread_mutex_unlock(&mutex);
+
+  for (unsigned i = 0; i < 2; ++i)
+    delete[] segments[i].data;
+
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+int ReadAhead::read(char* buffer, size_t bytes, offset_t offset) {
+  size_t served;
+  int ret;
+
+  pthread_mutex_lock(&mutex);
+  if (offset == expected) {
+    ++hits;
+  } else if (find(offset) == NULL) {
+    /* Náhodný přístup - začínáme znovu */
+    reset();
+  }
+  expected = offset + bytes;
+
+  served = serve(buffer, bytes, offset);
+
+  /* Další okno se čte již během čtení zbytku aktuálního požadavku */
+  schedule(offset + served);
+  pthread_mutex_unlock(&mutex);
+
+  if (served == bytes) return served;
+
+  ret = readDriver(buffer + served, bytes - served, offset + served);
+  if (ret < 0)
+    return (served > 0) ? int(served) : ret;
+
+  return served + ret;
+}
+
+ReadAhead::Segment* ReadAhead::find(offset_t offset) {
+  for (unsigned i = 0; i < 2; ++i) {
+    Segment* s = &segments[i];
+    if (s->state == Segment::EMPTY || s->generation != generation) continue;
+    if (s->start <= offset && offset < s->end()) return s;
+  }
+  return NULL;
+}
+
+size_t ReadAhead::serve(char* buffer, size_t bytes, offset_t offset) {
+  size_t done = 0;
+  size_t len;
+  Segment* s;
+
+  while (done < bytes) {
+    s = find(offset + done);
+    if (s == NULL) break;
+
+    /* Segment se právě načítá - počkáme na něj */
+    while (s->state == Segment::FILLING && s->generation == generation)
+      pthread_cond_wait(&cond, &mutex);
+
+    if (s->state != Segment::READY || s->generation != generation) break;
+    if (offset_t(offset + done) >= s->end()) break;
+
+    len = s->end() - (offset + done);
+    if (len > bytes - done) len = bytes - done;
+    memcpy(buffer + done, s->data + (offset + done - s->start), len);
+    done += len;
+  }
+  return done;
+}
+
+void ReadAhead::schedule(offset_t pos) {
+  if (hits < SEQUENTIAL_HITS) return;
+
+  offset_t size = node->getSize();
+  offset_t next = pos;
+  Segment* free_segment = NULL;
+  Segment* s;
+
+  /* Najdeme konec dat, která jsou již načtena nebo se načítají */
+  for (unsigned i = 0; i < 2; ++i) {
+    s = &segments[i];
+    if (s->state != Segment::EMPTY && s->generation == generation &&
+        s->start <= next && next < s->end())
+      next = s->end();
+  }
+  for (unsigned i = 0; i < 2; ++i) {
+    s = &segments[i];
+    if (s->state != Segment::EMPTY && s->generation == generation &&
+        s->start == next)
+      next = s->end();
+  }
+
+  if (next >= size) return;
+
+  /* Volný je prázdný segment nebo segment, který už čtenář přečetl */
+  for (unsigned i = 0; i < 2 && free_segment == NULL; ++i) {
+    s = &segments[i];
+    if (s->state == Segment::EMPTY ||
+        (s->state == Segment::READY && (s->generation != generation || s->end() <= pos)))
+      free_segment = &segments[i];
+  }
+  if (free_segment == NULL) return;
+
+  s = free_segment;
+  if (s->capacity < window) {
+    delete[] s->data;
+    s->data = new (nothrow) char[window];
+    if (s->data == NULL) {
+      s->capacity = 0;
+      s->state = Segment::EMPTY;
+      return;
+    }
+    s->capacity = window;
+  }
+
+  s->state = Segment::FILLING;
+  s->generation = generation;
+  s->start = next;
+  s->length = (size - next < offset_t(window)) ? size_t(size - next) : window;
+
+  ++pending;
+  Task* task = new FetchTask(this, s);
+  if (!Executor::global()->submit(task)) {
+    delete task;
+    --pending;
+    s->state = Segment::EMPTY;
+    return;
+  }
+
+  if (window < MAX_WINDOW) {
+    window *= 2;
+    if (window > MAX_WINDOW) window = MAX_WINDOW;
+  }
+}
+
+int ReadAhead::readDriver(char* buffer, size_t bytes, offset_t offset) {
+  /* Ovladač udržuje pozici v proudu (gzseek, ZipInflater), čtení z úlohy
+   * a z vlákna FUSE se proto nesmí překrývat */
+  pthread_mutex_lock(&fs->driver_mux);
+  int ret = fs->driver->read(node, buffer, bytes, offset);
+  pthread_mutex_unlock(&fs->driver_mux);
+  return ret;
+}
+
+void ReadAhead::reset() {
+  hits = 0;
+  window = MIN_WINDOW;
+  ++generation;
+
+  /* Segmenty, které se právě načítají, uvolní až úloha */
+  for (unsigned i = 0; i < 2; ++i) {
+    if (segments[i].state == Segment::READY)
+      segments[i].state = Segment::EMPTY;
+  }
+}
+
+void ReadAhead::FetchTask::run() {
+  size_t filled = 0;
+  int ret;
+
+  /* Segment ve stavu FILLING nikdo jiný nemění, data lze číst bez zámku */
+  while (filled < segment->length) {
+    ret = ra->readDriver(segment->data + filled, segment->length - filled,
+                         segment->start + filled);
+    if (ret <= 0) break;
+    filled += ret;
+  }
+
+  pthread_mutex_lock(&ra->mutex);
+  segment->length = filled;
+  if (segment->generation == ra->generation && filled > 0)
+    segment->state = Segment::READY;
+  else
+    segment->state = Segment::EMPTY;
+  --ra->pending;
+  pthread_cond_broadcast(&ra->cond);
+  pthread_mutex_unlock(&ra->mutex);
+}
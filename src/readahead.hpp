@@ -0,0 +1,132 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     Header file for readahead.cpp
+ * Modified: 04/2012
+ */
+
+#ifndef READ_AHEAD_HPP
+#define READ_AHEAD_HPP
+
+#include <cstddef>
+#include <pthread.h>
+
+#include "bufferiface.hpp"
+#include "executor.hpp"
+
+class FileSystem;
+class FileNode;
+
+/// Čtení dat s předstihem pro sekvenčně čtené soubory
+/** \class ReadAhead
+ * Objekt je vytvářen pro každé otevření souboru zvlášť a sleduje, jakým
+ * způsobem jsou data souboru čtena. Pokud jsou čtena sekvenčně, jsou
+ * následující data čtena ovladačem na pozadí (Executor) do jednoho ze dvou
+ * segmentů a další čtení jsou obsloužena z nich. Velikost čteného okna
+ * roste s každým dalším sekvenčním čtením až do MAX_WINDOW. Při náhodném
+ * přístupu je okno zmenšeno na minimum a načtená data zahozena.
+ *
+ * Používá se pouze pro soubory, které nejsou bufferovány - čte se z nich
+ * přímo ovladačem (ISO, tar bez komprese).
+ */
+class ReadAhead {
+public:
+  /// Maximální velikost okna v bytech, 0 čtení s předstihem vypíná
+  static size_t MAX_WINDOW;
+
+  /// Velikost okna po prvním rozpoznání sekvenčního čtení
+  static const size_t MIN_WINDOW = 128*1024;
+
+  /// Počet po sobě jdoucích sekvenčních čtení nutných k zahájení čtení s předstihem
+  static const unsigned SEQUENTIAL_HITS = 2;
+
+  inline static bool enabled() {
+    return MAX_WINDOW > 0;
+  }
+
+  ReadAhead(FileSystem* fs, FileNode* node);
+
+  /**
+   * Destruktor počká na dokončení všech čtení na pozadí.
+   */
+  ~ReadAhead();
+
+  /**
+   * Přečte bytes bytů s offsetem offset do buffer. Data jsou pokud možno
+   * čtena z načtených segmentů, zbytek je přečten přímo ovladačem.
+   * @returns počet přečtených bytů nebo záporný kód chyby ovladače
+   */
+  int read(char* buffer, size_t bytes, offset_t offset);
+
+private:
+  /** \struct ReadAhead::Segment
+   * Souvislý úsek dat souboru načtený (nebo právě načítaný) na pozadí.
+   */
+  struct Segment {
+    enum State {EMPTY, FILLING, READY} state;
+    char* data;
+    size_t capacity;
+    offset_t start;
+    /// Počet platných (u FILLING požadovaných) bytů
+    size_t length;
+    /// Generace, ve které bylo čtení segmentu zahájeno
+    unsigned generation;
+
+    inline offset_t end() const {
+      return start + length;
+    }
+  };
+
+  /** \class ReadAhead::FetchTask
+   * Úloha načítající data segmentu ovladačem.
+   */
+  class FetchTask: public Task {
+  public:
+    FetchTask(ReadAhead* _ra, Segment* _segment)
+      : Task(HIGH), ra(_ra), segment(_segment) {}
+    void run();
+  private:
+    ReadAhead* ra;
+    Segment* segment;
+  };
+
+  FileSystem* fs;
+  FileNode* node;
+
+  Segment segments[2];
+
+  /// Offset, od kterého by začínalo další sekvenční čtení
+  offset_t expected;
+
+  /// Počet po sobě jdoucích sekvenčních čtení
+  unsigned hits;
+
+  /// Aktuální velikost okna
+  size_t window;
+
+  /// Generace je zvýšena při každém náhodném přístupu, starší segmenty jsou neplatné
+  unsigned generation;
+
+  /// Počet úloh zařazených do fronty a dosud nedokončených
+  unsigned pending;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  /// Vrací segment obsahující byte s offsetem offset nebo NULL
+  Segment* find(offset_t offset);
+
+  /// Zkopíruje do buffer data z načtených segmentů, případně počká na jejich načtení
+  size_t serve(char* buffer, size_t bytes, offset_t offset);
+
+  /// Zahájí čtení dalšího okna za pozicí pos, pokud je volný segment
+  void schedule(offset_t pos);
+
+  /// Zahodí načtená data a zmenší okno na minimum
+  void reset();
+
+  /// Čte data souboru z ovladače pod zámkem archivu
+  int readDriver(char* buffer, size_t bytes, offset_t offset);
+};
+
+#endif
@@ -0,0 +1,86 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     File implementing cache for content of small files
+ * Modified: 04/2012
+ */
+
+#include <cstring>
+#include <new>
+
+#include "smallcache.hpp"
+
+offset_t SmallFileCache::LIMIT = 0;
+offset_t SmallFileCache::FILE_LIMIT = 8*1024;
+offset_t SmallFileCache::total_used = 0;
+pthread_mutex_t SmallFileCache::total_mux = PTHREAD_MUTEX_INITIALIZER;
+
+SmallFileCache::SmallFileCache()
+  : arena_used(ARENA_SIZE),
+    used(0) {
+}
+
+SmallFileCache::~SmallFileCache() {
+  for (vector<char*>::iterator it = arenas.begin(); it != arenas.end(); ++it)
+    delete[] (*it);
+
+  pthread_mutex_lock(&total_mux);
+  total_used -= used;
+  pthread_mutex_unlock(&total_mux);
+}
+
+bool SmallFileCache::accepts(offset_t size) const {
+  if (LIMIT <= 0 || size <= 0 || size > FILE_LIMIT) return false;
+  return (total_used + size <= LIMIT);
+}
+
+bool SmallFileCache::charge(offset_t bytes) {
+  bool ret = false;
+  pthread_mutex_lock(&total_mux);
+  if (total_used + bytes <= LIMIT) {
+    total_used += bytes;
+    ret = true;
+  }
+  pthread_mutex_unlock(&total_mux);
+  return ret;
+}
+
+const char* SmallFileCache::store(const char* data, size_t len) {
+  if (!accepts(len)) return NULL;
+
+  /* Soubory větší než aréna dostanou vlastní blok, aktuální aréna zůstává */
+  if (len > ARENA_SIZE) {
+    if (!charge(len)) return NULL;
+    char* block = new (nothrow) char[len];
+    if (block == NULL) {
+      pthread_mutex_lock(&total_mux);
+      total_used -= len;
+      pthread_mutex_unlock(&total_mux);
+      return NULL;
+    }
+    used += len;
+    arenas.insert(arenas.end()-(arenas.empty()?0:1), block);
+    memcpy(block, data, len);
+    return block;
+  }
+
+  /* Do rozpočtu se započítávají celé arény */
+  if (arena_used + len > ARENA_SIZE) {
+    if (!charge(ARENA_SIZE)) return NULL;
+    char* arena = new (nothrow) char[ARENA_SIZE];
+    if (arena == NULL) {
+      pthread_mutex_lock(&total_mux);
+      total_used -= ARENA_SIZE;
+      pthread_mutex_unlock(&total_mux);
+      return NULL;
+    }
+    used += ARENA_SIZE;
+    arenas.push_back(arena);
+    arena_used = 0;
+  }
+
+  char* ptr = arenas.back() + arena_used;
+  memcpy(ptr, data, len);
+  arena_used += len;
+  return ptr;
+}
@@ -0,0 +1,83 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     Header file for smallcache.cpp
+ * Modified: 04/2012
+ */
+
+#ifndef SMALL_CACHE_HPP
+#define SMALL_CACHE_HPP
+
+#include <vector>
+#include <cstddef>
+#include <pthread.h>
+
+#include "bufferiface.hpp"
+
+using namespace std;
+
+/// Cache obsahu malých souborů
+/** \class SmallFileCache
+ * Ukládá obsah malých souborů, který ovladač archivu přečte již během
+ * budování filesystému (např. při průchodu tar.gz archivem). Data jsou
+ * ukládána těsně za sebou do větších bloků (arén), takže jeden soubor
+ * nestojí žádnou samostatnou alokaci.
+ *
+ * Celková velikost všech cache (napříč všemi FileSystémy) je omezena
+ * rozpočtem LIMIT. Cache se uvolňuje až spolu s FileSystémem.
+ */
+class SmallFileCache {
+public:
+  /// Celkový rozpočet všech cache v bytech, 0 cache vypíná
+  static offset_t LIMIT;
+
+  /// Soubory větší než FILE_LIMIT bytů se do cache neukládají
+  static offset_t FILE_LIMIT;
+
+  SmallFileCache();
+
+  /**
+   * Destruktor uvolní arény a vrátí jejich velikost do celkového rozpočtu.
+   */
+  ~SmallFileCache();
+
+  /**
+   * Vrací true, pokud má smysl se pokusit uložit soubor o velikosti size.
+   * Neznamená to, že následné uložení musí uspět.
+   */
+  bool accepts(offset_t size) const;
+
+  /**
+   * Zkopíruje len bytů z data do arény.
+   * @returns ukazatel na uložená data nebo NULL, pokud by byl překročen
+   *          rozpočet
+   */
+  const char* store(const char* data, size_t len);
+
+  /// Počet bytů obsazených touto cache
+  inline offset_t size() const {
+    return used;
+  }
+
+private:
+  /// Velikost jedné arény
+  static const size_t ARENA_SIZE = 64*1024;
+
+  /// Aktuálně obsazené místo ve všech cache
+  static offset_t total_used;
+  static pthread_mutex_t total_mux;
+
+  /// Alokované arény, data se přidávají vždy do poslední z nich
+  vector<char*> arenas;
+
+  /// Počet obsazených bytů v poslední aréně
+  size_t arena_used;
+
+  /// Počet bytů odebraných z rozpočtu touto cache
+  offset_t used;
+
+  /// Odebere bytes z celkového rozpočtu, pokud je to možné
+  static bool charge(offset_t bytes);
+};
+
+#endif
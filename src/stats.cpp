@@ -0,0 +1,125 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     File implementing periodic writing of statistics
+ * Modified: 04/2012
+ */
+
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <sys/time.h>
+
+#include "stats.hpp"
+
+char* Stats::PATH = NULL;
+unsigned Stats::INTERVAL = 5;
+Stats* Stats::global_stats = NULL;
+pthread_mutex_t Stats::global_mux = PTHREAD_MUTEX_INITIALIZER;
+
+Stats* Stats::global() {
+  pthread_mutex_lock(&global_mux);
+  if (global_stats == NULL)
+    global_stats = new Stats;
+  pthread_mutex_unlock(&global_mux);
+  return global_stats;
+}
+
+void Stats::destroyGlobal() {
+  pthread_mutex_lock(&global_mux);
+  delete global_stats;
+  global_stats = NULL;
+  pthread_mutex_unlock(&global_mux);
+}
+
+Stats::Stats()
+  : running(false),
+    stopping(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+}
+
+Stats::~Stats() {
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+
+  if (running) pthread_join(thread, NULL);
+
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+void Stats::add(StatsSource* source) {
+  pthread_mutex_lock(&mutex);
+  sources.push_back(source);
+  pthread_mutex_unlock(&mutex);
+}
+
+void Stats::remove(StatsSource* source) {
+  pthread_mutex_lock(&mutex);
+  vector<StatsSource*>::iterator it = find(sources.begin(), sources.end(), source);
+  if (it != sources.end()) sources.erase(it);
+  pthread_mutex_unlock(&mutex);
+}
+
+bool Stats::start() {
+  if (PATH == NULL || running) return false;
+
+  running = (pthread_create(&thread, NULL, run, this) == 0);
+  if (!running) cerr << "Stats: cannot create thread" << endl;
+  return running;
+}
+
+bool Stats::write() {
+  string tmp_path(PATH);
+  tmp_path += ".tmp";
+
+  ofstream out(tmp_path.c_str(), ios::out | ios::trunc);
+  if (!out) return false;
+
+  out << "time " << time(NULL) << '\n';
+
+  /* Zdroj nelze odregistrovat během zápisu */
+  pthread_mutex_lock(&mutex);
+  for (vector<StatsSource*>::iterator it = sources.begin(); it != sources.end(); ++it)
+    (*it)->report(out);
+  pthread_mutex_unlock(&mutex);
+
+  out.close();
+  if (out.fail()) return false;
+
+  return rename(tmp_path.c_str(), PATH) == 0;
+}
+
+void* Stats::run(void* data) {
+  Stats* stats = reinterpret_cast<Stats*>(data);
+  struct timeval now;
+  struct timespec deadline;
+  bool error_reported = false;
+
+  pthread_mutex_lock(&stats->mutex);
+  while (!stats->stopping) {
+    pthread_mutex_unlock(&stats->mutex);
+    if (!stats->write() && !error_reported) {
+      cerr << "Stats: cannot write " << PATH << endl;
+      error_reported = true;
+    }
+    pthread_mutex_lock(&stats->mutex);
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + INTERVAL;
+    deadline.tv_nsec = now.tv_usec * 1000;
+    while (!stats->stopping &&
+           pthread_cond_timedwait(&stats->cond, &stats->mutex, &deadline) != ETIMEDOUT)
+      ;
+  }
+  pthread_mutex_unlock(&stats->mutex);
+
+  return NULL;
+}
@@ -0,0 +1,74 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     Header file for stats.cpp
+ * Modified: 04/2012
+ */
+
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <ostream>
+#include <vector>
+#include <pthread.h>
+
+using namespace std;
+
+/** \class StatsSource
+ * Objekt poskytující statistiky. Metoda report() zapisuje do out řádky
+ * ve tvaru "název hodnota".
+ */
+class StatsSource {
+public:
+  virtual ~StatsSource() {}
+  virtual void report(ostream& out) = 0;
+};
+
+/// Periodický zápis statistik do souboru
+/** \class Stats
+ * Pokud je nastavena cesta PATH, zapisuje vlákno každých INTERVAL sekund
+ * statistiky všech registrovaných zdrojů do souboru. Soubor je zapsán
+ * vedle a přejmenován, čtenář tedy nikdy neuvidí neúplný obsah.
+ */
+class Stats {
+public:
+  /// Cesta k souboru se statistikami, NULL zápis vypíná
+  static char* PATH;
+
+  /// Perioda zápisu v sekundách
+  static unsigned INTERVAL;
+
+  /// Globální objekt, vytvořený při prvním použití
+  static Stats* global();
+
+  /// Zastaví zápis a uvolní globální objekt
+  static void destroyGlobal();
+
+  Stats();
+  ~Stats();
+
+  void add(StatsSource* source);
+  void remove(StatsSource* source);
+
+  /// Spustí vlákno zapisující statistiky (až po démonizaci)
+  bool start();
+
+  /// Zapíše statistiky do souboru PATH
+  bool write();
+
+private:
+  vector<StatsSource*> sources;
+  pthread_t thread;
+  bool running;
+  bool stopping;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  static Stats* global_stats;
+  static pthread_mutex_t global_mux;
+
+  static void* run(void* stats);
+};
+
+#endif
@@ -0,0 +1,146 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     Buffer keeping the head of a file in memory and the rest
+ *           in a temporary file.
+ * Modified: 04/2012
+ */
+
+#include "tieredbuffer.hpp"
+
+/* Invariant: tail existuje právě tehdy, když _length > split, pak má
+ * head délku split a tail délku _length - split */
+
+TieredBuffer::TieredBuffer(offset_t len, offset_t _split)
+  : head(NULL),
+    tail(NULL),
+    split(_split),
+    _length(len) {
+  head = new MemBuffer(len < split ? len : split);
+  if (len > split) {
+    try {
+      tail = new FileBuffer(len - split);
+    }
+    catch (...) {
+      delete head;
+      throw;
+    }
+  }
+}
+
+TieredBuffer::TieredBuffer(MemBuffer* _head, offset_t _split)
+  : head(_head),
+    tail(NULL),
+    split(_split),
+    _length(_head->length()) {
+  if (split < _length) split = _length;
+}
+
+TieredBuffer::TieredBuffer(const TieredBuffer& old)
+  : head(NULL),
+    tail(NULL),
+    split(old.split),
+    _length(old._length) {
+  head = new MemBuffer(*old.head);
+  if (old.tail != NULL) tail = new FileBuffer(*old.tail);
+}
+
+TieredBuffer::~TieredBuffer() {
+  delete head;
+  delete tail;
+}
+
+size_t TieredBuffer::read(char* buffer, offset_t bytes, offset_t offset) const {
+  if (offset >= _length) return 0;
+  if (offset + bytes > _length) bytes = _length - offset;
+
+  offset_t end = offset + bytes;
+  size_t done = 0;
+  if (offset < split) {
+    offset_t len = ((end < split) ? end : split) - offset;
+    size_t got = head->read(buffer, len, offset);
+    if (offset_t(got) != len) return got;
+    buffer += len;
+    offset += len;
+    done = len;
+  }
+  if (offset < end) {
+    /* Chyba čtení souboru je předána dál, jinak jen skutečně přečtená data */
+    size_t got = tail->read(buffer, end - offset, offset - split);
+    if (ssize_t(got) < 0) return got;
+    done += got;
+  }
+  return done;
+}
+
+size_t TieredBuffer::slices(offset_t offset, size_t bytes, vector<BufferSlice>& out) const {
+  if (offset >= _length) return 0;
+  if (offset_t(offset + bytes) > _length) bytes = _length - offset;
+
+  offset_t end = offset + bytes;
+  if (offset < split) {
+    offset_t len = ((end < split) ? end : split) - offset;
+    if (offset_t(head->slices(offset, len, out)) != len) return 0;
+    offset += len;
+  }
+  if (offset < end) tail->slices(offset - split, end - offset, out);
+  return bytes;
+}
+
+size_t TieredBuffer::write(const char* data, offset_t length, offset_t offset) {
+  if (length == 0) return 0;
+
+  offset_t end = offset + length;
+  if (end > split && tail == NULL) {
+    head->truncate(split);
+    tail = new FileBuffer(0);
+  }
+
+  if (offset < split) {
+    offset_t len = ((end < split) ? end : split) - offset;
+    head->write(data, len, offset);
+    data += len;
+    offset += len;
+  }
+  if (offset < end) tail->write(data, end - offset, offset - split);
+
+  if (end > _length) _length = end;
+  return length;
+}
+
+void TieredBuffer::truncate(offset_t size) {
+  if (size <= split) {
+    delete tail;
+    tail = NULL;
+    head->truncate(size);
+  } else {
+    head->truncate(split);
+    if (tail == NULL) tail = new FileBuffer(size - split);
+    else tail->truncate(size - split);
+  }
+  _length = size;
+}
+
+offset_t TieredBuffer::seekData(offset_t offset) const {
+  if (offset < split) {
+    offset_t data = head->seekData(offset);
+    if (data < head->length()) return data;
+    offset = split;
+  }
+  if (tail == NULL || offset >= _length) return _length;
+  return split + tail->seekData(offset - split);
+}
+
+offset_t TieredBuffer::seekHole(offset_t offset) const {
+  if (offset < split) {
+    offset_t hole = head->seekHole(offset);
+    if (hole < head->length() || tail == NULL) return hole;
+    offset = split;
+  }
+  if (tail == NULL || offset >= _length) return _length;
+  return split + tail->seekHole(offset - split);
+}
+
+size_t TieredBuffer::freeze(time_t before, unsigned ratio) {
+  return head->freeze(before, ratio);
+}
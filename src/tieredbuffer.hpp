@@ -0,0 +1,60 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     Header file for tieredbuffer.cpp
+ * Modified: 04/2012
+ */
+
+#ifndef TIERED_BUFFER_HPP
+#define TIERED_BUFFER_HPP
+
+#include "membuffer.hpp"
+#include "filebuffer.hpp"
+
+/// Buffer s počátkem v paměti a zbytkem v souboru
+/** \class TieredBuffer
+ * Data před pozicí split jsou uložena v paměťovém bufferu (hlavička
+ * souboru bývá čtena nejčastěji), data za ní v souborovém bufferu, který
+ * je vytvořen až prvním zápisem za split. Pozice v souborovém bufferu jsou
+ * relativní vůči split. Naposledy použité části souboru drží v paměti
+ * jádro (soubor je namapován).
+ */
+class TieredBuffer: public BufferIface {
+public:
+  /// Buffer délky len s hranicí split
+  /** @throws std::bad_alloc, int errno */
+  TieredBuffer(offset_t len, offset_t _split);
+
+  /// Převezme paměťový buffer _head jako počátek bufferu do pozice _split
+  TieredBuffer(MemBuffer* _head, offset_t _split);
+
+  /// Sdílí data obou částí (copy-on-write)
+  TieredBuffer(const TieredBuffer& old);
+
+  ~TieredBuffer();
+
+  size_t read(char* buffer, offset_t bytes, offset_t offset) const;
+  size_t slices(offset_t offset, size_t bytes, vector<BufferSlice>& out) const;
+  size_t write(const char* data, offset_t length, offset_t offset);
+  void truncate(offset_t size);
+  offset_t seekData(offset_t offset) const;
+  offset_t seekHole(offset_t offset) const;
+
+  /// Komprimuje nepoužívané bloky paměťové části, viz MemBuffer::freeze
+  size_t freeze(time_t before, unsigned ratio);
+
+  inline offset_t length() {
+    return _length;
+  }
+
+private:
+  MemBuffer* head;
+  /// Data za pozicí split, NULL dokud za ni nebylo zapsáno
+  FileBuffer* tail;
+  offset_t split;
+  offset_t _length;
+
+  TieredBuffer& operator=(const TieredBuffer&);
+};
+
+#endif
@@ -0,0 +1,144 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     File implementing watching of a directory for changed files
+ * Modified: 04/2012
+ */
+
+#include <cerrno>
+#include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/inotify.h>
+
+#include "watcher.hpp"
+
+/* Soubor dopsaný, měněný, přesunutý do/z adresáře nebo smazaný */
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+static long long nowMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+DirWatcher::DirWatcher(const char* _dir)
+  : dir(_dir),
+    inotify_fd(-1),
+    running(false) {
+  wake_pipe[0] = wake_pipe[1] = -1;
+}
+
+DirWatcher::~DirWatcher() {
+  stop();
+}
+
+bool DirWatcher::start() {
+  if (running) return true;
+
+  inotify_fd = inotify_init();
+  if (inotify_fd == -1 || inotify_add_watch(inotify_fd, dir.c_str(), WATCH_EVENTS) == -1 ||
+      pipe(wake_pipe) != 0) {
+    cerr << "Watcher: cannot watch " << dir << endl;
+    stop();
+    return false;
+  }
+
+  running = (pthread_create(&thread, NULL, run, this) == 0);
+  if (!running) {
+    cerr << "Watcher: cannot create thread" << endl;
+    stop();
+  }
+  return running;
+}
+
+void DirWatcher::stop() {
+  if (running) {
+    char wake = 0;
+    while (::write(wake_pipe[1], &wake, 1) == -1 && errno == EINTR);
+    pthread_join(thread, NULL);
+    running = false;
+  }
+
+  settling.clear();
+  if (inotify_fd != -1) ::close(inotify_fd);
+  if (wake_pipe[0] != -1) ::close(wake_pipe[0]);
+  if (wake_pipe[1] != -1) ::close(wake_pipe[1]);
+  inotify_fd = wake_pipe[0] = wake_pipe[1] = -1;
+}
+
+void* DirWatcher::run(void* watcher) {
+  reinterpret_cast<DirWatcher*>(watcher)->loop();
+  return NULL;
+}
+
+/* DirWatcher::flushSettled
+ * - soubor se během čekání mohl změnit znovu, changed() je proto volán
+ *   pro kopii cesty až po odstranění ze settling
+ */
+int DirWatcher::flushSettled() {
+  long long now = nowMs();
+  long long next = -1;
+
+  map<string, long long>::iterator it = settling.begin();
+  while (it != settling.end()) {
+    if (it->second <= now) {
+      string path = it->first;
+      settling.erase(it++);
+      changed(path);
+    } else {
+      if (next == -1 || it->second - now < next) next = it->second - now;
+      ++it;
+    }
+  }
+  return int(next);
+}
+
+/* DirWatcher::loop
+ * - změny adresářů (např. úložiště změn archivu) jsou přeskočeny
+ * - při přetečení fronty inotify jsou události ztraceny, vypíše se varování
+ * - poll čeká nejdéle do ohlášení nejbližšího měněného souboru
+ */
+void DirWatcher::loop() {
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd fds[2];
+  fds[0].fd = inotify_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = wake_pipe[0];
+  fds[1].events = POLLIN;
+
+  for (;;) {
+    int ready = poll(fds, 2, flushSettled());
+    if (ready == -1) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (ready == 0) continue;
+    if (fds[1].revents) break;
+
+    ssize_t len = ::read(inotify_fd, events, sizeof(events));
+    if (len == -1) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      break;
+    }
+
+    struct inotify_event* event;
+    for (char* ptr = events; ptr < events + len; ptr += sizeof(struct inotify_event) + event->len) {
+      event = reinterpret_cast<struct inotify_event*>(ptr);
+
+      if (event->mask & IN_Q_OVERFLOW)
+        cerr << "Watcher: some changes in " << dir << " were missed" << endl;
+      if (event->len == 0 || (event->mask & IN_ISDIR)) continue;
+
+      string path = dir + "/" + event->name;
+      if ((event->mask & WATCH_EVENTS) == IN_MODIFY) {
+        settling[path] = nowMs() + SETTLE_MS;
+        continue;
+      }
+      settling.erase(path);
+      changed(path);
+    }
+  }
+}
@@ -0,0 +1,72 @@
+/* Project:  ArchiveFS
+ * Author:   Michal SAMEK
+ * Email:    xsamek01@fit.vutbr.cz
+ * Desc:     Header file for watcher.cpp
+ * Modified: 04/2012
+ */
+
+#ifndef WATCHER_HPP
+#define WATCHER_HPP
+
+#include <string>
+#include <map>
+#include <pthread.h>
+
+using namespace std;
+
+/// Sledování změn souborů v adresáři (inotify)
+/** \class DirWatcher
+ * Vlákno čeká na události inotify nad adresářem a pro každý zapsaný,
+ * přesunutý nebo smazaný soubor volá changed(). Sledován je adresář, nikoli
+ * jednotlivé soubory - zachyceny jsou tak i soubory nahrazené přejmenováním.
+ *
+ * Soubor měněný bez uzavření (IN_MODIFY) je ohlášen až poté, co se
+ * SETTLE_MS milisekund nezměnil, zápis po částech tak vyvolá jediné
+ * changed(); uzavření, přesun nebo smazání souboru je ohlášeno ihned.
+ */
+class DirWatcher {
+public:
+  DirWatcher(const char* _dir);
+
+  /// Potomek musí vlákno zastavit (stop()) již ve svém destruktoru
+  virtual ~DirWatcher();
+
+  /// Spustí vlákno (až po démonizaci)
+  bool start();
+
+  /// Zastaví vlákno, po návratu již není changed() volán
+  void stop();
+
+  /// Doba klidu souboru měněného bez uzavření, po které je ohlášen
+  static const unsigned SETTLE_MS = 500;
+
+protected:
+  /// Volá vlákno pro změněný soubor s cestou path
+  virtual void changed(const string& path) = 0;
+
+private:
+  string dir;
+  int inotify_fd;
+
+  /// Zápisem do roury je vlákno probuzeno k ukončení
+  int wake_pipe[2];
+
+  pthread_t thread;
+  bool running;
+
+  /// Soubory změněné bez uzavření a čas (ms), kdy budou ohlášeny;
+  /// používá jen vlákno sledování
+  map<string, long long> settling;
+
+  static void* run(void* watcher);
+  void loop();
+
+  /// Ohlásí soubory, jejichž doba klidu uplynula, vrací čas do dalšího (ms)
+  /// nebo -1
+  int flushSettled();
+
+  DirWatcher(const DirWatcher&);
+  DirWatcher& operator=(const DirWatcher&);
+};
+
+#endif